@@ -1,234 +1,644 @@
 #pragma once
 
+#include <cstdint>
+#include <vector>
+
 #include <nes_component.h>
 
 class nes_system;
+class nes_memory;
+class nes_state_writer;
+class nes_state_reader;
+struct blip_t;
+
+using namespace std;
+
+enum nes_apu_channel
+{
+    nes_apu_channel_pulse_1,
+    nes_apu_channel_pulse_2,
+    nes_apu_channel_triangle,
+    nes_apu_channel_noise,
+    nes_apu_channel_dmc,
+    nes_apu_channel_count
+};
 
-class nes_audio_device
+//
+// Turns channel outputs into samples
+//
+// Channels report their output level (0~15, or 0~127 for DMC) only when it changes. Within a frame the changes
+// are simply queued up - one list per channel, already in time order - and end_frame merges them, runs them
+// through the non-linear mixer, and feeds every change of the mixed output into blip_buf as a delta. blip_buf
+// then does band-limited resampling to the output rate, so samples come out in one batch per frame and the
+// cost depends on how often the output changes rather than on how many cycles ran
+// http://wiki.nesdev.com/w/index.php/APU_Mixer
+//
+class nes_apu_mixer
 {
 public :
-    void read_buffer(uint8_t *buf, size_t buf_size)
+    nes_apu_mixer();
+    ~nes_apu_mixer();
+
+    void init();
+
+    //
+    // Start producing samples at sample_rate, or stop with 0. Without samples nothing gets queued and the
+    // rest of the APU still runs exactly the same
+    //
+    void set_sample_rate(int sample_rate);
+    int sample_rate() { return _sample_rate; }
+
+    //
+    // Produce ratio times as many samples for the same emulated time, by running blip_buf's clock that much
+    // slower. Meant for small nudges (well under 1%) that keep the audio buffer level steady when emulation and
+    // the audio device don't run at exactly the same speed - the pitch change isn't noticeable
+    //
+    void set_rate_adjust(double ratio);
+    double rate_adjust() { return _rate_adjust; }
+
+    // time is in CPU cycles
+    void set_level(nes_apu_channel channel, int64_t time, uint8_t level)
     {
-        if (_write_offset == _read_offset && !_buf_full)
-        {
-            memset(buf, 0, buf_size);
-            NES_TRACE1("[NES_APU] Not enough buffered audio. " << buf_size << " filled with silence.");
+        if (_levels[channel] == level)
             return;
-        }
 
-        _buf_full = false;
-        if (_write_offset > _read_offset)
-        {
-            //  read          write
-            //   ^             ^
-            // --------------------
-            size_t remaining_size = _write_offset - _read_offset;
-            size_t copy_size = remaining_size > buf_size ? buf_size : remaining_size;
-
-            memcpy_s(buf, buf_size, _audio_buffer.data() + _read_offset, copy_size);
-
-            // wrap to 0 if _read_offset is at the end
-            _read_offset = (_read_offset + copy_size) % _audio_buffer.size();
-            if (buf_size > remaining_size)
-            {
-                buf_size -= remaining_size;
-                buf += remaining_size;
-                memset(buf, 0, buf_size);
-                NES_TRACE1("[NES_APU] Not enough buffered audio. " << buf_size << " filled with silence.");
-
-                return;
-            }
-        }
-        else
-        {
-            // write         read
-            //   ^             ^
-            // --------------------
-            size_t remaining_size = _audio_buffer.size() - _read_offset;
-            size_t first_copy = remaining_size > buf_size ? buf_size : remaining_size;
-            memcpy_s(buf, buf_size, _audio_buffer.data() + _read_offset, first_copy);
-            buf_size -= first_copy;
-            buf += first_copy;
-            if (buf_size == 0)
-            {
-                _read_offset += first_copy;
-                return;
-            }
-
-            memcpy_s(buf, buf_size, _audio_buffer.data(), _write_offset > buf_size ? buf_size : _write_offset);
-            if (buf_size > _write_offset)
-            {
-                buf_size -= _write_offset;
-                buf += _write_offset;
-                memset(buf, 0, buf_size);
-                NES_TRACE1("[NES_APU] Not enough buffered audio. " << buf_size << " filled with silence.");
-
-                _read_offset = _write_offset;
-
-                return;
-            }
-
-            _read_offset += buf_size;
-        }
+        _levels[channel] = level;
+        if (_blip)
+            _events[channel].push_back({ uint32_t(time - _frame_start), level });
     }
 
-    void write_buffer(const uint8_t *buf, size_t buf_size)
+    // Turn everything queued up to time (in CPU cycles) into samples
+    void end_frame(int64_t time);
+
+    // Start the next frame at time without producing anything - such as after loading a savestate
+    void reset_frame(int64_t time);
+
+    int samples_available();
+
+    // Read up to count mono samples - returns the number of samples read
+    int read_samples(int16_t *buf, int count);
+
+private :
+    int mix(const uint8_t *levels)
     {
-        if (_buf_full)
+        return _pulse_table[levels[nes_apu_channel_pulse_1] + levels[nes_apu_channel_pulse_2]] +
+            _tnd_table[3 * levels[nes_apu_channel_triangle] + 2 * levels[nes_apu_channel_noise] + levels[nes_apu_channel_dmc]];
+    }
+
+private :
+    struct nes_apu_level_change
+    {
+        uint32_t time;                              // CPU cycles since _frame_start
+        uint8_t level;
+    };
+
+    blip_t *_blip;
+    int _sample_rate;
+    double _rate_adjust;                            // see set_rate_adjust
+    int _buffer_size;                               // in samples
+    int64_t _frame_start;                           // in CPU cycles
+
+    uint8_t _levels[nes_apu_channel_count];         // latest levels reported by channels
+    uint8_t _mixed_levels[nes_apu_channel_count];   // levels as of the last change fed into blip_buf
+    int _amplitude;                                 // mixed output as of the last change fed into blip_buf
+    vector<nes_apu_level_change> _events[nes_apu_channel_count];
+    vector<int16_t> _discard;                       // samples nobody read in time
+
+    int _pulse_table[31];
+    int _tnd_table[203];
+};
+
+//
+// Volume envelope of pulse and noise channels
+// http://wiki.nesdev.com/w/index.php/APU_Envelope
+//
+class nes_apu_envelope
+{
+public :
+    void init()
+    {
+        _start = _loop = _constant_volume = false;
+        _volume = _divider = _decay = 0;
+    }
+
+    void write(uint8_t val)
+    {
+        _loop = val & 0x20;
+        _constant_volume = val & 0x10;
+        _volume = val & 0xf;
+    }
+
+    void restart() { _start = true; }
+
+    // quarter frame
+    void clock()
+    {
+        if (_start)
         {
-            NES_TRACE1("[NES_APU] Buffer full - " << buf_size << " bytes lost");
-            return;
+            _start = false;
+            _decay = 15;
+            _divider = _volume;
         }
-
-        if (_write_offset >= _read_offset)
+        else if (_divider == 0)
         {
-            //  read          write
-            //   ^             ^
-            // --------------------
-            size_t remaining_size = _audio_buffer.size() - _write_offset;
-            if (remaining_size >= buf_size)
-            {
-                memcpy_s(_audio_buffer.data() + _write_offset, remaining_size, buf, buf_size);
-
-                // handle special case remaining_size == buf_size
-                _write_offset = (_write_offset + buf_size) % _audio_buffer.size();
-                if (_write_offset == _read_offset)
-                    _buf_full = true;
-            }
-            else
-            {
-                memcpy_s(_audio_buffer.data() + _write_offset, remaining_size, buf, remaining_size);
-
-                buf_size -= remaining_size;
-                if (_read_offset < buf_size)
-                {
-                    NES_TRACE1("[NES_APU] Buffer full - " << buf_size << " bytes lost");
-                    return;
-                }
-
-                memcpy_s(_audio_buffer.data(), buf_size, buf + remaining_size, buf_size);
-
-                _write_offset = buf_size;
-            }
+            _divider = _volume;
+            if (_decay > 0)
+                _decay--;
+            else if (_loop)
+                _decay = 15;
         }
         else
         {
-            // write         read
-            //   ^             ^
-            // --------------------
-            size_t remaining_size = _read_offset - _write_offset;
-            if (remaining_size < buf_size)
-            {
-                NES_TRACE1("[NES_APU] Buffer full - " << buf_size << " bytes lost");
-                return;
-            }
-
-            memcpy_s(_audio_buffer.data() + _write_offset, remaining_size, buf, buf_size);
-
-            _write_offset += buf_size;
-
-            if (_write_offset == _read_offset)
-                _buf_full = true;
+            _divider--;
         }
     }
 
+    uint8_t output() { return _constant_volume ? _volume : _decay; }
+
+    void save_state(nes_state_writer &writer);
+    void load_state(nes_state_reader &reader);
+
 private :
-    bool            _buf_full;              // distingush full or empty when begin == end
-    size_t          _write_offset;          // end of data - increment when writing
-    size_t          _read_offset;           // begin of data - increment when reading
-    vector<uint8_t> _audio_buffer;          // circular audio buffer of desired size
+    bool _start;                // restart at next clock
+    bool _loop;                 // loop back to 15 after reaching 0 (same bit as length counter halt)
+    bool _constant_volume;      // use _volume directly instead of _decay
+    uint8_t _volume;            // constant volume, or the divider period when decaying
+    uint8_t _divider;
+    uint8_t _decay;             // 15 -> 0
 };
 
-class nes_apu_mixer
+//
+// Length counter that silences the channel once it counts down to 0
+// http://wiki.nesdev.com/w/index.php/APU_Length_Counter
+//
+class nes_apu_length_counter
 {
-    
+public :
+    void init()
+    {
+        _enabled = _halt = false;
+        _counter = 0;
+    }
+
+    // $4015 - disabling clears the counter right away
+    void set_enabled(bool enabled)
+    {
+        _enabled = enabled;
+        if (!enabled)
+            _counter = 0;
+    }
+
+    void set_halt(bool halt) { _halt = halt; }
+
+    void load(uint8_t index)
+    {
+        if (_enabled)
+            _counter = s_length_table[index & 0x1f];
+    }
+
+    // half frame
+    void clock()
+    {
+        if (_counter > 0 && !_halt)
+            _counter--;
+    }
+
+    bool is_active() { return _counter > 0; }
+
+    void save_state(nes_state_writer &writer);
+    void load_state(nes_state_reader &reader);
+
+private :
+    bool _enabled;
+    bool _halt;
+    uint8_t _counter;
+
+private :
+    static const uint8_t s_length_table[32];
 };
 
 // 
 // Pulse channel that produce square wave
+// http://wiki.nesdev.com/w/index.php/APU_Pulse
 //
 class nes_apu_pulse_channel
 {
 public :
+    nes_apu_pulse_channel(nes_apu_channel channel)
+        :_channel(channel)
+    {
+    }
+
     void init()
     {
-        _cur_timer = 0;
+        _envelope.init();
+        _length_counter.init();
+
+        _duty_cycle = 0;
+        _sequence = 0;
         _timer = 0;
+        _next_clock = 0;
+
+        _sweep_enabled = _sweep_negate = _sweep_reload = false;
+        _sweep_period = _sweep_shift = _sweep_divider = 0;
     }
 
+    // $4000 / $4004
     void write_duty(uint8_t val)
     {
-        _duty_cycle = (val & 0xc0) >> 6;
-        _length_counter_halt = val & 0x20;
-        _constant_volume = val & 0x10;
-        _volume = val & 0x7;
+        _duty_cycle = val >> 6;
+        _length_counter.set_halt(val & 0x20);
+        _envelope.write(val);
     }
 
+    // $4001 / $4005
     void write_sweep(uint8_t val)
     {
         _sweep_enabled = val & 0x80;
-        _period = (val & 0x70) >> 4;
-        _negate = val & 0x8;
-        _shift_count = val & 0x7;
+        _sweep_period = (val & 0x70) >> 4;
+        _sweep_negate = val & 0x8;
+        _sweep_shift = val & 0x7;
+        _sweep_reload = true;
     }
 
-    void write_timer(uint8_t val)
+    // $4002 / $4006
+    void write_timer_low(uint8_t val)
     {
-        _timer |= val;
+        _timer = (_timer & 0x700) | val;
     }
 
+    // $4003 / $4007
     void write_length_counter(uint8_t val)
     {
         _timer = (_timer & 0xff) | ((val & 0x7) << 8);
-        _length_counter = val >> 3;
+        _length_counter.load(val >> 3);
+
+        // sequencer restarts but the timer keeps counting
+        _sequence = 0;
+        _envelope.restart();
+    }
+
+    void set_enabled(bool enabled) { _length_counter.set_enabled(enabled); }
+    bool is_active() { return _length_counter.is_active(); }
+
+    void quarter_frame() { _envelope.clock(); }
+
+    void half_frame()
+    {
+        _length_counter.clock();
+
+        if (_sweep_divider == 0 && _sweep_enabled && _sweep_shift > 0 && !is_muted())
+            _timer = target_timer();
+
+        if (_sweep_divider == 0 || _sweep_reload)
+        {
+            _sweep_divider = _sweep_period;
+            _sweep_reload = false;
+        }
+        else
+        {
+            _sweep_divider--;
+        }
+    }
+
+    // Run the timer up to (but not including) CPU cycle <to>
+    void run(nes_apu_mixer &mixer, int64_t to);
+
+    void update_output(nes_apu_mixer &mixer, int64_t time) { mixer.set_level(_channel, time, output()); }
+
+    void save_state(nes_state_writer &writer);
+    void load_state(nes_state_reader &reader);
+
+private :
+    uint16_t target_timer()
+    {
+        int change = _timer >> _sweep_shift;
+        if (!_sweep_negate)
+            return uint16_t(_timer + change);
+
+        // pulse 1 negates with one's complement
+        int target = _timer - change - (_channel == nes_apu_channel_pulse_1 ? 1 : 0);
+        return target < 0 ? 0 : uint16_t(target);
+    }
+
+    // Sweep unit mutes the channel even when it is disabled
+    bool is_muted() { return _timer < 8 || target_timer() > 0x7ff; }
 
-        // timer gets immediately reset
-        _cur_timer = _timer;
+    bool is_silent() { return !_length_counter.is_active() || is_muted() || _envelope.output() == 0; }
+
+    uint8_t output()
+    {
+        if (!s_duty_cycle[_duty_cycle][_sequence] || is_silent())
+            return 0;
+
+        return _envelope.output();
     }
 
 private :
+    nes_apu_channel _channel;
+
+    nes_apu_envelope _envelope;
+    nes_apu_length_counter _length_counter;
+
     // duty
     uint8_t _duty_cycle;        // which of the duty cycle it is using
-    bool _length_counter_halt;  // length counter halt
-    bool _constant_volume;      // true if using constant volume, otherwise use volume from envelop
-    uint8_t _volume;            // constant volume (if _use_envelop is false), otherwise it is the period of envelop
+    uint8_t _sequence;          // position in the duty cycle
 
-    // length counter
-    uint16_t _cur_timer;
+    // timer
     uint16_t _timer;            // internal waveform generator timer goes from t -> 0 -> t
-    uint8_t _length_counter;    // length counter
-    uint8_t _divider;
+    int64_t _next_clock;        // CPU cycle where the sequencer moves next
 
     // sweep
     bool _sweep_enabled;
-    uint8_t _period;
-    bool _negate;
-    uint8_t _shift_count;
+    uint8_t _sweep_period;
+    bool _sweep_negate;
+    uint8_t _sweep_shift;
+    bool _sweep_reload;
+    uint8_t _sweep_divider;
 
 private :
-    static uint8_t s_duty_cycle[4][8];
+    static const uint8_t s_duty_cycle[4][8];
 };
 
+//
+// Triangle channel
+// http://wiki.nesdev.com/w/index.php/APU_Triangle
+//
 class nes_apu_triangle_channel
 {
+public :
+    void init()
+    {
+        _length_counter.init();
+
+        _control = _linear_reload = false;
+        _linear_reload_value = _linear_counter = 0;
+        _sequence = 0;
+        _timer = 0;
+        _next_clock = 0;
+    }
+
+    // $4008
+    void write_linear_counter(uint8_t val)
+    {
+        _control = val & 0x80;
+        _length_counter.set_halt(_control);
+        _linear_reload_value = val & 0x7f;
+    }
+
+    // $400A
+    void write_timer_low(uint8_t val)
+    {
+        _timer = (_timer & 0x700) | val;
+    }
+
+    // $400B
+    void write_length_counter(uint8_t val)
+    {
+        _timer = (_timer & 0xff) | ((val & 0x7) << 8);
+        _length_counter.load(val >> 3);
+        _linear_reload = true;
+    }
+
+    void set_enabled(bool enabled) { _length_counter.set_enabled(enabled); }
+    bool is_active() { return _length_counter.is_active(); }
+
+    void quarter_frame()
+    {
+        if (_linear_reload)
+            _linear_counter = _linear_reload_value;
+        else if (_linear_counter > 0)
+            _linear_counter--;
+
+        if (!_control)
+            _linear_reload = false;
+    }
+
+    void half_frame() { _length_counter.clock(); }
+
+    void run(nes_apu_mixer &mixer, int64_t to);
+
+    // Stopped triangle holds whatever it was outputting
+    void update_output(nes_apu_mixer &mixer, int64_t time) { mixer.set_level(nes_apu_channel_triangle, time, s_sequence[_sequence]); }
+
+    void save_state(nes_state_writer &writer);
+    void load_state(nes_state_reader &reader);
+
+private :
+    nes_apu_length_counter _length_counter;
+
+    bool _control;                  // length counter halt / linear counter control
+    bool _linear_reload;
+    uint8_t _linear_reload_value;
+    uint8_t _linear_counter;
+
+    uint8_t _sequence;              // position in s_sequence
+    uint16_t _timer;
+    int64_t _next_clock;
+
+private :
+    static const uint8_t s_sequence[32];
 };
 
+//
+// Noise channel - pseudo-random bits from a 15-bit LFSR
+// http://wiki.nesdev.com/w/index.php/APU_Noise
+//
 class nes_apu_noise_channel
 {
+public :
+    void init()
+    {
+        _envelope.init();
+        _length_counter.init();
 
+        _mode = false;
+        _shift = 1;
+        _timer = s_period_table[0];
+        _next_clock = 0;
+    }
+
+    // $400C
+    void write_volume(uint8_t val)
+    {
+        _length_counter.set_halt(val & 0x20);
+        _envelope.write(val);
+    }
+
+    // $400E
+    void write_period(uint8_t val)
+    {
+        _mode = val & 0x80;
+        _timer = s_period_table[val & 0xf];
+    }
+
+    // $400F
+    void write_length_counter(uint8_t val)
+    {
+        _length_counter.load(val >> 3);
+        _envelope.restart();
+    }
+
+    void set_enabled(bool enabled) { _length_counter.set_enabled(enabled); }
+    bool is_active() { return _length_counter.is_active(); }
+
+    void quarter_frame() { _envelope.clock(); }
+    void half_frame() { _length_counter.clock(); }
+
+    void run(nes_apu_mixer &mixer, int64_t to);
+
+    void update_output(nes_apu_mixer &mixer, int64_t time) { mixer.set_level(nes_apu_channel_noise, time, output()); }
+
+    void save_state(nes_state_writer &writer);
+    void load_state(nes_state_reader &reader);
+
+private :
+    bool is_silent() { return !_length_counter.is_active() || _envelope.output() == 0; }
+
+    uint8_t output()
+    {
+        if ((_shift & 1) || is_silent())
+            return 0;
+
+        return _envelope.output();
+    }
+
+private :
+    nes_apu_envelope _envelope;
+    nes_apu_length_counter _length_counter;
+
+    bool _mode;                     // short mode - feedback from bit 6 instead of bit 1
+    uint16_t _shift;                // 15-bit LFSR
+    uint16_t _timer;                // in CPU cycles
+    int64_t _next_clock;
+
+private :
+    static const uint16_t s_period_table[16];
 };
 
+//
+// Delta modulation channel - plays 1-bit delta encoded samples from CPU memory
+// http://wiki.nesdev.com/w/index.php/APU_DMC
+//
+// @TODO - Sample fetches should stall the CPU for up to 4 cycles
+//
 class nes_apu_dmc_channel
 {
+public :
+    void init()
+    {
+        _irq_enabled = _loop = _irq = false;
+        _timer = s_rate_table[0];
+        _next_clock = 0;
+        _output_level = 0;
+
+        _sample_addr = 0xc000;
+        _sample_length = 1;
+        _cur_addr = 0xc000;
+        _bytes_remaining = 0;
+        _buffer = 0;
+        _buffer_empty = true;
+
+        _shift = 0;
+        _bits_remaining = 8;
+        _silence = true;
+    }
+
+    // $4010
+    void write_flags(uint8_t val)
+    {
+        _irq_enabled = val & 0x80;
+        if (!_irq_enabled)
+            _irq = false;
+        _loop = val & 0x40;
+        _timer = s_rate_table[val & 0xf];
+    }
+
+    // $4011
+    void write_direct_load(uint8_t val) { _output_level = val & 0x7f; }
+
+    // $4012
+    void write_sample_addr(uint8_t val) { _sample_addr = 0xc000 | (uint16_t(val) << 6); }
+
+    // $4013
+    void write_sample_length(uint8_t val) { _sample_length = (uint16_t(val) << 4) | 1; }
+
+    // $4015 - enabling starts the sample unless it is still playing
+    void set_enabled(bool enabled, nes_memory *mem)
+    {
+        _irq = false;
+        if (!enabled)
+        {
+            _bytes_remaining = 0;
+        }
+        else if (_bytes_remaining == 0)
+        {
+            _cur_addr = _sample_addr;
+            _bytes_remaining = _sample_length;
+            if (_buffer_empty)
+                fetch(mem);
+        }
+    }
+
+    bool is_active() { return _bytes_remaining > 0; }
+    bool irq() { return _irq; }
+
+    // The earliest CPU cycle where the IRQ may be raised (INT64_MAX if it can't)
+    int64_t next_irq_cycle()
+    {
+        if (!_irq_enabled || _loop || _irq || _bytes_remaining == 0)
+            return INT64_MAX;
+
+        // next byte is fetched when the output unit starts its next cycle
+        return _next_clock + int64_t(_bits_remaining - 1) * _timer;
+    }
+
+    void run(nes_apu_mixer &mixer, nes_memory *mem, int64_t to);
 
+    void update_output(nes_apu_mixer &mixer, int64_t time) { mixer.set_level(nes_apu_channel_dmc, time, _output_level); }
+
+    void save_state(nes_state_writer &writer);
+    void load_state(nes_state_reader &reader);
+
+private :
+    // memory reader fills the sample buffer
+    void fetch(nes_memory *mem);
+
+private :
+    bool _irq_enabled;
+    bool _loop;
+    bool _irq;                      // IRQ flag - $4015 bit 7
+    uint16_t _timer;                // in CPU cycles
+    int64_t _next_clock;
+    uint8_t _output_level;          // 7-bit
+
+    // memory reader
+    uint16_t _sample_addr;
+    uint16_t _sample_length;
+    uint16_t _cur_addr;
+    uint16_t _bytes_remaining;
+    uint8_t _buffer;
+    bool _buffer_empty;
+
+    // output unit
+    uint8_t _shift;
+    uint8_t _bits_remaining;
+    bool _silence;
+
+private :
+    static const uint16_t s_rate_table[16];
 };
 
 //
 // NES APU implementation
 // http://wiki.nesdev.com/w/index.php/APU
 //
-class nes_apu : nes_component
-
+// Like the PPU, the APU runs behind the CPU and only catches up (step_to) when its state is accessed, when it
+// may need to raise IRQ, and at the end of nes_system::step. Catching up doesn't go cycle by cycle either - each
+// channel jumps from one timer boundary to the next and reports its output only when it changes, and silent
+// channels skip ahead in one go
+//
+class nes_apu : public nes_component
 {
 public:
     nes_apu();
@@ -238,85 +648,81 @@ public :
     //
     // nes_component overrides
     //
-    virtual void power_on(nes_system *system) 
-    { 
-        _system = system;
-        init(); 
-    }
+    virtual void power_on(nes_system *system);
+    virtual void reset();
+    virtual void step_to(nes_cycle_t count);
+    virtual void save_state(nes_state_writer &writer);
+    virtual void load_state(nes_state_reader &reader);
 
-    virtual void reset() { init(); }
+public :
+    //
+    // Audio output
+    //
 
-    virtual void step_to(nes_cycle_t count) {}
+    // Start producing mono 16-bit samples at sample_rate (such as 44100), or stop with 0
+    void set_sample_rate(int sample_rate) { _mixer.set_sample_rate(sample_rate); }
+    void set_rate_adjust(double ratio) { _mixer.set_rate_adjust(ratio); }
+    double rate_adjust() { return _mixer.rate_adjust(); }
+    int sample_rate() { return _mixer.sample_rate(); }
 
-private :
-    void init()
-    {
-        // status
-        _dmc_enabled = _noise_enabled = _triangle_enabled = _pulse_1_enabled = _pulse_2_enabled = false;
+    // Turn everything played so far into samples - nes_system does this at the end of every step
+    void end_frame() { _mixer.end_frame(_cycle); }
 
-        // frame counter
-        _frame_counter_mode = 0;
-        _irq_inhibit = true;
-    }
+    int samples_available() { return _mixer.samples_available(); }
+    int read_samples(int16_t *buf, int count) { return _mixer.read_samples(buf, count); }
+
+    // The earliest cycle where APU might raise IRQ - CPU needs to catch APU up by then
+    nes_cycle_t next_event_cycle() { return _next_event_cycle; }
 
 public :
     //
     // I/O registers
     //
 
-    void write_status(uint8_t val)
-    {
-        _dmc_enabled = val & 0x10;
-        _noise_enabled = val & 0x8;
-        _triangle_enabled = val & 0x4;
-        _pulse_2_enabled = val & 0x2;
-        _pulse_1_enabled = val & 0x1;
-    }
-
-    uint8_t read_status()
-    {
-        // @TODO
-        return 0;
-    }
-
-    void write_frame_counter(uint8_t val)
-    {
-        // @TODO
-        _frame_counter_mode = val >> 7;
-        _irq_inhibit = val & 0x40;
-    }
+    // $4000~$4013, $4017
+    void write_reg(uint16_t addr, uint8_t val);
 
-    void write_pulse_1_duty(uint8_t val)
-    {
-        
-    }
+    // $4015
+    void write_status(uint8_t val);
+    uint8_t read_status();
 
-    void write_pulse_1_sweep(uint8_t val)
-    {
+    // $4017
+    void write_frame_counter(uint8_t val);
 
-    }
+private :
+    void init();
 
-    void write_pulse_1_timer_low(uint8_t val)
-    {
+    // Run all channels up to (but not including) CPU cycle <to>
+    void run_channels(int64_t to);
 
-    }
+    void update_outputs();
 
-    void write_pulse_1_length_counter(uint8_t val)
-    {
+    void clock_frame_counter();
+    void reset_frame_counter(int64_t start);
 
-    }
+    void update_irq();
+    void update_next_event_cycle();
 
 private:
-    nes_system * _system;
+    nes_system *_system;
+    nes_memory *_mem;
+
+    int64_t _cycle;                         // in CPU cycles
 
-    // status
-    bool _dmc_enabled;
-    bool _noise_enabled;
-    bool _triangle_enabled;
-    bool _pulse_2_enabled;
-    bool _pulse_1_enabled;
+    nes_apu_mixer _mixer;
+    nes_apu_pulse_channel _pulse_1;
+    nes_apu_pulse_channel _pulse_2;
+    nes_apu_triangle_channel _triangle;
+    nes_apu_noise_channel _noise;
+    nes_apu_dmc_channel _dmc;
 
     // frame counter
-    uint8_t _frame_counter_mode;
+    uint8_t _frame_counter_mode;            // 0 = 4-step, 1 = 5-step
     bool _irq_inhibit;
+    bool _frame_irq;                        // frame interrupt flag - $4015 bit 6
+    int64_t _frame_start;                   // CPU cycle where the current sequence started
+    uint8_t _frame_step;                    // next step in the sequence
+    int64_t _frame_next;                    // CPU cycle of the next step
+
+    nes_cycle_t _next_event_cycle;
 };
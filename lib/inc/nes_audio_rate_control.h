@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Never stretch audio by more than this - 0.5% is about a twelfth of a semitone, which nobody hears
+#define NES_AUDIO_MAX_RATE_ADJUST 0.005
+
+//
+// Dynamic rate control for audio
+//
+// Frames are paced by the host clock (or vsync), and the audio device plays at its own clock. The two never
+// agree exactly, so at a fixed rate the audio buffer slowly drains (pops from underruns) or fills up (latency
+// grows until samples get dropped). Instead, feed the buffer level to update once per frame and produce
+// samples at the returned ratio (nes_apu::set_rate_adjust): a bit faster when the buffer is below the target
+// level, a bit slower when above, never more than max_adjust either way
+// https://docs.libretro.com/development/cores/dynamic-rate-control/
+//
+// This is proportional only, so a constant clock mismatch settles slightly off target (by mismatch / max_adjust
+// of the target level) - which is fine as long as the target leaves some room either way
+//
+class nes_audio_rate_control
+{
+public :
+    // target_level is the buffer level to hold, in samples
+    nes_audio_rate_control(double target_level, double max_adjust = NES_AUDIO_MAX_RATE_ADJUST);
+
+public :
+    // Feed the current buffer level (in samples) - returns the ratio to produce samples at for the next frame
+    double update(size_t level);
+
+    // Start over - such as after a stall that drained the buffer
+    void reset();
+
+    double ratio() { return _ratio; }
+    double target_level() { return _target_level; }
+
+    // Buffer level smoothed over the last several updates
+    double average_level() { return _average_level; }
+
+    // Number of updates so far
+    uint64_t update_count() { return _update_count; }
+
+private :
+    double _target_level;
+    double _max_adjust;
+
+    double _average_level;
+    double _ratio;
+    uint64_t _update_count;
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+using namespace std;
+
+//
+// Lock-free handoff of audio samples from the emulation thread to the audio callback thread
+//
+// Single producer / single consumer. Read and write positions only ever increase and are masked into the
+// buffer, which is why capacity is a power of two - full and empty are simply write - read == capacity and 0.
+// Each side only stores its own position, and release/acquire on it publishes the samples in between, so
+// neither side ever takes a lock (the audio callback must not block)
+//
+// When the producer runs ahead, samples that don't fit are dropped. When the consumer runs dry, the rest of
+// its buffer is filled with silence. Both are counted, and together with fill_level they tell how well
+// emulation keeps up with the audio device
+//
+class nes_audio_ring
+{
+public :
+    nes_audio_ring(size_t capacity)
+    {
+        // round up to a power of two so that positions wrap with a mask
+        _capacity = 1;
+        while (_capacity < capacity)
+            _capacity <<= 1;
+        _mask = _capacity - 1;
+
+        _samples = make_unique<int16_t[]>(_capacity);
+        memset(_samples.get(), 0, _capacity * sizeof(int16_t));
+
+        _write_pos = 0;
+        _overflow_count = 0;
+        _read_pos = 0;
+        _underrun_count = 0;
+    }
+
+public :
+    //
+    // Producer (emulation thread)
+    //
+
+    // Append samples - returns how many fit. The rest are dropped and counted as overflow
+    size_t write(const int16_t *samples, size_t count)
+    {
+        size_t write_pos = _write_pos.load(std::memory_order_relaxed);
+
+        // acquire - consumer is done with everything before read_pos
+        size_t space = _capacity - (write_pos - _read_pos.load(std::memory_order_acquire));
+        if (count > space)
+        {
+            _overflow_count.store(_overflow_count.load(std::memory_order_relaxed) + (count - space), std::memory_order_relaxed);
+            count = space;
+        }
+
+        size_t offset = write_pos & _mask;
+        size_t first = min(count, _capacity - offset);
+        memcpy(_samples.get() + offset, samples, first * sizeof(int16_t));
+        memcpy(_samples.get(), samples + first, (count - first) * sizeof(int16_t));
+
+        // release - samples are visible before the new write_pos
+        _write_pos.store(write_pos + count, std::memory_order_release);
+        return count;
+    }
+
+    //
+    // Consumer (audio thread)
+    //
+
+    // Fill samples - returns how many were buffered. The rest is silence and counted as underrun
+    size_t read(int16_t *samples, size_t count)
+    {
+        size_t read_pos = _read_pos.load(std::memory_order_relaxed);
+
+        // acquire - samples before write_pos are written
+        size_t available = _write_pos.load(std::memory_order_acquire) - read_pos;
+        size_t read_count = min(count, available);
+
+        size_t offset = read_pos & _mask;
+        size_t first = min(read_count, _capacity - offset);
+        memcpy(samples, _samples.get() + offset, first * sizeof(int16_t));
+        memcpy(samples + first, _samples.get(), (read_count - first) * sizeof(int16_t));
+
+        // release - producer may overwrite these samples only after we are done copying them
+        _read_pos.store(read_pos + read_count, std::memory_order_release);
+
+        if (read_count < count)
+        {
+            memset(samples + read_count, 0, (count - read_count) * sizeof(int16_t));
+            _underrun_count.store(_underrun_count.load(std::memory_order_relaxed) + (count - read_count), std::memory_order_relaxed);
+        }
+
+        return read_count;
+    }
+
+    //
+    // Telemetry - safe to call from either thread (or any other)
+    //
+
+    // Number of samples buffered and not yet read
+    size_t fill_level()
+    {
+        // read_pos first: write_pos can only have moved further ahead by the time it is loaded
+        size_t read_pos = _read_pos.load(std::memory_order_acquire);
+        size_t write_pos = _write_pos.load(std::memory_order_acquire);
+        return min(write_pos - read_pos, _capacity);
+    }
+
+    size_t capacity() { return _capacity; }
+
+    // Total samples dropped because the ring was full
+    uint64_t overflow_count() { return _overflow_count.load(std::memory_order_relaxed); }
+
+    // Total samples of silence handed out because the ring was empty
+    uint64_t underrun_count() { return _underrun_count.load(std::memory_order_relaxed); }
+
+private :
+    unique_ptr<int16_t[]> _samples;
+    size_t _capacity;
+    size_t _mask;
+
+    // Producer and consumer state on their own cache lines so that they don't fight over them
+    alignas(64) atomic<size_t> _write_pos;          // stored by producer only
+    atomic<uint64_t> _overflow_count;               // stored by producer only
+
+    alignas(64) atomic<size_t> _read_pos;           // stored by consumer only
+    atomic<uint64_t> _underrun_count;               // stored by consumer only
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class nes_system;
+
+//
+// A single independent emulation job - run a ROM from power on for a number of frames
+//
+struct nes_batch_job
+{
+    string rom_path;
+
+    // Frames to run. 0 means the entire movie if there is one
+    uint32_t frame_count = 0;
+
+    // Optional input - play back the movie and verify it against the recorded hashes
+    string movie_path;
+
+    //
+    // Optional input - called on the worker thread before each frame, such as to register input devices or
+    // poke RAM. Any state it touches needs to be owned by the job as jobs run in parallel
+    //
+    function<void(nes_system &system, uint32_t frame)> on_frame;
+
+    // Outputs to keep in the result
+    bool keep_state = false;
+    bool keep_frame_buffer = false;
+};
+
+struct nes_batch_result
+{
+    bool success = false;
+    string error;                   // why the job failed
+    uint32_t frames_run = 0;
+    uint64_t hash = 0;              // nes_movie::hash at the end of the job
+    vector<uint8_t> state;          // final savestate if keep_state
+    vector<uint8_t> frame_buffer;   // last frame if keep_frame_buffer
+    double seconds = 0;             // time spent running this job
+};
+
+struct nes_batch_summary
+{
+    uint32_t job_count = 0;
+    uint32_t failed_count = 0;
+    uint64_t frame_count = 0;
+    double seconds = 0;             // wall clock time of the entire batch
+};
+
+//
+// Runs many independent nes_system instances on a work-stealing thread pool sized to the cores
+// Every ROM is read once per batch and shared by all the jobs using it
+// Each worker starts with a few jobs in its own queue, and steals from others once it runs out - jobs vary
+// wildly in length (a few frames vs. an entire movie) so a static split would leave cores idle
+//
+class nes_batch_runner
+{
+public :
+    // thread_count = 0 means one thread per core
+    nes_batch_runner(uint32_t thread_count = 0);
+
+public :
+    // Run all jobs and return the results in the same order as jobs
+    vector<nes_batch_result> run(const vector<nes_batch_job> &jobs);
+
+    // Summary of the last run
+    const nes_batch_summary &summary() { return _summary; }
+
+    uint32_t thread_count() { return _thread_count; }
+
+private :
+    uint32_t _thread_count;
+    nes_batch_summary _summary;
+};
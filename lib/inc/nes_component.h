@@ -5,6 +5,8 @@
 #include "nes_cycle.h"
 
 class nes_system;
+class nes_state_writer;
+class nes_state_reader;
 
 class nes_component
 {
@@ -14,4 +16,8 @@ public :
     virtual void reset() = 0;
 
     virtual void step_to(nes_cycle_t count) = 0;
+
+    // Save/load everything needed to resume emulation exactly - see nes_system::save_state
+    virtual void save_state(nes_state_writer &writer) = 0;
+    virtual void load_state(nes_state_reader &reader) = 0;
 };
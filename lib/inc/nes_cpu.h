@@ -12,6 +12,8 @@
 
 using namespace std;
 
+class nes_apu;
+
 //
 // All processor status codes for the status register
 // http://wiki.nesdev.com/w/index.php/CPU_status_flag_behavior
@@ -50,6 +52,12 @@ using namespace std;
 
 #define IRQ_HANDLER     0xfffe
 
+// Devices that can pull the IRQ line - it stays asserted as long as any of them does
+enum nes_irq_source : uint8_t
+{
+    nes_irq_source_apu = 0x1,               // frame counter or DMC
+};
+
 // Addressing modes of 6502
 // http://obelisk.me.uk/6502/addressing.html
 // http://wiki.nesdev.com/w/index.php/CPU_addressing_modes
@@ -113,11 +121,21 @@ public :
     virtual void reset();
     virtual void step_to(nes_cycle_t count);
 
+    virtual void save_state(nes_state_writer &writer);
+    virtual void load_state(nes_state_reader &reader);
+
 public :
 
     void stop_at_infinite_loop() { _stop_at_infinite_loop = true; }
     void stop_at_addr(uint16_t addr) { _is_stop_at_addr = true;  _stop_at_addr = addr; }
 
+    // Fast forward through loops that only poll RAM or PPUSTATUS (on by default) - see skip_idle_loop
+    void set_idle_loop_skip(bool enable) { _idle_loop_skip = enable; _idle_loop.valid = false; }
+    bool is_idle_loop_skip() { return _idle_loop_skip; }
+
+    // Total cycles fast forwarded through idle loops
+    nes_cycle_t idle_cycles() { return _idle_cycles; }
+
     void set_carry_flag(bool set) { set_flag(PROCESSOR_STATUS_CARRY_MASK, set); }
     uint8_t get_carry() { return (_context.P & PROCESSOR_STATUS_CARRY_MASK); }
 
@@ -149,9 +167,21 @@ public :
     uint8_t &P() { return _context.P; }
     uint8_t &S() { return _context.S; }
 
+    // current CPU cycle - this is the start of the instruction while the instruction is executing
+    nes_cycle_t cycle() { return _cycle; }
+
     void request_nmi() { _nmi_pending = true; };
     void request_dma(uint16_t addr) { _dma_pending = true; _dma_addr = addr; }
 
+    // IRQ is taken at the next instruction boundary where interrupt flag is clear
+    void set_irq(nes_irq_source source, bool asserted)
+    {
+        if (asserted)
+            _irq_line |= source;
+        else
+            _irq_line &= ~source;
+    }
+
 public :
     //
     // Stack operations
@@ -193,8 +223,48 @@ private :
     // execute on instruction, update processor status as needed, and move CPU internal cycle count
     void exec_one_instruction();
     void NMI();
+    void IRQ();
     void OAMDMA();
 
+    //
+    // Idle loop skipping
+    //
+    // A short backward branch/JMP that closes a loop is checked when arriving at the loop head. A loop is
+    // idle when its body is straight-line code that only reads RAM/ROM or PPUSTATUS, and the registers at
+    // the head are exactly the same as the last iteration - every following iteration would then do the
+    // same thing until what it polls changes. Those iterations are skipped as a whole up to the earliest
+    // cycle the polled value can change (NMI / PPU status flags / any PPU event / APU IRQ), so cycles stay exact
+    //
+    enum idle_loop_kind : uint8_t
+    {
+        idle_loop_kind_none,            // has side effects or reads something we can't predict
+        idle_loop_kind_memory,          // only reads RAM/ROM - only CPU (NMI handler) can change them
+        idle_loop_kind_ppu_status,      // also reads PPUSTATUS
+    };
+
+    struct nes_idle_loop
+    {
+        bool valid;
+        uint16_t head;                  // start of the loop
+        uint16_t tail;                  // the branch/JMP back to head
+        idle_loop_kind kind;
+        nes_cpu_context context;        // registers when last arriving at head
+        nes_cycle_t cycle;              // cycle when last arriving at head
+    };
+
+    void jump_back(uint16_t tail)
+    {
+        // Only short loops are worth checking
+        if (PC() <= tail && tail - PC() <= 0x20)
+        {
+            _idle_loop_check = true;
+            _idle_loop_tail = tail;
+        }
+    }
+
+    bool skip_idle_loop(nes_cycle_t new_count);
+    idle_loop_kind get_idle_loop_kind(uint16_t head, uint16_t tail);
+
     uint8_t decode_byte()
     {
         return _mem->get_byte(_context.PC++);
@@ -218,6 +288,7 @@ private :
 private :
     enum operand_kind : uint8_t
     {
+        operand_kind_imp,
         operand_kind_acc,
         operand_kind_imm,
         operand_kind_addr
@@ -233,28 +304,46 @@ private :
     void step_cpu(nes_cpu_cycle_t cycle);
     void step_cpu(int64_t cycle);
 
-    nes_cpu_cycle_t get_cpu_cycle(operand_t operand, nes_addr_mode mode);
     nes_cpu_cycle_t get_branch_cycle(bool cond, uint16_t new_addr, int8_t rel);
-    nes_cpu_cycle_t get_shift_cycle(nes_addr_mode addr_mode);
+
+    //
+    // Every op code is dispatched through a 256-entry table of exec_op instantiations - each one has the
+    // instruction, addressing mode and cycle count baked in so there is no runtime branching on them.
+    // See NES_CPU_OP_TABLE in nes_cpu.cpp
+    //
+    typedef void (*op_func_t)(nes_cpu &cpu);
+    typedef void (nes_cpu::*op_handler_t)(operand_t op);
+
+    template <op_handler_t handler, nes_addr_mode addr_mode, int cycles, bool page_penalty>
+    static void exec_op(nes_cpu &cpu);
+
+    static const op_func_t s_op_table[];
 
     //
     // Implements all address mode
+    // addr_mode is always known at compile time, so all the branches are folded away
     //
-    operand_t decode_operand(nes_addr_mode addr_mode)
+    template <nes_addr_mode addr_mode>
+    operand_t decode_operand()
     {    
-        if (addr_mode == nes_addr_mode::nes_addr_mode_acc)
+        if (addr_mode == nes_addr_mode::nes_addr_mode_imp)
+        {
+            return { 0, operand_kind_imp, false };
+        }
+        else if (addr_mode == nes_addr_mode::nes_addr_mode_acc)
         {
             return { 0, operand_kind_acc, false };
         }
-        else if (addr_mode == nes_addr_mode::nes_addr_mode_imm)
+        else if (addr_mode == nes_addr_mode::nes_addr_mode_imm || addr_mode == nes_addr_mode::nes_addr_mode_rel)
         {
             // immediate - next byte is a constant
+            // relative - next byte is the signed offset
             return { decode_byte(), operand_kind_imm, false };
         }
         else
         {
             bool page_crossing;
-            uint16_t addr = decode_operand_addr(addr_mode, &page_crossing);
+            uint16_t addr = decode_operand_addr<addr_mode>(&page_crossing);
             return { addr, operand_kind_addr, page_crossing };
         }
     }
@@ -291,10 +380,10 @@ private :
         }
     }
 
-    uint16_t decode_operand_addr(nes_addr_mode addr_mode, bool *page_crossing = nullptr)
+    template <nes_addr_mode addr_mode>
+    uint16_t decode_operand_addr(bool *page_crossing)
     {
-        if (page_crossing)
-            *page_crossing = false;
+        *page_crossing = false;
         if (addr_mode == nes_addr_mode::nes_addr_mode_zp)
         {
             // zero page - next byte is 8-bit address
@@ -335,8 +424,7 @@ private :
             // Absolute X
             uint16_t addr = decode_word();
             uint16_t new_addr = addr + _context.X;
-            if (page_crossing)
-                *page_crossing = ((addr & 0xff00) != (new_addr & 0xff00));
+            *page_crossing = ((addr & 0xff00) != (new_addr & 0xff00));
             return new_addr;
         }
         else if (addr_mode == nes_addr_mode::nes_addr_mode_abs_y)
@@ -344,8 +432,7 @@ private :
             // Absolute Y
             uint16_t addr = decode_word();
             uint16_t new_addr = addr + _context.Y;
-            if (page_crossing)
-                *page_crossing = ((addr & 0xff00) != (new_addr & 0xff00));
+            *page_crossing = ((addr & 0xff00) != (new_addr & 0xff00));
             return new_addr;
         }
         else if (addr_mode == nes_addr_mode::nes_addr_mode_ind_x)
@@ -361,8 +448,7 @@ private :
             uint8_t arg_addr = decode_byte();
             uint16_t addr = peek(arg_addr) + (uint16_t(peek((arg_addr + 1) & 0xff)) << 8);
             uint16_t new_addr = addr + _context.Y;
-            if (page_crossing)
-                *page_crossing = ((addr & 0xff00) != (new_addr & 0xff00));
+            *page_crossing = ((addr & 0xff00) != (new_addr & 0xff00));
             return new_addr;
         }
         else
@@ -391,218 +477,240 @@ private :
             ((val1 & 0x80) != (new_value & 0x80)));
     }
 
-    string get_op_str(const char *op, nes_addr_mode addr_mode, bool is_official = true);
+    string get_op_str(uint8_t op_code);
     void append_operand_str(string &str, nes_addr_mode addr_mode);
+    void trace_instruction(nes_trace_ring &trace, uint8_t op_code);
+
+public :
+    //
+    // Disassemble instruction at pc (op code + operand bytes) without looking at memory or registers
+    // Used for formatting binary traces long after the instruction is executed
+    //
+    static void append_instruction_str(string &str, uint16_t pc, uint8_t op_code, const uint8_t *operand);
+
+private :
+    static int get_operand_size(nes_addr_mode addr_mode);
 
-    void branch(bool cond, nes_addr_mode addr_mode);
+    void branch(bool cond, operand_t op);
 
     // ADC - Add with carry
-    void ADC(nes_addr_mode addr_mode);
+    void ADC(operand_t op);
     void _ADC(uint8_t val);
 
     // AND - Logical AND
-    void AND(nes_addr_mode addr_mode);
+    void AND(operand_t op);
 
     // ASL - Arithmetic Shift Left
-    void ASL(nes_addr_mode addr_mode);
+    void ASL(operand_t op);
     
     // BCC - Branch if Carry Clear
-    void BCC(nes_addr_mode addr_mode);
+    void BCC(operand_t op);
 
     // BCS - Branch if Carry Set 
-    void BCS(nes_addr_mode addr_mode);
+    void BCS(operand_t op);
 
     // BEQ - Branch if Equal
-    void BEQ(nes_addr_mode addr_mode);
+    void BEQ(operand_t op);
 
     // BIT - Bit test
-    void BIT(nes_addr_mode addr_mode);
+    void BIT(operand_t op);
 
     // BMI - Branch if minus
-    void BMI(nes_addr_mode addr_mode);
+    void BMI(operand_t op);
 
     // BNE - Branch if not equal
-    void BNE(nes_addr_mode addr_mode);
+    void BNE(operand_t op);
 
     // BPL - Branch if positive 
-    void BPL(nes_addr_mode addr_mode);
+    void BPL(operand_t op);
 
     // BRK - Force interrupt
-    void BRK(nes_addr_mode addr_mode);
+    void BRK(operand_t op);
 
     // BVC - Branch if overflow clear
-    void BVC(nes_addr_mode addr_mode);
+    void BVC(operand_t op);
 
     // BVS - Branch if overflow set
-    void BVS(nes_addr_mode addr_mode);
+    void BVS(operand_t op);
 
     // CLC - Clear carry flag
-    void CLC(nes_addr_mode addr_mode);
+    void CLC(operand_t op);
 
     // CLD - Clear decimal mode
-    void CLD(nes_addr_mode addr_mode);
+    void CLD(operand_t op);
 
     // CLI - Clear interrupt disable
-    void CLI(nes_addr_mode addr_mode);
+    void CLI(operand_t op);
 
     // CLV - Clear overflow flag
-    void CLV(nes_addr_mode addr_mode);
+    void CLV(operand_t op);
 
     // CMP - Compare 
-    void CMP(nes_addr_mode addr_mode);
+    void CMP(operand_t op);
 
     // CPX - Compare X register
-    void CPX(nes_addr_mode addr_mode);
+    void CPX(operand_t op);
 
     // CPY - Compare Y register
-    void CPY(nes_addr_mode addr_mode);
+    void CPY(operand_t op);
 
     // DEC - Decrement memory
-    void DEC(nes_addr_mode addr_mode);
+    void DEC(operand_t op);
 
     // DEX - Decrement X register
-    void DEX(nes_addr_mode addr_mode);
+    void DEX(operand_t op);
 
     // DEY - Decrement Y register
-    void DEY(nes_addr_mode addr_mode);
+    void DEY(operand_t op);
 
     // Exclusive OR 
-    void EOR(nes_addr_mode addr_mode);
+    void EOR(operand_t op);
 
     // INC - Increment memory
-    void INC(nes_addr_mode addr_mode);
+    void INC(operand_t op);
 
     // INX - Increment X
-    void INX(nes_addr_mode addr_mode);
+    void INX(operand_t op);
 
     // INY - Increment Y
-    void INY(nes_addr_mode addr_mode);
+    void INY(operand_t op);
 
     // JMP - Jump 
-    void JMP(nes_addr_mode addr_mode);
+    void JMP(operand_t op);
 
     // JSR - Jump to subroutine
-    void JSR(nes_addr_mode addr_mode);
+    void JSR(operand_t op);
 
     // LDA - Load Accumulator
-    void LDA(nes_addr_mode addr_mode);
+    void LDA(operand_t op);
 
     // LDX - Load X register
-    void LDX(nes_addr_mode addr_mode);
+    void LDX(operand_t op);
 
     // LDY - Load Y register
-    void LDY(nes_addr_mode addr_mode);
+    void LDY(operand_t op);
 
     // LSR - Logical shift right
-    void LSR(nes_addr_mode addr_mode);
+    void LSR(operand_t op);
 
     // NOP - NOP
-    void NOP(nes_addr_mode addr_mode);
+    void NOP(operand_t op);
 
     // ORA - Logical Inclusive OR
-    void ORA(nes_addr_mode addr_mode);
+    void ORA(operand_t op);
 
     // PHA - Push accumulator
-    void PHA(nes_addr_mode addr_mode);
+    void PHA(operand_t op);
 
     // PHP - Push processor status
-    void PHP(nes_addr_mode addr_mode);
+    void PHP(operand_t op);
 
     // PLA - Pull accumulator
-    void PLA(nes_addr_mode addr_mode);
+    void PLA(operand_t op);
 
     // PLP - Pull processor status
-    void PLP(nes_addr_mode addr_mode);
+    void PLP(operand_t op);
     void _PLP();
 
     // ROL - Rotate left
-    void ROL(nes_addr_mode addr_mode);
+    void ROL(operand_t op);
 
     // ROR - Rotate right
-    void ROR(nes_addr_mode addr_mode);
+    void ROR(operand_t op);
 
     // RTI - Return from interrupt
-    void RTI(nes_addr_mode addr_mode);
+    void RTI(operand_t op);
 
     // RTS - Return from subroutine
-    void RTS(nes_addr_mode addr_mode);
+    void RTS(operand_t op);
 
     // SBC - Subtract with carry
-    void SBC(nes_addr_mode addr_mode);
+    void SBC(operand_t op);
     void _SBC(uint8_t val);
 
     // SEC - Set carry flag
-    void SEC(nes_addr_mode addr_mode);
+    void SEC(operand_t op);
 
     // SED - Set decimal flag
-    void SED(nes_addr_mode addr_mode);
+    void SED(operand_t op);
 
     // SEI - Set interrupt disable
-    void SEI(nes_addr_mode addr_mode);
+    void SEI(operand_t op);
 
     // STA - Store Accumulator  
-    void STA(nes_addr_mode addr_mode);
+    void STA(operand_t op);
 
     // STX - Store X
-    void STX(nes_addr_mode addr_mode);
+    void STX(operand_t op);
 
     // STY- Store Y
-    void STY(nes_addr_mode addr_mode);
+    void STY(operand_t op);
 
     // TAX - Transfer accumulator to X 
-    void TAX(nes_addr_mode addr_mode);
+    void TAX(operand_t op);
 
     // TAY - Transfer accumulator to Y
-    void TAY(nes_addr_mode addr_mode);
+    void TAY(operand_t op);
 
     // TSX - Transfer stack pointer to X 
-    void TSX(nes_addr_mode addr_mode);
+    void TSX(operand_t op);
 
     // TXA - Transfer X to acc
-    void TXA(nes_addr_mode addr_mode);
+    void TXA(operand_t op);
 
     // TXS - Transfer X to stack pointer
-    void TXS(nes_addr_mode addr_mode);
+    void TXS(operand_t op);
 
     // TYA - Transfer Y to accumulator
-    void TYA(nes_addr_mode addr_mode);
+    void TYA(operand_t op);
 
     // KIL - Kill?
-    void KIL(nes_addr_mode addr_mode);
+    void KIL(operand_t op);
+
+    // ILL - Any op code that we don't recognize
+    void ILL(operand_t op);
 
     //===================================================================================
     // Unofficial OP codes
     //===================================================================================
 
-    void ALR(nes_addr_mode addr_mode);
-    void ANC(nes_addr_mode addr_mode);
-    void ARR(nes_addr_mode addr_mode);
-    void AXS(nes_addr_mode addr_mode);
-    void LAX(nes_addr_mode addr_mode);
-    void SAX(nes_addr_mode addr_mode);
-    void DCP(nes_addr_mode addr_mode);
-    void ISC(nes_addr_mode addr_mode);
-    void RLA(nes_addr_mode addr_mode);
-    void RRA(nes_addr_mode addr_mode);
-    void SLO(nes_addr_mode addr_mode);
-    void SRE(nes_addr_mode addr_mode);
+    void ALR(operand_t op);
+    void ANC(operand_t op);
+    void ARR(operand_t op);
+    void AXS(operand_t op);
+    void LAX(operand_t op);
+    void SAX(operand_t op);
+    void DCP(operand_t op);
+    void ISC(operand_t op);
+    void RLA(operand_t op);
+    void RRA(operand_t op);
+    void SLO(operand_t op);
+    void SRE(operand_t op);
     
-    void XAA(nes_addr_mode addr_mode);
-    void AHX(nes_addr_mode addr_mode);
-    void TAS(nes_addr_mode addr_mode);
-    void LAS(nes_addr_mode addr_mode);
+    void XAA(operand_t op);
+    void AHX(operand_t op);
+    void TAS(operand_t op);
+    void LAS(operand_t op);
 
 private :
     nes_system      *_system;
     nes_memory      *_mem;
     nes_ppu         *_ppu;
+    nes_apu         *_apu;
     nes_cpu_context _context;
     nes_cycle_t     _cycle;
     bool            _nmi_pending;           // NMI interrupt pending from PPU vertical blanking
+    uint8_t         _irq_line;              // nes_irq_source currently asserting IRQ
     bool            _dma_pending;           // OAMDMA is requested from writing $4014
     uint16_t        _dma_addr;              // starting address
     bool            _stop_at_infinite_loop; // stop at when the ROM starts infinite loop - useful for testing
     bool            _is_stop_at_addr;       // stop at a certain address - useful for testing
     uint16_t        _stop_at_addr;          // stop at a certain address - useful for testing
+
+    bool            _idle_loop_skip;        // see skip_idle_loop
+    bool            _idle_loop_check;       // just jumped back to a potential loop head
+    uint16_t        _idle_loop_tail;        // where we jumped back from
+    nes_idle_loop   _idle_loop;             // the loop we are currently checking
+    nes_cycle_t     _idle_cycles;           // total cycles skipped
 };
 
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <functional>
+
+#include "nes_cycle.h"
+
+using namespace std;
+
+//
+// NTSC runs 341 * 262 PPU cycles per frame, minus the cycle skipped on odd frames when rendering is on
+//
+#define NES_NTSC_FRAME_RATE (double(NES_CLOCK_HZ) / (341 * 262 - 0.5))
+
+//
+// Paces a frame-at-a-time emulation loop to real time: wait_frame blocks until the next frame is due, and the
+// loop then runs exactly one frame. Waiting is mostly sleeping, with a short yield loop at the end since sleeps
+// can overshoot by a millisecond or more
+//
+// By default frames are scheduled against the host clock. set_clock slaves the schedule to another clock instead
+// such as the audio device (samples played / sample rate), so that emulation neither underruns nor overfills
+// the audio buffer
+//
+class nes_frame_pacer
+{
+public :
+    nes_frame_pacer(double frame_rate = NES_NTSC_FRAME_RATE);
+
+public :
+    // Block until the next frame is due - call once before running each frame
+    void wait_frame();
+
+    // Schedule frames against the given clock (in seconds, never going backwards). nullptr for the host clock
+    void set_clock(function<double()> clock);
+
+    // Forget the schedule - the next frame is due right away
+    void reset() { _started = false; }
+
+    double frame_rate() { return _frame_rate; }
+
+    // Number of frames paced so far
+    uint64_t frame_count() { return _frame_count; }
+
+    // Number of times emulation fell too far behind and the schedule was reset rather than catching up
+    uint64_t late_count() { return _late_count; }
+
+private :
+    double now();
+
+private :
+    double _frame_rate;
+    double _period;                         // seconds per frame
+    double _next;                           // when the next frame is due
+    bool _started;
+
+    function<double()> _clock;
+    steady_clock::time_point _start;
+
+    uint64_t _frame_count;
+    uint64_t _late_count;
+};
@@ -5,6 +5,8 @@
 
 #include <cstdint>
 
+#include "nes_state.h"
+
 #define NES_CONTROLLER_STROBE_BIT 0x1
 
 // The controller are reported always in bit 0 in the order of 
@@ -57,6 +59,20 @@ public :
         // Do nothing
     }
 
+    virtual void save_state(nes_state_writer &writer)
+    {
+        writer.write(_strobe_on);
+        writer.write(_button_flags);
+        writer.write(_button_id);
+    }
+
+    virtual void load_state(nes_state_reader &reader)
+    {
+        reader.read(_strobe_on);
+        reader.read(_button_flags);
+        reader.read(_button_id);
+    }
+
 public :
     void register_input(int id, shared_ptr<nes_input_device> input) { _user_inputs[id] = input; }
     void unregister_input(int id) { _user_inputs[id] = nullptr; }
@@ -44,10 +44,20 @@ struct nes_mapper_info
 class nes_ppu;
 class nes_cpu;
 class nes_memory;
+class nes_state_writer;
+class nes_state_reader;
 
 class nes_mapper
 {
 public :
+    nes_mapper(shared_ptr<vector<uint8_t>> &prg_rom, shared_ptr<vector<uint8_t>> &chr_rom)
+        :_prg_rom(prg_rom), _chr_rom(chr_rom)
+    {
+    }
+
+    vector<uint8_t> &prg_rom() { return *_prg_rom; }
+    vector<uint8_t> &chr_rom() { return *_chr_rom; }
+
     //
     // Called when mapper is loaded into memory
     // Useful when all you need is a one-time memcpy
@@ -71,7 +81,24 @@ public :
     //
     virtual void write_reg(uint16_t addr, uint8_t val) {};
 
+    //
+    // Copy of this mapper (with all its registers) for a forked nes_system - ROM is shared, not copied
+    // The copy gets bound to the new memory/PPU through on_load_ram/on_load_ppu
+    //
+    virtual shared_ptr<nes_mapper> clone() = 0;
+
+    //
+    // Save/load mapper registers for savestate
+    // Current PRG/CHR bank mappings are saved by nes_memory/nes_ppu so there is no need to remap here
+    //
+    virtual void save_state(nes_state_writer &writer) {}
+    virtual void load_state(nes_state_reader &reader) {}
+
     virtual ~nes_mapper() {}
+
+protected :
+    shared_ptr<vector<uint8_t>> _prg_rom;
+    shared_ptr<vector<uint8_t>> _chr_rom;
 };
 
 //
@@ -82,7 +109,7 @@ class nes_mapper_nrom : public nes_mapper
 {
 public :
     nes_mapper_nrom(shared_ptr<vector<uint8_t>> &prg_rom, shared_ptr<vector<uint8_t>> &chr_rom, bool vertical_mirroring)
-        :_prg_rom(prg_rom), _chr_rom(chr_rom), _vertical_mirroring(vertical_mirroring)
+        :nes_mapper(prg_rom, chr_rom), _vertical_mirroring(vertical_mirroring)
     {
 
     }
@@ -91,9 +118,9 @@ public :
     virtual void on_load_ppu(nes_ppu &ppu);
     virtual void get_info(nes_mapper_info &info);
 
+    virtual shared_ptr<nes_mapper> clone() { return make_shared<nes_mapper_nrom>(*this); }
+
 private :
-    shared_ptr<vector<uint8_t>> _prg_rom;
-    shared_ptr<vector<uint8_t>> _chr_rom;
     bool _vertical_mirroring;
 };
 
@@ -105,9 +132,13 @@ class nes_mapper_mmc1 : public nes_mapper
 {
 public :
     nes_mapper_mmc1(shared_ptr<vector<uint8_t>> &prg_rom, shared_ptr<vector<uint8_t>> &chr_rom, bool vertical_mirroring)
-        :_prg_rom(prg_rom), _chr_rom(chr_rom), _vertical_mirroring(vertical_mirroring)
+        :nes_mapper(prg_rom, chr_rom), _vertical_mirroring(vertical_mirroring)
     {
         _bit_latch = 0;
+        _reg = 0;
+
+        // power on state - PRG ROM bank mode 3 (fix last bank at $C000)
+        _control = 0x0c;
     }
 
     virtual void on_load_ram(nes_memory &mem);
@@ -116,6 +147,11 @@ public :
 
     virtual void write_reg(uint16_t addr, uint8_t val);
 
+    virtual shared_ptr<nes_mapper> clone() { return make_shared<nes_mapper_mmc1>(*this); }
+
+    virtual void save_state(nes_state_writer &writer);
+    virtual void load_state(nes_state_reader &reader);
+
  private :
     void write_control(uint8_t val);
     void write_chr_bank_0(uint8_t val);
@@ -126,8 +162,6 @@ private :
     nes_ppu *_ppu;
     nes_memory *_mem;
 
-    shared_ptr<vector<uint8_t>> _prg_rom;
-    shared_ptr<vector<uint8_t>> _chr_rom;
     bool _vertical_mirroring;
 
 
@@ -144,7 +178,7 @@ class nes_mapper_mmc3 : public nes_mapper
 {
 public:
     nes_mapper_mmc3(shared_ptr<vector<uint8_t>> &prg_rom, shared_ptr<vector<uint8_t>> &chr_rom, bool vertical_mirroring)
-        :_prg_rom(prg_rom), _chr_rom(chr_rom), _vertical_mirroring(vertical_mirroring)
+        :nes_mapper(prg_rom, chr_rom), _vertical_mirroring(vertical_mirroring)
     {
         // 1 -> neither 0 or 0x40 - means not yet initialized (and always will be different)
         _prev_prg_mode = 1;
@@ -158,6 +192,11 @@ public:
 
     virtual void write_reg(uint16_t addr, uint8_t val);
 
+    virtual shared_ptr<nes_mapper> clone() { return make_shared<nes_mapper_mmc3>(*this); }
+
+    virtual void save_state(nes_state_writer &writer);
+    virtual void load_state(nes_state_reader &reader);
+
 private:
     void write_bank_select(uint8_t val);
     void write_bank_data(uint8_t val);
@@ -172,8 +211,6 @@ private:
     nes_ppu * _ppu;
     nes_memory *_mem;
 
-    shared_ptr<vector<uint8_t>> _prg_rom;
-    shared_ptr<vector<uint8_t>> _chr_rom;
     bool _vertical_mirroring;
 
     uint8_t _bank_select;                       // control register
@@ -11,15 +11,19 @@ using namespace std;
 
 #define RAM_SIZE 0x10000
 
+// CPU address space is mapped in 256-byte pages
+#define RAM_PAGE_COUNT 0x100
+
 class nes_mapper;
 class nes_ppu;
+class nes_apu;
 
 class nes_memory : public nes_component
 {
 public :
     nes_memory()
     {
-        _ram.reserve(RAM_SIZE);
+        _ram.resize(RAM_SIZE);
     }
 
     bool is_io_reg(uint16_t addr)
@@ -36,35 +40,85 @@ public :
     uint8_t read_io_reg(uint16_t addr);
     void write_io_reg(uint16_t addr, uint8_t val);
 
+    // Let PPU catch up with CPU before CPU observes or changes any PPU state
+    void sync_ppu();
+    void sync_apu();
+
+    //
+    // All CPU memory access goes through the page tables first. A page that maps to plain memory (RAM and
+    // its mirrors, PRG ROM, etc) points directly to the backing memory. A page that has side effects
+    // (I/O registers, mapper registers, ROM writes) is nullptr and goes through the slow path.
+    //
     uint8_t get_byte(uint16_t addr)
     {
-        redirect_addr(addr);
-        if (is_io_reg(addr))
-            return read_io_reg(addr);
+        uint8_t *page = _read_pages[addr >> 8];
+        if (page)
+            return page[addr & 0xff];
 
-        return _ram[addr];
+        return read_byte_slow(addr);
     }
 
     uint16_t get_word(uint16_t addr)
     {
         // NES 6502 CPU is little endian
+        uint8_t *page = _read_pages[addr >> 8];
+        if (page && (addr & 0xff) != 0xff)
+            return page[addr & 0xff] + (uint16_t(page[(addr & 0xff) + 1]) << 8);
+
         return get_byte(addr) + (uint16_t(get_byte(addr + 1)) << 8);
     }
 
-    void set_byte(uint16_t addr, uint8_t val);
+    void set_byte(uint16_t addr, uint8_t val)
+    {
+        uint8_t *page = _write_pages[addr >> 8];
+        if (page)
+        {
+            page[addr & 0xff] = val;
+            return;
+        }
 
+        write_byte_slow(addr, val);
+    }
+
+    // Copy bytes directly into the RAM image - this bypasses I/O registers, mappers, and ROM mappings
     void set_bytes(uint16_t addr, uint8_t *data, size_t size)
     {
         assert(size + addr <= RAM_SIZE);
         redirect_addr(addr);
+        for (size_t page = addr >> 8; page <= ((addr + size - 1) >> 8); ++page)
+            unshare_page(int(page));
         memcpy_s(&_ram[0] + addr, RAM_SIZE - addr, data, size);
     }
 
+    // Read byte as CPU sees it, but without any side effects (I/O registers read as 0)
+    uint8_t peek_byte(uint16_t addr)
+    {
+        uint8_t *page = _read_pages[addr >> 8];
+        return page ? page[addr & 0xff] : 0;
+    }
+
+    // Copy bytes as CPU sees them, but without any side effects (I/O registers read as 0)
     void get_bytes(uint8_t *dest, uint16_t dest_size, uint16_t src_addr, size_t src_size)
     {
         assert(src_addr + src_size <= RAM_SIZE);
-        redirect_addr(src_addr);
-        memcpy_s(dest, dest_size, &_ram[0] + src_addr, src_size);
+        assert(src_size <= dest_size);
+        while (src_size > 0)
+        {
+            size_t offset = src_addr & 0xff;
+            size_t size = 0x100 - offset;
+            if (size > src_size)
+                size = src_size;
+
+            uint8_t *page = _read_pages[src_addr >> 8];
+            if (page)
+                memcpy(dest, page + offset, size);
+            else
+                memset(dest, 0, size);
+
+            dest += size;
+            src_addr += uint16_t(size);
+            src_size -= size;
+        }
     }
 
     void set_word(uint16_t addr, uint16_t value)
@@ -74,6 +128,12 @@ public :
         set_byte(addr + 1, (value >> 8));
     }
 
+    //
+    // Map PRG ROM directly into CPU address space - reads go straight into the ROM and writes never
+    // modify it. addr and size need to be page (256 bytes) aligned
+    //
+    void map_prg(uint16_t addr, uint8_t *rom, size_t size);
+
     void redirect_addr(uint16_t &addr)
     {
         if ((addr & 0xE000) == 0)
@@ -90,7 +150,45 @@ public :
 
     void load_mapper(shared_ptr<nes_mapper> &mapper);
 
+    //
+    // Share all RAM with child memory copy-on-write - child needs to have the (cloned) mapper loaded already
+    // Afterwards neither side writes into shared pages - the first write to a page copies it (256 bytes) so
+    // forking is cheap no matter how much RAM there is
+    //
+    void fork_to(nes_memory &child);
+
     nes_mapper& get_mapper() { return *_mapper; }
+    bool has_mapper() { return _mapper != nullptr; }
+
+private :
+    uint8_t read_byte_slow(uint16_t addr);
+    void write_byte_slow(uint16_t addr, uint8_t val);
+
+    // Reset page tables to the RAM image (with internal RAM mirrors) and I/O registers
+    void reset_pages();
+
+    // The page in RAM image backing the CPU page - resolving internal RAM mirrors
+    static int ram_page_index(int page) { return page < 0x20 ? (page & 0x7) : page; }
+
+    // Where the content of the RAM image page is - either _ram or a shared RAM image
+    uint8_t *ram_page(int ram_page)
+    {
+        auto &shared = _shared_ram[ram_page];
+        return (shared ? shared->data() : &_ram[0]) + (ram_page << 8);
+    }
+
+    // Whether the CPU page is reading RAM shared with other forks
+    bool is_shared_page(int page)
+    {
+        int index = ram_page_index(page);
+        return _shared_ram[index] && _read_pages[page] == ram_page(index);
+    }
+
+    // Turn all of RAM into a shared image that is never written again
+    void share_pages();
+
+    // Copy the RAM image page out of the shared image so that it can be written
+    void unshare_page(int ram_page);
 
 public :
     //
@@ -107,13 +205,23 @@ public :
         // Do nothing
     }
 
+    virtual void save_state(nes_state_writer &writer);
+    virtual void load_state(nes_state_reader &reader);
+
 private :
     vector<uint8_t>        _ram;
     shared_ptr<nes_mapper> _mapper;
 
+    // Copy-on-write RAM pages after fork - nullptr means the page is in _ram
+    shared_ptr<vector<uint8_t>> _shared_ram[RAM_PAGE_COUNT];
+
+    uint8_t *_read_pages[RAM_PAGE_COUNT];       // nullptr means read through read_byte_slow
+    uint8_t *_write_pages[RAM_PAGE_COUNT];      // nullptr means write through write_byte_slow
+
     nes_system *_system;
     nes_ppu *_ppu;
     nes_input *_input;
+    nes_apu *_apu;
 
     nes_mapper_info _mapper_info;
 };
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "nes_input.h"
+#include "nes_system.h"
+
+using namespace std;
+
+//
+// Movie is a recording of controller input for each frame, starting from power on + load_rom
+// Emulation is deterministic so playing back the input reproduces the exact same session - optionally each
+// frame also has a hash of RAM and frame buffer to verify that it actually does
+//
+// Controllers are polled when the strobe bit is turned off (nes_input::reload). Recording latches the first
+// polled state within a frame so that every poll within the same frame sees the same state - which is what
+// playback does as well
+//
+#define NES_MOVIE_MAGIC 0x4d53454e     // 'NESM'
+#define NES_MOVIE_VERSION 1
+
+enum nes_movie_flags : uint32_t
+{
+    nes_movie_flags_none = 0,
+
+    // Each frame has a hash of RAM + frame buffer at the end of the frame
+    nes_movie_flags_has_hash = 0x1,
+};
+
+struct nes_movie_header
+{
+    uint32_t magic;             // NES_MOVIE_MAGIC
+    uint32_t version;           // NES_MOVIE_VERSION
+    uint32_t flags;             // nes_movie_flags
+    uint32_t frame_count;
+    uint32_t prg_rom_size;      // size of PRG ROM of the recorded ROM - as a sanity check
+    uint32_t chr_rom_size;      // size of CHR ROM of the recorded ROM
+};
+
+struct nes_movie_frame
+{
+    nes_button_flags buttons[NES_MAX_PLAYER];
+    uint64_t hash;              // hash of RAM + frame buffer at the end of the frame if there is one
+};
+
+class nes_movie
+{
+public :
+    nes_movie()
+    {
+        clear();
+    }
+
+public :
+    // Save / load the movie file. Returns false if file can't be read or isn't a valid movie
+    bool save(const char *path);
+    bool load(const char *path);
+
+    void clear()
+    {
+        _flags = nes_movie_flags_none;
+        _prg_rom_size = _chr_rom_size = 0;
+        _frames.clear();
+    }
+
+    bool has_hash() const { return _flags & nes_movie_flags_has_hash; }
+    uint32_t frame_count() const { return uint32_t(_frames.size()); }
+    vector<nes_movie_frame> &frames() { return _frames; }
+    const vector<nes_movie_frame> &frames() const { return _frames; }
+
+    // Whether the movie is recorded with the ROM currently loaded in system
+    bool is_rom_loaded(nes_system &system) const;
+
+    // Hash of internal RAM and the last completed frame
+    static uint64_t hash(nes_system &system);
+
+private :
+    friend class nes_movie_recorder;
+
+    uint32_t _flags;
+    uint32_t _prg_rom_size;
+    uint32_t _chr_rom_size;
+    vector<nes_movie_frame> _frames;
+};
+
+//
+// Polls the actual device once per frame when recording
+//
+class nes_movie_record_input : public nes_input_device
+{
+public :
+    nes_movie_record_input(shared_ptr<nes_input_device> device)
+        :_device(device), _buttons(nes_button_flags_none), _polled(false)
+    {
+    }
+
+    virtual nes_button_flags poll_status()
+    {
+        if (!_polled)
+        {
+            _buttons = _device->poll_status();
+            _polled = true;
+        }
+
+        return _buttons;
+    }
+
+    // Start of a new frame - poll the device again when asked
+    void next_frame()
+    {
+        _buttons = nes_button_flags_none;
+        _polled = false;
+    }
+
+    nes_button_flags buttons() { return _buttons; }
+
+private :
+    shared_ptr<nes_input_device> _device;
+    nes_button_flags _buttons;
+    bool _polled;
+};
+
+//
+// Hands out recorded input of the current frame when playing back
+//
+class nes_movie_play_input : public nes_input_device
+{
+public :
+    nes_movie_play_input()
+        :_buttons(nes_button_flags_none)
+    {
+    }
+
+    virtual nes_button_flags poll_status() { return _buttons; }
+
+    void set_buttons(nes_button_flags buttons) { _buttons = buttons; }
+
+private :
+    nes_button_flags _buttons;
+};
+
+//
+// Records input into movie - start recording right after load_rom, and run frames through run_frame
+//
+class nes_movie_recorder
+{
+public :
+    nes_movie_recorder(nes_system &system, nes_movie &movie, bool record_hash = true);
+    ~nes_movie_recorder();
+
+public :
+    // Record input from device as the given player
+    void register_input(int id, shared_ptr<nes_input_device> device);
+
+    // Run one frame and record its input (and hash)
+    nes_system_event run_frame();
+
+private :
+    nes_system &_system;
+    nes_movie &_movie;
+    shared_ptr<nes_movie_record_input> _inputs[NES_MAX_PLAYER];
+};
+
+//
+// Plays back a movie - start playing right after load_rom, and run frames through run_frame or play
+// No rendering or timing is involved so this runs as fast as emulation goes
+//
+class nes_movie_player
+{
+public :
+    nes_movie_player(nes_system &system, const nes_movie &movie);
+    ~nes_movie_player();
+
+public :
+    // Whether all frames are played
+    bool is_done() { return _frame_id >= _movie.frame_count(); }
+
+    // Index of the next frame to be played
+    uint32_t frame_id() { return _frame_id; }
+
+    //
+    // Run the next frame with recorded input. If verify is true and the movie has hashes, returns false
+    // if the result doesn't match the recording
+    //
+    bool run_frame(bool verify = true);
+
+    //
+    // Play the rest of the movie - returns false at the first frame that doesn't match (which is then
+    // frame_id() - 1), or if the movie isn't recorded with the loaded ROM
+    //
+    bool play(bool verify = true);
+
+private :
+    nes_system &_system;
+    const nes_movie &_movie;
+    uint32_t _frame_id;
+    shared_ptr<nes_movie_play_input> _inputs[NES_MAX_PLAYER];
+};
@@ -12,6 +12,14 @@
 // http://wiki.nesdev.com/w/index.php/PPU_memory_map
 #define PPU_VRAM_SIZE 0x4000
 
+// Pattern tables $0000~$1FFF are mapped in 1KB banks so that mappers can switch CHR by pointer
+#define PPU_CHR_BANK_SIZE 0x400
+#define PPU_CHR_BANK_COUNT 8
+
+// Pattern tables $0000~$1FFF have 512 tiles of 16 bytes each
+#define PPU_TILE_SIZE 0x10
+#define PPU_TILE_COUNT 0x200
+
 // OAM (Object Attribute Memory) - internal memory inside PPU for 64 sprites of 4 bytes each
 // wiki.nesdev.com/w/index.php/PPU_OAM
 #define PPU_OAM_SIZE 0x100
@@ -61,6 +69,7 @@
 #define PPUMASK_EMPHASIZE_RED 0x20
 #define PPUMASK_EMPHASIZE_GREEN 0x40
 #define PPUMASK_EMPHASIZE_BLUE 0x80
+#define PPUMASK_EMPHASIZE_MASK 0xe0
 
 // Previously written to a PPU register (due to not being updated for this address)
 #define PPUSTATUS_LATCH_MASK 0x1f
@@ -94,11 +103,27 @@
 #define PPU_SPRITE_ATTR_HORIZONTAL_FLIP 0x40
 #define PPU_SPRITE_ATTR_VERTICAL_FLIP 0x80
 
+// Sprite line buffer entry - 6-bit color plus opaque flag
+#define PPU_SPRITE_LINE_COLOR_MASK 0x3f
+#define PPU_SPRITE_LINE_OPAQUE 0x80
+
 class nes_system;
 class nes_mapper;
 
 using namespace std;
 
+// Pixel formats PPU can output directly into a caller provided surface
+enum nes_pixel_format
+{
+    nes_pixel_format_argb8888,      // 32-bit 0xAARRGGBB, same as SDL_PIXELFORMAT_ARGB8888
+    nes_pixel_format_rgb565,        // 16-bit, same as SDL_PIXELFORMAT_RGB565
+    nes_pixel_format_yuy2,          // packed YUV 4:2:2 - Y0 U Y1 V for every 2 pixels, same as SDL_PIXELFORMAT_YUY2
+};
+
+// 64 colors for each of the 8 color emphasis combinations in PPUMASK
+#define PPU_PALETTE_COLOR_COUNT 0x40
+#define PPU_PALETTE_LUT_SIZE 0x200
+
 enum nes_ppu_state
 {
     nes_ppu_state_power_on,     // initial
@@ -127,6 +152,12 @@ public :
     {
         _vram = make_unique<uint8_t[]>(PPU_VRAM_SIZE);
         _oam = make_unique<uint8_t[]>(PPU_OAM_SIZE);
+
+        _output_pixels = nullptr;
+        _output_pitch = 0;
+        _logic_only = false;
+        _output_format = nes_pixel_format_argb8888;
+        set_palette(s_default_palette);
     }
     
     ~nes_ppu();
@@ -141,22 +172,43 @@ public :
 
     virtual void step_to(nes_cycle_t count);
 
+    virtual void save_state(nes_state_writer &writer);
+    virtual void load_state(nes_state_reader &reader);
+
 public :
     void init();
 
     void step_ppu(nes_ppu_cycle_t cycle);
     void fetch_tile();
+    void fetch_tile_scanline();
+    void fetch_name_table_byte();
+    void fetch_attribute_table_byte();
+    void increment_x();
+    void increment_y();
+    void step_scanline_fast();
     void fetch_tile_pipeline();
     void fetch_sprite_pipeline();
     void fetch_sprite(uint8_t sprite_id);
+    void compose_sprite_line();
+    void output_scanline(int scanline);
+    void build_palette_lut();
 
     bool is_ready() { return _master_cycle > nes_ppu_cycle_t(29658); }
 
-    void stop_after_frame(uint32_t frame) 
-    {
-        _auto_stop = true;
-        _stop_after_frame = frame; 
-    }
+    // The earliest cycle where PPU might need to signal the rest of the system (NMI at vblank, end of frame,
+    // or any other event nes_system::run_until is waiting for)
+    // Until then CPU can run freely and PPU only needs to catch up when its state is accessed
+    nes_cycle_t next_event_cycle() { return _next_event_cycle; }
+    void update_next_event_cycle();
+
+    // The earliest cycle after <from> where PPUSTATUS flags might change on their own (not counting reads
+    // clearing them). Used by CPU to fast forward loops polling PPUSTATUS
+    nes_cycle_t next_status_change_cycle(nes_cycle_t from);
+
+    nes_cycle_t cycle() { return _master_cycle; }
+    uint32_t frame_count() { return _frame_count; }
+    int cur_scanline() { return _cur_scanline; }
+    nes_ppu_cycle_t scanline_cycle() { return _scanline_cycle; }
 
     bool is_render_off() { return !_show_bg && !_show_sprites; }
 
@@ -164,6 +216,15 @@ public :
 
     void set_mirroring(nes_mapper_flags flags);
 
+    //
+    // Map CHR ROM directly into pattern tables - reads go straight into the ROM and writes are ignored
+    // addr and size need to be 1KB aligned
+    //
+    void map_chr(uint16_t addr, uint8_t *chr, size_t size);
+
+    // Map pattern tables back to CHR RAM (the first 8KB of VRAM)
+    void reset_chr_banks();
+
     uint8_t *frame_buffer()
     {
         // Return the completed buffer
@@ -173,6 +234,28 @@ public :
             return _frame_buffer_1;
     }
 
+    //
+    // Write final pixels of each completed scanline directly into the given surface (such as a locked SDL
+    // texture), resolved through the palette LUT including PPUMASK grayscale and color emphasis
+    // pitch is in bytes. Pass nullptr to stop writing to the surface
+    //
+    void set_output(void *pixels, int pitch, nes_pixel_format format);
+
+    // Set the 64 NES colors (0x00RRGGBB) used for output - defaults to s_default_palette
+    void set_palette(const uint32_t *rgb);
+
+    //
+    // Skip generating pixels for frames nobody is going to look at (fast forward, repeating the same input
+    // many frames, etc). Everything the game can observe still happens exactly the same - VRAM fetches and
+    // address increments, sprite evaluation/overflow, sprite 0 hit, vblank/NMI timing - but frame_buffer()
+    // and the output surface are left as they are. Takes effect from the next scanline, so set it at frame
+    // boundaries such as between run_frame calls
+    //
+    void set_logic_only(bool logic_only) { _logic_only = logic_only; }
+    bool is_logic_only() { return _logic_only; }
+
+    static const uint32_t s_default_palette[PPU_PALETTE_COLOR_COUNT];
+
     void swap_buffer()
     {
         if (_frame_buffer == _frame_buffer_1)
@@ -188,6 +271,10 @@ public :
     //
     uint8_t read_byte(uint16_t addr)
     {
+        // pattern tables
+        if (addr < 0x2000)
+            return _chr_read_banks[addr >> 10][addr & (PPU_CHR_BANK_SIZE - 1)];
+
         redirect_addr(addr);
 
         if (addr >= PPU_VRAM_SIZE)
@@ -198,6 +285,18 @@ public :
 
     void write_byte(uint16_t addr, uint8_t val)
     {
+        // pattern tables - only CHR RAM is writable
+        if (addr < 0x2000)
+        {
+            uint8_t *bank = _chr_write_banks[addr >> 10];
+            if (bank)
+            {
+                bank[addr & (PPU_CHR_BANK_SIZE - 1)] = val;
+                _tile_cache_valid[addr / PPU_TILE_SIZE] = false;
+            }
+            return;
+        }
+
         redirect_addr(addr);
         
         if (addr >= PPU_VRAM_SIZE)
@@ -206,15 +305,6 @@ public :
         _vram[addr] = val;
     }
 
-    void write_bytes(uint16_t addr, uint8_t *src, size_t src_size)
-    {
-        if (addr + src_size > PPU_VRAM_SIZE)
-            return;
-
-        redirect_addr(addr);
-        memcpy_s(_vram.get() + addr, PPU_VRAM_SIZE - addr, src, src_size);
-    }
-
     void redirect_addr(uint16_t &addr)
     {
         if ((addr & 0xff00) == 0x3f00)
@@ -310,6 +400,7 @@ public :
         _show_bg = val & PPUMASK_SHOW_BACKGROUND;
         _show_sprites = val & PPUMASK_SHOW_SPRITES;
         _gray_scale_mode = val & PPUMASK_GRAYSCALE;
+        _color_emphasis = (val & PPUMASK_EMPHASIZE_MASK) >> 5;
     }
 
     uint8_t read_PPUSTATUS()
@@ -480,26 +571,39 @@ private :
 
         return read_byte(tile_addr | (bitplane << 3) | tile_row_index);
     }
-   
-    uint8_t read_pattern_table_column_8x16_sprite(uint8_t tile_index, uint8_t bitplane, uint8_t tile_row_index)
+
+    //
+    // Returns the 8 pixels (2-bit palette index each) of one row of the tile at tile_addr, left to right
+    // Tiles are decoded on first use and stay cached until CHR is written or remapped
+    //
+    const uint8_t *get_tile_row(uint16_t tile_addr, uint8_t tile_row_index, bool flip)
     {
-        // TTTTTTB - T is tile number and B is tile pattern table select $0000 or $1000
-        uint16_t tile_addr = ((uint16_t(tile_index) & 0x1) << 12) | ((uint16_t(tile_index) & ~0x1) << 4);
-
-        // the tiles are laid like this:
-        // 0-7: bitplane 0 for top tile       --> tile row index 0-7
-        // 8-f: bitplane 1 for top tile       --> tile row index 0-7
-        // 10-17: bitplane 0 for bottom tile  --> tile row index 8-f
-        // 18-1f: bitplane 1 for bottom tile  --> tile row index 8-f
-        return read_byte(tile_addr | (bitplane << 3) | (tile_row_index & 0x7) | ((tile_row_index & 0x8) << 1));
+        uint16_t tile_id = tile_addr / PPU_TILE_SIZE;
+        if (!_tile_cache_valid[tile_id])
+            decode_tile(tile_id);
+
+        if (flip)
+            return _tile_cache_flipped[tile_id][tile_row_index];
+        return _tile_cache[tile_id][tile_row_index];
     }
 
+    void decode_tile(uint16_t tile_id);
+    void invalidate_tiles(uint16_t addr, size_t size);
+
  private :
     nes_system *_system;
 
     unique_ptr<uint8_t[]> _vram;
     unique_ptr<uint8_t[]> _oam;
 
+    uint8_t *_chr_read_banks[PPU_CHR_BANK_COUNT];       // 1KB pattern table banks - CHR ROM or CHR RAM
+    uint8_t *_chr_write_banks[PPU_CHR_BANK_COUNT];      // nullptr for CHR ROM
+
+    // pre-decoded pattern table tiles - see get_tile_row
+    uint8_t _tile_cache[PPU_TILE_COUNT][8][8];
+    uint8_t _tile_cache_flipped[PPU_TILE_COUNT][8][8];  // horizontally flipped
+    bool _tile_cache_valid[PPU_TILE_COUNT];
+
     // PPUCTRL data
     uint16_t _name_tbl_addr;
     uint16_t _bg_pattern_tbl_addr;
@@ -513,6 +617,7 @@ private :
     bool _show_bg;
     bool _show_sprites;
     bool _gray_scale_mode;
+    uint8_t _color_emphasis;            // PPUMASK bit 7/6/5 - blue/green/red
 
     // PPUSTATUS
     uint8_t _latch;
@@ -541,13 +646,12 @@ private :
     uint8_t _vram_read_buf;             // delayed VRAM reads
 
     nes_cycle_t _master_cycle;
+    nes_cycle_t _next_event_cycle;      // see next_event_cycle
     nes_ppu_cycle_t _scanline_cycle;
     int _cur_scanline;
     uint32_t _frame_count;
 
     bool _protect_register;             // protect PPU register from destructive reads temporarily
-    uint32_t _stop_after_frame;              // stop after X frames - useful for testing
-    int _auto_stop;                     // stop after X frames - useful for testing
 
     // rendering states
     uint8_t _tile_index;                // tile index from name table - it consists of 
@@ -567,8 +671,18 @@ private :
     bool _has_sprite_0;                 // first active sprite is sprite 0 - needed in sprite 0 hit detection
     bool _mask_oam_read;                // OAM read is masked at certain sprite evaluation stage to always return FF
     uint8_t _sprite_pos_y;              // last sprite Y read
+    uint8_t _sprite_line[PPU_SCREEN_X];         // top most sprite pixel of current scanline - see compose_sprite_line
+    uint8_t _sprite_line_front[PPU_SCREEN_X];   // top most sprite pixel that is in front of background
 
     shared_ptr<nes_mapper> _mapper;
 
+    // output surface - see set_output
+    void *_output_pixels;
+    int _output_pitch;
+    nes_pixel_format _output_format;
+    bool _logic_only;                   // see set_logic_only
+    uint32_t _palette_rgb[PPU_PALETTE_COLOR_COUNT];
+    uint32_t _palette_lut[PPU_PALETTE_LUT_SIZE];    // emphasis << 6 | color - in _output_format
+
     nes_mapper_flags _mirroring_flags;  // mapper flags masked by mirroring flags
 };
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+class nes_system;
+
+//
+// Rewind history for a nes_system, built on top of savestates
+//
+// Every interval-th snapshot is a keyframe, and the ones in between are deltas against that keyframe. Both are
+// stored XOR+RLE encoded (a keyframe is simply a delta against all zeros), so restoring any frame only needs
+// to decode its keyframe and at most one delta. A full state is ~80KB but frame-to-frame only a handful of
+// bytes in RAM/VRAM/OAM and the registers change, so a delta is typically a few hundred bytes
+//
+// Everything lives in a ring buffer preallocated up front - once the buffer is full the oldest keyframe and
+// its deltas are dropped to make room. Nothing is allocated per frame after the first keyframe
+//
+class nes_rewind
+{
+public :
+    //
+    // buffer_size  - size of the ring buffer in bytes, which decides how much history to keep
+    // max_frames   - maximum number of snapshots to keep regardless of how small they are
+    // interval     - a keyframe is taken every interval snapshots
+    //
+    nes_rewind(size_t buffer_size, uint32_t max_frames, uint32_t interval = 60);
+
+public :
+    //
+    // Capture the current state of system into the history - typically called once per frame before running
+    // the frame. Returns false if the snapshot doesn't fit in the buffer at all
+    //
+    bool push(nes_system &system);
+
+    //
+    // Go back the given number of snapshots: pops them from the history and restores the system to the oldest
+    // one popped. Returns false if there isn't that much history
+    //
+    bool rewind(nes_system &system, uint32_t frames = 1);
+
+    // Drop the entire history
+    void clear();
+
+    // Number of snapshots currently available
+    uint32_t frame_count() { return _count; }
+
+    // Bytes in the buffer taken by snapshots - wasted space at the end of buffer when wrapping isn't included
+    size_t used_size();
+
+private :
+    struct nes_rewind_entry
+    {
+        size_t offset;              // offset into _buf
+        uint32_t size;              // encoded size
+        uint32_t index;             // 0 for keyframe, otherwise position of the delta after its keyframe
+    };
+
+    nes_rewind_entry &entry(uint32_t i) { return _entries[(_first + i) % _entries.size()]; }
+    nes_rewind_entry &oldest() { return entry(0); }
+    nes_rewind_entry &newest() { return entry(_count - 1); }
+
+    // Drop the oldest keyframe and all its deltas
+    void drop_oldest();
+
+    // XOR+RLE encode state against base (nullptr means all zeros) into _encoded
+    void encode(const vector<uint8_t> &state, const uint8_t *base);
+
+    // Decode snapshot into state, which needs to already have the base (or zeros) in it
+    void decode(const nes_rewind_entry &snapshot, vector<uint8_t> &state);
+
+private :
+    vector<uint8_t> _buf;                   // ring buffer holding encoded snapshots
+    vector<nes_rewind_entry> _entries;      // ring of snapshots in _buf, oldest first
+    uint32_t _first;                        // oldest entry in _entries
+    uint32_t _count;                        // number of snapshots
+    uint32_t _interval;
+
+    vector<uint8_t> _state;                 // current state, reused between push / rewind
+    vector<uint8_t> _keyframe;              // decoded keyframe that new deltas are against
+    bool _keyframe_valid;                   // whether _keyframe is the keyframe of the newest snapshot
+    vector<uint8_t> _encoded;               // scratch for encoding before copying into _buf
+};
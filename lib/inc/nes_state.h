@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <vector>
+
+using namespace std;
+
+//
+// Savestate is a flat binary blob:
+// nes_state_header followed by every component's state in a fixed order (see nes_system::save_state)
+// Components write their fields raw in native layout - states are meant to be loaded by the same build
+// of the emulator (same machine), which is what rewind / search workloads need
+//
+#define NES_STATE_MAGIC 0x5353454e     // 'NESS'
+#define NES_STATE_VERSION 2
+
+struct nes_state_header
+{
+    uint32_t magic;             // NES_STATE_MAGIC
+    uint32_t version;           // NES_STATE_VERSION
+    uint32_t size;              // total size including header
+    uint32_t prg_rom_size;      // size of PRG ROM of the loaded ROM - states are only valid for the same ROM
+    uint32_t chr_rom_size;      // size of CHR ROM of the loaded ROM
+};
+
+// Pointers into RAM/ROM (such as bank mappings) are saved as region + offset so that they can be restored
+// into a different nes_system instance
+enum nes_state_region : uint8_t
+{
+    nes_state_region_none,      // nullptr
+    nes_state_region_ram,       // RAM / VRAM owned by the component
+    nes_state_region_rom,       // PRG / CHR ROM owned by the mapper
+};
+
+class nes_state_writer
+{
+public :
+    // Appends to the end of buf
+    nes_state_writer(vector<uint8_t> &buf)
+        :_buf(buf)
+    {
+    }
+
+    template <typename T>
+    void write(const T &val)
+    {
+        write_bytes(&val, sizeof(T));
+    }
+
+    void write_bytes(const void *data, size_t size)
+    {
+        size_t offset = _buf.size();
+        _buf.resize(offset + size);
+        memcpy(_buf.data() + offset, data, size);
+    }
+
+    void write_ptr(const uint8_t *ptr, const uint8_t *ram, size_t ram_size, const uint8_t *rom, size_t rom_size)
+    {
+        nes_state_region region = nes_state_region_none;
+        uint32_t offset = 0;
+        if (ptr >= ram && ptr < ram + ram_size)
+        {
+            region = nes_state_region_ram;
+            offset = uint32_t(ptr - ram);
+        }
+        else if (ptr >= rom && ptr < rom + rom_size)
+        {
+            region = nes_state_region_rom;
+            offset = uint32_t(ptr - rom);
+        }
+        else
+        {
+            assert(ptr == nullptr);
+        }
+
+        write(region);
+        write(offset);
+    }
+
+    size_t size() { return _buf.size(); }
+
+private :
+    vector<uint8_t> &_buf;
+};
+
+class nes_state_reader
+{
+public :
+    nes_state_reader(const uint8_t *data, size_t size)
+        :_data(data), _size(size), _offset(0)
+    {
+    }
+
+    template <typename T>
+    void read(T &val)
+    {
+        read_bytes(&val, sizeof(T));
+    }
+
+    void read_bytes(void *dest, size_t size)
+    {
+        // size is validated against the header before any component reads
+        assert(_offset + size <= _size);
+        memcpy(dest, _data + _offset, size);
+        _offset += size;
+    }
+
+    uint8_t *read_ptr(uint8_t *ram, uint8_t *rom)
+    {
+        nes_state_region region;
+        uint32_t offset;
+        read(region);
+        read(offset);
+
+        if (region == nes_state_region_ram)
+            return ram + offset;
+        else if (region == nes_state_region_rom)
+            return rom + offset;
+
+        return nullptr;
+    }
+
+    size_t offset() { return _offset; }
+
+private :
+    const uint8_t *_data;
+    size_t _size;
+    size_t _offset;
+};
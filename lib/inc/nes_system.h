@@ -5,6 +5,7 @@
 #include <vector>
 
 #include "nes_component.h"
+#include "nes_trace.h"
 
 using namespace std;
 
@@ -13,6 +14,8 @@ class nes_memory;
 class nes_apu;
 class nes_ppu;
 class nes_input;
+class nes_mapper;
+class nes_trace_ring;
 
 enum nes_rom_exec_mode
 {
@@ -26,6 +29,26 @@ enum nes_rom_exec_mode
     nes_rom_exec_mode_reset
 };
 
+//
+// Events that nes_system::run_until can return at
+// These can be combined as a mask
+//
+enum nes_system_event
+{
+    nes_system_event_none = 0,
+
+    // Start of a new scanline (dot 0)
+    nes_system_event_scanline = 0x1,
+
+    // Start of vertical blanking (scanline 241 dot 1) - this is where NMI fires
+    nes_system_event_vblank = 0x2,
+
+    // Start of a new frame (scanline 0 dot 0) - at this point the frame buffer has a complete frame
+    nes_system_event_frame = 0x4,
+
+    // Emulation is stopped - either by stop() or by the CPU (BRK, KIL, infinite loop, etc)
+    nes_system_event_stop = 0x8,
+};
 
 //
 // The NES system hardware that manages all the invidual components - CPU, PPU, APU, RAM, etc
@@ -48,11 +71,50 @@ public :
     void run_rom(const char *rom_path, nes_rom_exec_mode mode);
 
     void load_rom(const char *rom_path, nes_rom_exec_mode mode);
+
+    // Load a ROM that is already loaded by nes_rom_loader - pass a clone() to share the ROM between instances
+    void load_mapper(shared_ptr<nes_mapper> mapper, nes_rom_exec_mode mode);
+
+    //
+    // Capture the entire emulation state (CPU, RAM, PPU, OAM, input, mapper) into a flat binary blob, replacing
+    // the contents of state. Reusing the same vector avoids allocations - this is cheap enough to do every frame
+    //
+    void save_state(vector<uint8_t> &state);
+
+    //
+    // Restore a state captured by save_state with the same ROM loaded. Emulation continues exactly as if it
+    // were the instance that saved it. Returns false (and leaves everything untouched) if state is invalid
+    //
+    bool load_state(const uint8_t *state, size_t size);
+    bool load_state(const vector<uint8_t> &state) { return load_state(state.data(), state.size()); }
+
+    //
+    // Create a child that continues exactly from the current state, without reloading the ROM
+    // ROM is shared and RAM is shared copy-on-write (256 byte pages) between this and the child, so
+    // branching thousands of times is cheap. fork_to reuses an existing instance (which is powered on
+    // and reset to the forked state) to avoid allocating a new one each time
+    //
+    unique_ptr<nes_system> fork();
+    void fork_to(nes_system &child);
    
     nes_cpu     *cpu()      { return _cpu.get();   }
     nes_memory  *ram()      { return _ram.get();   }
     nes_ppu     *ppu()      { return _ppu.get();   } 
     nes_input   *input()    { return _input.get(); }
+    nes_apu     *apu()      { return _apu.get();   }
+
+    //
+    // Binary tracing of CPU instructions, interrupts, I/O register access and PPU scanlines/frames into a
+    // ring buffer of <capacity> records owned by this instance. nullptr when tracing isn't enabled
+    // Compiled out along with NES_TRACE4 when NES_TRACE_MAX_LEVEL is below diag
+    //
+#if NES_TRACE_MAX_LEVEL >= 4
+    nes_trace_ring *trace_ring() { return _trace_ring.get(); }
+#else
+    nes_trace_ring *trace_ring() { return nullptr; }
+#endif
+    void enable_trace_ring(size_t capacity);
+    void disable_trace_ring();
 
 public :
     //
@@ -62,12 +124,44 @@ public :
     // 2. Let CPU drive cycle - and other component "catch up"
     // 3. Let each component own their own thread - and synchronizes at cycle granuarity
     //
-    // I think option #1 will produce the most accurate timing without subjecting too much to OS resource
-    // management.
+    // Originally this was option #1 in lock step with 1 cycle at a time, but most of the time was spent
+    // in the stepping overhead itself. Now it is option #2 - CPU runs freely and PPU only catches up
+    // when CPU touches PPU state (registers, OAMDMA, mapper) or when PPU may need to signal something
+    // (NMI at vblank, end of frame). The timing observed by CPU is exactly the same as in lock step,
+    // so it is perfectly fine to step a large amount of cycles at a time.
     //
     void step(nes_cycle_t count);
 
-    bool stop_requested() { return _stop_requested; }
+    //
+    // Run until any of the events in event_mask happens (or emulation stops) and returns the events hit
+    // PPU stops exactly at the event boundary, while CPU stops at the first instruction boundary at or after
+    // it. Resuming afterwards is exactly the same as if we never stopped, so this is fully deterministic.
+    //
+    nes_system_event run_until(int event_mask);
+
+    // Run until start of the next frame - the completed frame is available in ppu()->frame_buffer()
+    nes_system_event run_frame() { return run_until(nes_system_event_frame); }
+
+    //
+    // Run <count> frames, such as repeating the same input for a while - only the last frame is rendered and
+    // the ones before only run game logic (see nes_ppu::set_logic_only)
+    //
+    nes_system_event run_frames(int count);
+
+    // Run <count> scanlines, ending at the start of a scanline
+    nes_system_event run_scanlines(int count);
+
+    // Called by components when an event happens
+    void signal_event(nes_system_event event)
+    {
+        if (_event_mask & event)
+            _event_hit |= event;
+    }
+
+    int event_mask() { return _event_mask; }
+
+    // Either stop is requested or we are returning to run_until caller
+    bool stop_requested() { return _stop_requested || _event_hit; }
 
 private :
     // Emulation loop that is only intended for tests 
@@ -75,6 +169,8 @@ private :
 
     void init();
 
+    void get_rom_size(uint32_t &prg_rom_size, uint32_t &chr_rom_size);
+
 private :
     nes_cycle_t _master_cycle;              // keep count of current cycle
 
@@ -82,8 +178,14 @@ private :
     unique_ptr<nes_memory> _ram;
     unique_ptr<nes_ppu> _ppu;
     unique_ptr<nes_input> _input;
+    unique_ptr<nes_apu> _apu;
+
+    unique_ptr<nes_trace_ring> _trace_ring;
 
     vector<nes_component *> _components;
 
     bool _stop_requested;                   // useful for internal testing, or synchronization to rendering
+
+    int _event_mask;                        // events we want to stop at in run_until
+    int _event_hit;                         // events that happened in run_until
 };
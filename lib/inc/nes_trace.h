@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <fstream>
+#include <string>
 
 using namespace std;
 
@@ -57,9 +60,12 @@ public :
         _level = level;
     }
 
+    nes_tracer_level level() { return _level; }
+
     bool is_enabled(nes_tracer_level level)
     {
-        return (level <= _level);
+        // Nothing to write to unless initialized
+        return (_stream && level <= _level);
     }
 
     void trace(string str)
@@ -74,9 +80,13 @@ public :
             _stream->write(str, strlen(str));
     }
 
+    //
+    // Each thread has its own tracer so that independent nes_system instances can run on different threads
+    // (such as nes_batch_runner) without stepping on each other - INIT_TRACE only affects the current thread
+    //
     static nes_tracer &get()
     {
-        static nes_tracer s_trace;
+        static thread_local nes_tracer s_trace;
         return s_trace;
     }
 
@@ -109,13 +119,42 @@ static ostream& operator <<(ostream &os, const string &str)
 #define NES_LOG(expr) nes_tracer::get().stream() << expr << endl;
 #define NES_LOG_IF(level, expr) if (nes_tracer::get().is_enabled(level)) { nes_tracer::get().stream() << expr << endl; }
 
+//
+// Trace levels above NES_TRACE_MAX_LEVEL are compiled out entirely - no level check or formatting is left
+// on the hot path (such as NES_TRACE4 for every instruction). Set it with the NESCHAN_TRACE_MAX_LEVEL
+// CMake option. Defaults to keeping everything
+//
+#ifndef NES_TRACE_MAX_LEVEL
+#define NES_TRACE_MAX_LEVEL 5
+#endif
+
 #define NES_TRACE0(expr) NES_LOG_IF(nes_tracer_level_quiet, expr);
+
+#if NES_TRACE_MAX_LEVEL >= 1
 #define NES_TRACE1(expr) NES_LOG_IF(nes_tracer_level_minimal, expr); 
+#else
+#define NES_TRACE1(expr) ;
+#endif
+
+#if NES_TRACE_MAX_LEVEL >= 2
 #define NES_TRACE2(expr) NES_LOG_IF(nes_tracer_level_normal, expr);
+#else
+#define NES_TRACE2(expr) ;
+#endif
+
+#if NES_TRACE_MAX_LEVEL >= 3
 #define NES_TRACE3(expr) NES_LOG_IF(nes_tracer_level_detail, expr);
+#else
+#define NES_TRACE3(expr) ;
+#endif
+
+#if NES_TRACE_MAX_LEVEL >= 4
 #define NES_TRACE4(expr) NES_LOG_IF(nes_tracer_level_diag, expr);
+#else
+#define NES_TRACE4(expr) ;
+#endif
 
-#ifdef _DEBUG
+#if defined(_DEBUG) && NES_TRACE_MAX_LEVEL >= 5
 #define NES_DBG(expr) NES_LOG_IF(nes_tracer_level_debug, expr); 
 #else
 #define NES_DBG(expr) ;
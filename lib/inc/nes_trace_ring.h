@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+//
+// Binary event tracing for a single nes_system
+//
+// Unlike nes_tracer (text, one flush per line, shared by the whole thread), each event here is a fixed-size
+// record copied into a lock-free single producer / single consumer ring buffer owned by the nes_system, so
+// tracing every instruction costs a few nanoseconds. Turning records into text happens later - either on a
+// background thread streaming to a file, or when dumping the ring
+//
+enum nes_trace_event : uint8_t
+{
+    nes_trace_event_instruction,        // about to execute op_code at pc with registers a/x/y/p/s
+    nes_trace_event_nmi,                // NMI interrupt
+    nes_trace_event_oam_dma,            // OAMDMA from data
+    nes_trace_event_reg_read,           // CPU reads I/O register data, value is what's read
+    nes_trace_event_reg_write,          // CPU writes value to I/O register data
+    nes_trace_event_scanline,           // PPU starts scanline data
+    nes_trace_event_frame,              // PPU starts frame data
+    nes_trace_event_irq,                // IRQ interrupt, data is the nes_irq_source mask
+};
+
+struct nes_trace_record
+{
+    int64_t cycle;                      // master cycle (PPU cycles) of the event
+    uint16_t pc;                        // PC of the instruction, or where CPU is at
+    uint8_t type;                       // nes_trace_event
+    uint8_t op_code;
+    uint8_t operand[2];                 // operand bytes following op_code
+    uint8_t a, x, y, p, s;              // CPU registers before executing the instruction
+    uint8_t value;                      // register value read / written
+    uint32_t data;                      // event specific - see nes_trace_event
+};
+
+static_assert(sizeof(nes_trace_record) == 24, "nes_trace_record should be kept small and fixed size");
+
+class nes_trace_ring
+{
+public :
+    // capacity is the number of records, rounded up to power of 2
+    nes_trace_ring(size_t capacity);
+    ~nes_trace_ring();
+
+public :
+    //
+    // Producer side - only called by the thread running the nes_system
+    //
+    // Without a consumer the ring keeps the last <capacity> records (a flight recorder) - the oldest get
+    // overwritten. When streaming, the producer waits for the consumer instead so nothing is lost
+    //
+    void record(const nes_trace_record &rec)
+    {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        if (head - _tail.load(std::memory_order_acquire) > _mask)
+        {
+            if (_streaming)
+            {
+                while (head - _tail.load(std::memory_order_acquire) > _mask)
+                    std::this_thread::yield();
+            }
+            else
+            {
+                // nobody else touches tail without streaming
+                _tail.store(head - _mask, std::memory_order_relaxed);
+            }
+        }
+
+        _records[head & _mask] = rec;
+        _head.store(head + 1, std::memory_order_release);
+    }
+
+    void record_event(nes_trace_event type, int64_t cycle, uint16_t pc, uint32_t data, uint8_t value = 0)
+    {
+        nes_trace_record rec = {};
+        rec.type = type;
+        rec.cycle = cycle;
+        rec.pc = pc;
+        rec.data = data;
+        rec.value = value;
+        record(rec);
+    }
+
+    //
+    // Consumer side - either the streaming thread, or the thread running nes_system when not streaming
+    //
+
+    // Pop up to count records into dest - returns number of records popped
+    size_t read(nes_trace_record *dest, size_t count);
+
+    // Number of records currently in the ring
+    size_t size() { return size_t(_head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire)); }
+
+    // Total records ever recorded
+    uint64_t total_count() { return _head.load(std::memory_order_acquire); }
+
+    // Pop all records in the ring and write them as text
+    bool dump(const char *path);
+
+    //
+    // Format records as text on a background thread into path while emulation is running
+    // stop_streaming writes out everything left and waits for the thread
+    //
+    bool start_streaming(const char *path);
+    void stop_streaming();
+
+    // Text form of the record - instructions follow the Nintendulator format used by nes_cpu::get_op_str
+    static void format(string &str, const nes_trace_record &rec);
+
+private :
+    void stream_loop(FILE *file);
+    void write_records(FILE *file, string &text, nes_trace_record *buf, size_t count);
+
+private :
+    unique_ptr<nes_trace_record[]> _records;
+    uint64_t _mask;
+
+    // head and tail on their own cache lines so that producer and consumer don't fight over them
+    alignas(64) atomic<uint64_t> _head;
+    alignas(64) atomic<uint64_t> _tail;
+
+    alignas(64) atomic<bool> _streaming;
+    atomic<bool> _stop_requested;
+    thread _stream_thread;
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+using namespace std;
+
+//
+// Lock-free handoff of completed frames from the emulation thread to the render thread
+//
+// There are three frames: back (being written by the producer), ready (the latest published frame), and
+// front (being read by the consumer). Publishing swaps back and ready, and acquiring swaps ready and front,
+// so neither side ever waits for the other or touches a frame the other side owns. When the consumer is
+// slower, older frames get replaced by newer ones - the sequence numbers tell how many were dropped
+//
+class nes_triple_buffer
+{
+    // _ready holds a frame index, plus a flag telling whether it has been published since the last acquire
+    static const uint8_t s_index_mask = 0x3;
+    static const uint8_t s_new_flag = 0x4;
+
+public :
+    nes_triple_buffer(size_t frame_size)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            _frames[i] = make_unique<uint8_t[]>(frame_size);
+            memset(_frames[i].get(), 0, frame_size);
+            _sequences[i] = 0;
+        }
+
+        _frame_size = frame_size;
+        _back = 0;
+        _ready = 1;
+        _front = 2;
+    }
+
+public :
+    //
+    // Producer (emulation thread)
+    //
+
+    // The frame to write next
+    uint8_t *back() { return _frames[_back].get(); }
+
+    // Make the back frame the latest one for the consumer, and start writing into another frame
+    void publish(uint64_t sequence)
+    {
+        _sequences[_back] = sequence;
+
+        // release - frame content and sequence are visible to whoever acquires this index
+        uint8_t prev = _ready.exchange(_back | s_new_flag, std::memory_order_acq_rel);
+        _back = prev & s_index_mask;
+    }
+
+    //
+    // Consumer (render thread)
+    //
+
+    // Take the latest published frame as front - returns false if nothing new was published since last time
+    bool acquire()
+    {
+        if (!(_ready.load(std::memory_order_relaxed) & s_new_flag))
+            return false;
+
+        uint8_t prev = _ready.exchange(_front, std::memory_order_acq_rel);
+        _front = prev & s_index_mask;
+        return true;
+    }
+
+    const uint8_t *front() { return _frames[_front].get(); }
+
+    // Sequence passed to publish for the front frame - 0 if nothing is acquired yet
+    uint64_t front_sequence() { return _sequences[_front]; }
+
+    size_t frame_size() { return _frame_size; }
+
+private :
+    unique_ptr<uint8_t[]> _frames[3];
+    uint64_t _sequences[3];
+    size_t _frame_size;
+
+    uint8_t _back;                      // owned by producer
+    uint8_t _front;                     // owned by consumer
+
+    // index of the ready frame, with s_new_flag if consumer hasn't acquired it yet
+    // on its own cache line so that producer and consumer don't fight over it
+    alignas(64) atomic<uint8_t> _ready;
+};
@@ -2,18 +2,18 @@
 
 //
 // Called when mapper is loaded into memory
-// Useful when all you need is a one-time memcpy
+// PRG banks are mapped directly into CPU address space - bank switching only updates the page table
 //
 void nes_mapper_mmc1::on_load_ram(nes_memory &mem)
 {
-    mem.set_bytes(0x8000, _prg_rom->data() + _prg_rom->size() - 0x8000, 0x8000);
+    mem.map_prg(0x8000, _prg_rom->data() + _prg_rom->size() - 0x8000, 0x8000);
 
     _mem = &mem;
 }
 
 //
 // Called when mapper is loaded into PPU
-// Useful when all you need is a one-time memcpy
+// CHR banks are mapped directly into pattern tables as they are switched
 //
 void nes_mapper_mmc1::on_load_ppu(nes_ppu &ppu)
 {
@@ -40,6 +40,20 @@ void nes_mapper_mmc1::get_info(nes_mapper_info &info)
         info.flags = nes_mapper_flags(info.flags | nes_mapper_flags_vertical_mirroring);
 }
 
+void nes_mapper_mmc1::save_state(nes_state_writer &writer)
+{
+    writer.write(_bit_latch);
+    writer.write(_reg);
+    writer.write(_control);
+}
+
+void nes_mapper_mmc1::load_state(nes_state_reader &reader)
+{
+    reader.read(_bit_latch);
+    reader.read(_reg);
+    reader.read(_control);
+}
+
 void nes_mapper_mmc1::write_reg(uint16_t addr, uint8_t val) 
 {
     if (val & 0x80)
@@ -120,7 +134,7 @@ void nes_mapper_mmc1::write_chr_bank_0(uint8_t val)
     if (_chr_rom->size() < addr + size)
         return;
 
-    _ppu->write_bytes(0x0000, _chr_rom->data() + addr, size);
+    _ppu->map_chr(0x0000, _chr_rom->data() + addr, size);
 }
 
 /*
@@ -142,7 +156,7 @@ void nes_mapper_mmc1::write_chr_bank_1(uint8_t val)
         if (_chr_rom->size() < addr + size)
             return;
 
-        _ppu->write_bytes(0x1000, _chr_rom->data() + addr, size);
+        _ppu->map_chr(0x1000, _chr_rom->data() + addr, size);
     }
 }
 
@@ -157,25 +171,37 @@ RPPPP
 */
 void nes_mapper_mmc1::write_prg_bank(uint8_t val)
 {
+    // Banks are mapped by pointer and stay live until next switch. Like the real MMC1, bank bits past the end
+    // of PRG ROM are simply ignored (PRG ROM sizes are powers of two) - so everything is always remapped
+    uint32_t bank_count = uint32_t(_prg_rom->size() / 0x4000);
+    uint32_t bank = (val & 0xf) & (bank_count - 1);
+
     if (_control & 0x8)
     {
         // 16KB mode
+        uint32_t offset = bank * 0x4000;
         if (_control & 0x4)
         {
             // fix last bank at $C000 and switch 16KB bank at $8000
-            _mem->set_bytes(0x8000, _prg_rom->data() + (val & 0xf) * 0x4000, 0x4000);
-            _mem->set_bytes(0xc000, _prg_rom->data() + _prg_rom->size() - 0x4000, 0x4000);
+            _mem->map_prg(0x8000, _prg_rom->data() + offset, 0x4000);
+            _mem->map_prg(0xc000, _prg_rom->data() + _prg_rom->size() - 0x4000, 0x4000);
         }
         else
         {
             // fix first bank at $8000 and switch 16KB bank at $C000
-            _mem->set_bytes(0x8000, _prg_rom->data(), 0x4000);
-            _mem->set_bytes(0xc000, _prg_rom->data() + (val & 0xf) * 0x4000, 0x4000);
+            _mem->map_prg(0x8000, _prg_rom->data(), 0x4000);
+            _mem->map_prg(0xc000, _prg_rom->data() + offset, 0x4000);
         }
     }
+    else if (bank_count < 2)
+    {
+        // 32KB mode with only 16KB of PRG ROM - it shows up in both halves
+        _mem->map_prg(0x8000, _prg_rom->data(), 0x4000);
+        _mem->map_prg(0xc000, _prg_rom->data(), 0x4000);
+    }
     else
     {
-        // 32KB mode at $8000
-        _mem->set_bytes(0x8000, _prg_rom->data() + (val & 0xe) * 0x4000, 0x8000);
+        // 32KB mode at $8000 - low bit of bank number is ignored
+        _mem->map_prg(0x8000, _prg_rom->data() + (bank & ~1) * 0x4000, 0x8000);
     }
 }
\ No newline at end of file
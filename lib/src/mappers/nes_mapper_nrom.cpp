@@ -2,28 +2,27 @@
 
 //
 // Called when mapper is loaded into memory
-// Useful when all you need is a one-time memcpy
+// PRG ROM is mapped directly into CPU address space - no copy needed
 //
 void nes_mapper_nrom::on_load_ram(nes_memory &mem)
 {
-    // memcpy
-    mem.set_bytes(0x8000, _prg_rom->data(), _prg_rom->size());
+    mem.map_prg(0x8000, _prg_rom->data(), _prg_rom->size());
 
     if (_prg_rom->size() == 0x4000)
     {
         // "map" 0xC000 to 0x8000
-        mem.set_bytes(0xc000, _prg_rom->data(), _prg_rom->size());
+        mem.map_prg(0xc000, _prg_rom->data(), _prg_rom->size());
     }
 }
 
 //
 // Called when mapper is loaded into PPU
-// Useful when all you need is a one-time memcpy
+// CHR ROM is mapped directly into pattern tables - no CHR ROM means CHR RAM
 //
 void nes_mapper_nrom::on_load_ppu(nes_ppu &ppu)
 {
-    // memcpy
-    ppu.write_bytes(0x0000, _chr_rom->data(), _chr_rom->size());
+    if (_chr_rom->size() > 0)
+        ppu.map_chr(0x0000, _chr_rom->data(), _chr_rom->size());
 }
 
 //
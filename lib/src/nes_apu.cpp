@@ -1,16 +1,829 @@
 #include "stdafx.h"
 
 #include <nes_apu.h>
+#include <blip_buf.h>
 
-uint8_t nes_apu_pulse_channel::s_duty_cycle[4][8] = {
-    { 0, 0, 0, 0, 0, 0, 0, 1 },
-    { 0, 0, 0, 0, 0, 0, 1, 1 },
-    { 0, 0, 0, 0, 1, 1, 1, 1 },
-    { 1, 1, 1, 1, 1, 1, 0, 0 },
-    /*
+#define NES_CPU_CLOCK_HZ (21477272.0 / 12)
+
+// Mixed output at full volume on every channel - leaves some headroom for the high-pass in blip_buf
+#define APU_MIXER_MAX_AMPLITUDE 24000
+
+//
+// Mixer
+//
+
+nes_apu_mixer::nes_apu_mixer()
+    :_blip(nullptr), _sample_rate(0), _rate_adjust(1.0), _buffer_size(0), _frame_start(0)
+{
+    // http://wiki.nesdev.com/w/index.php/APU_Mixer#Lookup_Table
+    _pulse_table[0] = 0;
+    for (int i = 1; i < 31; ++i)
+        _pulse_table[i] = int(APU_MIXER_MAX_AMPLITUDE * 95.52 / (8128.0 / i + 100));
+
+    _tnd_table[0] = 0;
+    for (int i = 1; i < 203; ++i)
+        _tnd_table[i] = int(APU_MIXER_MAX_AMPLITUDE * 163.67 / (24329.0 / i + 100));
+
+    init();
+}
+
+nes_apu_mixer::~nes_apu_mixer()
+{
+    if (_blip)
+        blip_delete(_blip);
+}
+
+void nes_apu_mixer::init()
+{
+    memset(_levels, 0, sizeof(_levels));
+    memset(_mixed_levels, 0, sizeof(_mixed_levels));
+    _amplitude = 0;
+    _frame_start = 0;
+    for (auto &events : _events)
+        events.clear();
+
+    if (_blip)
+        blip_clear(_blip);
+}
+
+void nes_apu_mixer::set_sample_rate(int sample_rate)
+{
+    if (_blip)
+    {
+        blip_delete(_blip);
+        _blip = nullptr;
+    }
+
+    _sample_rate = sample_rate;
+    if (sample_rate == 0)
+        return;
+
+    // Enough for a few frames in case nobody reads the samples in time - anything older gets dropped
+    _buffer_size = sample_rate / 4;
+    _blip = blip_new(_buffer_size);
+    blip_set_rates(_blip, NES_CPU_CLOCK_HZ / _rate_adjust, sample_rate);
+
+    for (auto &events : _events)
+        events.reserve(0x1000);
+
+    // Start from wherever channels are right now
+    memcpy(_mixed_levels, _levels, sizeof(_levels));
+    _amplitude = mix(_mixed_levels);
+    blip_add_delta(_blip, 0, _amplitude);
+}
+
+void nes_apu_mixer::set_rate_adjust(double ratio)
+{
+    assert(ratio > 0);
+
+    // blip_buf carries the fractional sample position over, so this can change between any two frames
+    _rate_adjust = ratio;
+    if (_blip)
+        blip_set_rates(_blip, NES_CPU_CLOCK_HZ / ratio, _sample_rate);
+}
+
+void nes_apu_mixer::end_frame(int64_t time)
+{
+    if (!_blip)
+    {
+        _frame_start = time;
+        return;
+    }
+
+    // Merge changes from all channels in time order
+    size_t pos[nes_apu_channel_count] = {};
+    for (;;)
+    {
+        int next = -1;
+        uint32_t next_time = UINT32_MAX;
+        for (int i = 0; i < nes_apu_channel_count; ++i)
+        {
+            if (pos[i] < _events[i].size() && _events[i][pos[i]].time < next_time)
+            {
+                next = i;
+                next_time = _events[i][pos[i]].time;
+            }
+        }
+
+        if (next < 0)
+            break;
+
+        _mixed_levels[next] = _events[next][pos[next]++].level;
+        int amplitude = mix(_mixed_levels);
+        if (amplitude != _amplitude)
+        {
+            blip_add_delta(_blip, next_time, amplitude - _amplitude);
+            _amplitude = amplitude;
+        }
+    }
+
+    for (auto &events : _events)
+        events.clear();
+
+    // Make room for this frame by dropping the oldest samples
+    int frame_samples = int(double(time - _frame_start) * _sample_rate * _rate_adjust / NES_CPU_CLOCK_HZ) + 1;
+    int excess = blip_samples_avail(_blip) + frame_samples - _buffer_size;
+    if (excess > 0)
+    {
+        NES_TRACE1("[NES_APU] Audio buffer full - " << excess << " samples dropped");
+        _discard.resize(excess);
+        blip_read_samples(_blip, _discard.data(), excess, 0);
+    }
+
+    blip_end_frame(_blip, uint32_t(time - _frame_start));
+    _frame_start = time;
+}
+
+void nes_apu_mixer::reset_frame(int64_t time)
+{
+    for (auto &events : _events)
+        events.clear();
+
+    _frame_start = time;
+}
+
+int nes_apu_mixer::samples_available()
+{
+    return _blip ? blip_samples_avail(_blip) : 0;
+}
+
+int nes_apu_mixer::read_samples(int16_t *buf, int count)
+{
+    if (!_blip)
+        return 0;
+
+    return blip_read_samples(_blip, buf, count, 0);
+}
+
+//
+// Channels
+//
+
+const uint8_t nes_apu_length_counter::s_length_table[32] = {
+    10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+    12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+// Output of each step in time order - the sequencer counts down so the wiki lists them in the opposite order
+const uint8_t nes_apu_pulse_channel::s_duty_cycle[4][8] = {
     { 0, 1, 0, 0, 0, 0, 0, 0 },         // 12.5%
     { 0, 1, 1, 0, 0, 0, 0, 0 },         // 25%
     { 0, 1, 1, 1, 1, 0, 0, 0 },         // 50%
     { 1, 0, 0, 1, 1, 1, 1, 1 }          // 25% negated
-    */
-};
\ No newline at end of file
+};
+
+const uint8_t nes_apu_triangle_channel::s_sequence[32] = {
+    15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+// NTSC, in CPU cycles
+const uint16_t nes_apu_noise_channel::s_period_table[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+// NTSC, in CPU cycles
+const uint16_t nes_apu_dmc_channel::s_rate_table[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+// Number of timer clocks at <next_clock> + n * period before <to>
+static int64_t clocks_before(int64_t next_clock, int64_t period, int64_t to)
+{
+    return (to - next_clock + period - 1) / period;
+}
+
+void nes_apu_pulse_channel::run(nes_apu_mixer &mixer, int64_t to)
+{
+    if (_next_clock >= to)
+        return;
+
+    // Timer is clocked every other CPU cycle
+    int64_t period = (int64_t(_timer) + 1) * 2;
+    if (is_silent())
+    {
+        // Output stays 0 wherever the sequencer is
+        int64_t count = clocks_before(_next_clock, period, to);
+        _sequence = uint8_t((_sequence + count) & 0x7);
+        _next_clock += count * period;
+        return;
+    }
+
+    uint8_t volume = _envelope.output();
+    while (_next_clock < to)
+    {
+        _sequence = (_sequence + 1) & 0x7;
+        mixer.set_level(_channel, _next_clock, s_duty_cycle[_duty_cycle][_sequence] ? volume : 0);
+        _next_clock += period;
+    }
+}
+
+void nes_apu_triangle_channel::run(nes_apu_mixer &mixer, int64_t to)
+{
+    if (_next_clock >= to)
+        return;
+
+    int64_t period = int64_t(_timer) + 1;
+    int64_t count = clocks_before(_next_clock, period, to);
+    if (!_length_counter.is_active() || _linear_counter == 0)
+    {
+        // Sequencer is stopped
+        _next_clock += count * period;
+        return;
+    }
+
+    if (_timer < 2)
+    {
+        // Ultrasonic - it would only come out as a DC offset anyway, so hold the output like most emulators do
+        // instead of generating ~900K changes per second
+        _sequence = uint8_t((_sequence + count) & 0x1f);
+        _next_clock += count * period;
+        return;
+    }
+
+    while (_next_clock < to)
+    {
+        _sequence = (_sequence + 1) & 0x1f;
+        mixer.set_level(nes_apu_channel_triangle, _next_clock, s_sequence[_sequence]);
+        _next_clock += period;
+    }
+}
+
+void nes_apu_noise_channel::run(nes_apu_mixer &mixer, int64_t to)
+{
+    if (_next_clock >= to)
+        return;
+
+    int64_t period = _timer;
+    if (is_silent())
+    {
+        // Nobody can hear where the LFSR is - don't bother clocking it (up to ~450K times per second)
+        _next_clock += clocks_before(_next_clock, period, to) * period;
+        return;
+    }
+
+    uint8_t volume = _envelope.output();
+    int feedback_bit = _mode ? 6 : 1;
+    while (_next_clock < to)
+    {
+        uint16_t feedback = (_shift ^ (_shift >> feedback_bit)) & 1;
+        _shift = (_shift >> 1) | (feedback << 14);
+        mixer.set_level(nes_apu_channel_noise, _next_clock, (_shift & 1) ? 0 : volume);
+        _next_clock += period;
+    }
+}
+
+void nes_apu_dmc_channel::fetch(nes_memory *mem)
+{
+    _buffer = mem->get_byte(_cur_addr);
+    _buffer_empty = false;
+    _cur_addr = (_cur_addr == 0xffff) ? 0x8000 : _cur_addr + 1;
+
+    if (--_bytes_remaining == 0)
+    {
+        if (_loop)
+        {
+            _cur_addr = _sample_addr;
+            _bytes_remaining = _sample_length;
+        }
+        else if (_irq_enabled)
+        {
+            _irq = true;
+        }
+    }
+}
+
+void nes_apu_dmc_channel::run(nes_apu_mixer &mixer, nes_memory *mem, int64_t to)
+{
+    if (_next_clock >= to)
+        return;
+
+    int64_t period = _timer;
+    if (_silence && _buffer_empty && _bytes_remaining == 0)
+    {
+        // Nothing to play until the sample restarts - only the output cycle moves along
+        int64_t count = clocks_before(_next_clock, period, to);
+        _bits_remaining = uint8_t((int64_t(_bits_remaining) - 1 - count % 8 + 8) % 8 + 1);
+        _next_clock += count * period;
+        return;
+    }
+
+    while (_next_clock < to)
+    {
+        if (!_silence)
+        {
+            if (_shift & 1)
+            {
+                if (_output_level <= 125)
+                    _output_level += 2;
+            }
+            else if (_output_level >= 2)
+            {
+                _output_level -= 2;
+            }
+
+            _shift >>= 1;
+            mixer.set_level(nes_apu_channel_dmc, _next_clock, _output_level);
+        }
+
+        if (--_bits_remaining == 0)
+        {
+            // start a new output cycle
+            _bits_remaining = 8;
+            if (_buffer_empty)
+            {
+                _silence = true;
+            }
+            else
+            {
+                _silence = false;
+                _shift = _buffer;
+                _buffer_empty = true;
+                if (_bytes_remaining > 0)
+                    fetch(mem);
+            }
+        }
+
+        _next_clock += period;
+    }
+}
+
+void nes_apu_envelope::save_state(nes_state_writer &writer)
+{
+    writer.write(_start);
+    writer.write(_loop);
+    writer.write(_constant_volume);
+    writer.write(_volume);
+    writer.write(_divider);
+    writer.write(_decay);
+}
+
+void nes_apu_envelope::load_state(nes_state_reader &reader)
+{
+    reader.read(_start);
+    reader.read(_loop);
+    reader.read(_constant_volume);
+    reader.read(_volume);
+    reader.read(_divider);
+    reader.read(_decay);
+}
+
+void nes_apu_length_counter::save_state(nes_state_writer &writer)
+{
+    writer.write(_enabled);
+    writer.write(_halt);
+    writer.write(_counter);
+}
+
+void nes_apu_length_counter::load_state(nes_state_reader &reader)
+{
+    reader.read(_enabled);
+    reader.read(_halt);
+    reader.read(_counter);
+}
+
+void nes_apu_pulse_channel::save_state(nes_state_writer &writer)
+{
+    _envelope.save_state(writer);
+    _length_counter.save_state(writer);
+    writer.write(_duty_cycle);
+    writer.write(_sequence);
+    writer.write(_timer);
+    writer.write(_next_clock);
+    writer.write(_sweep_enabled);
+    writer.write(_sweep_period);
+    writer.write(_sweep_negate);
+    writer.write(_sweep_shift);
+    writer.write(_sweep_reload);
+    writer.write(_sweep_divider);
+}
+
+void nes_apu_pulse_channel::load_state(nes_state_reader &reader)
+{
+    _envelope.load_state(reader);
+    _length_counter.load_state(reader);
+    reader.read(_duty_cycle);
+    reader.read(_sequence);
+    reader.read(_timer);
+    reader.read(_next_clock);
+    reader.read(_sweep_enabled);
+    reader.read(_sweep_period);
+    reader.read(_sweep_negate);
+    reader.read(_sweep_shift);
+    reader.read(_sweep_reload);
+    reader.read(_sweep_divider);
+}
+
+void nes_apu_triangle_channel::save_state(nes_state_writer &writer)
+{
+    _length_counter.save_state(writer);
+    writer.write(_control);
+    writer.write(_linear_reload);
+    writer.write(_linear_reload_value);
+    writer.write(_linear_counter);
+    writer.write(_sequence);
+    writer.write(_timer);
+    writer.write(_next_clock);
+}
+
+void nes_apu_triangle_channel::load_state(nes_state_reader &reader)
+{
+    _length_counter.load_state(reader);
+    reader.read(_control);
+    reader.read(_linear_reload);
+    reader.read(_linear_reload_value);
+    reader.read(_linear_counter);
+    reader.read(_sequence);
+    reader.read(_timer);
+    reader.read(_next_clock);
+}
+
+void nes_apu_noise_channel::save_state(nes_state_writer &writer)
+{
+    _envelope.save_state(writer);
+    _length_counter.save_state(writer);
+    writer.write(_mode);
+    writer.write(_shift);
+    writer.write(_timer);
+    writer.write(_next_clock);
+}
+
+void nes_apu_noise_channel::load_state(nes_state_reader &reader)
+{
+    _envelope.load_state(reader);
+    _length_counter.load_state(reader);
+    reader.read(_mode);
+    reader.read(_shift);
+    reader.read(_timer);
+    reader.read(_next_clock);
+}
+
+void nes_apu_dmc_channel::save_state(nes_state_writer &writer)
+{
+    writer.write(_irq_enabled);
+    writer.write(_loop);
+    writer.write(_irq);
+    writer.write(_timer);
+    writer.write(_next_clock);
+    writer.write(_output_level);
+    writer.write(_sample_addr);
+    writer.write(_sample_length);
+    writer.write(_cur_addr);
+    writer.write(_bytes_remaining);
+    writer.write(_buffer);
+    writer.write(_buffer_empty);
+    writer.write(_shift);
+    writer.write(_bits_remaining);
+    writer.write(_silence);
+}
+
+void nes_apu_dmc_channel::load_state(nes_state_reader &reader)
+{
+    reader.read(_irq_enabled);
+    reader.read(_loop);
+    reader.read(_irq);
+    reader.read(_timer);
+    reader.read(_next_clock);
+    reader.read(_output_level);
+    reader.read(_sample_addr);
+    reader.read(_sample_length);
+    reader.read(_cur_addr);
+    reader.read(_bytes_remaining);
+    reader.read(_buffer);
+    reader.read(_buffer_empty);
+    reader.read(_shift);
+    reader.read(_bits_remaining);
+    reader.read(_silence);
+}
+
+//
+// APU
+//
+
+//
+// Frame counter sequences, in CPU cycles since the sequence started
+// http://wiki.nesdev.com/w/index.php/APU_Frame_Counter
+//
+#define APU_FRAME_QUARTER   0x1
+#define APU_FRAME_HALF      0x2
+#define APU_FRAME_IRQ       0x4
+#define APU_FRAME_WRAP      0x8         // start over - this is also cycle 0 of the next sequence
+
+struct nes_apu_frame_step
+{
+    int32_t cycle;
+    uint8_t flags;
+};
+
+static const nes_apu_frame_step s_frame_steps[2][6] = {
+    // 4-step
+    {
+        { 7457,  APU_FRAME_QUARTER },
+        { 14913, APU_FRAME_QUARTER | APU_FRAME_HALF },
+        { 22371, APU_FRAME_QUARTER },
+        { 29828, APU_FRAME_IRQ },
+        { 29829, APU_FRAME_QUARTER | APU_FRAME_HALF | APU_FRAME_IRQ },
+        { 29830, APU_FRAME_IRQ | APU_FRAME_WRAP },
+    },
+    // 5-step
+    {
+        { 7457,  APU_FRAME_QUARTER },
+        { 14913, APU_FRAME_QUARTER | APU_FRAME_HALF },
+        { 22371, APU_FRAME_QUARTER },
+        { 29829, 0 },
+        { 37281, APU_FRAME_QUARTER | APU_FRAME_HALF },
+        { 37282, APU_FRAME_WRAP },
+    }
+};
+
+nes_apu::nes_apu()
+    :_pulse_1(nes_apu_channel_pulse_1), _pulse_2(nes_apu_channel_pulse_2)
+{
+}
+
+nes_apu::~nes_apu()
+{
+}
+
+void nes_apu::power_on(nes_system *system)
+{
+    _system = system;
+    _mem = system->ram();
+
+    init();
+}
+
+void nes_apu::reset()
+{
+    init();
+}
+
+void nes_apu::init()
+{
+    _cycle = 0;
+
+    _mixer.init();
+    _pulse_1.init();
+    _pulse_2.init();
+    _triangle.init();
+    _noise.init();
+    _dmc.init();
+
+    // Power up as if $4017 was written with 0, except that frame IRQ starts out inhibited
+    _frame_counter_mode = 0;
+    _irq_inhibit = true;
+    _frame_irq = false;
+    reset_frame_counter(0);
+
+    update_irq();
+    update_next_event_cycle();
+}
+
+void nes_apu::save_state(nes_state_writer &writer)
+{
+    writer.write(_cycle);
+    _pulse_1.save_state(writer);
+    _pulse_2.save_state(writer);
+    _triangle.save_state(writer);
+    _noise.save_state(writer);
+    _dmc.save_state(writer);
+
+    writer.write(_frame_counter_mode);
+    writer.write(_irq_inhibit);
+    writer.write(_frame_irq);
+    writer.write(_frame_start);
+    writer.write(_frame_step);
+    writer.write(_frame_next);
+}
+
+void nes_apu::load_state(nes_state_reader &reader)
+{
+    reader.read(_cycle);
+    _pulse_1.load_state(reader);
+    _pulse_2.load_state(reader);
+    _triangle.load_state(reader);
+    _noise.load_state(reader);
+    _dmc.load_state(reader);
+
+    reader.read(_frame_counter_mode);
+    reader.read(_irq_inhibit);
+    reader.read(_frame_irq);
+    reader.read(_frame_start);
+    reader.read(_frame_step);
+    reader.read(_frame_next);
+
+    // Audio continues from the new state
+    _mixer.reset_frame(_cycle);
+    update_outputs();
+
+    update_irq();
+    update_next_event_cycle();
+}
+
+void nes_apu::step_to(nes_cycle_t count)
+{
+    int64_t to = duration_cast<nes_cpu_cycle_t>(count).count();
+    if (to <= _cycle)
+        return;
+
+    while (_frame_next <= to)
+    {
+        run_channels(_frame_next);
+        clock_frame_counter();
+    }
+
+    run_channels(to);
+
+    update_irq();
+    update_next_event_cycle();
+}
+
+void nes_apu::run_channels(int64_t to)
+{
+    _pulse_1.run(_mixer, to);
+    _pulse_2.run(_mixer, to);
+    _triangle.run(_mixer, to);
+    _noise.run(_mixer, to);
+    _dmc.run(_mixer, _mem, to);
+
+    _cycle = to;
+}
+
+void nes_apu::update_outputs()
+{
+    _pulse_1.update_output(_mixer, _cycle);
+    _pulse_2.update_output(_mixer, _cycle);
+    _triangle.update_output(_mixer, _cycle);
+    _noise.update_output(_mixer, _cycle);
+    _dmc.update_output(_mixer, _cycle);
+}
+
+void nes_apu::clock_frame_counter()
+{
+    const nes_apu_frame_step &step = s_frame_steps[_frame_counter_mode][_frame_step];
+
+    if (step.flags & APU_FRAME_QUARTER)
+    {
+        _pulse_1.quarter_frame();
+        _pulse_2.quarter_frame();
+        _triangle.quarter_frame();
+        _noise.quarter_frame();
+    }
+
+    if (step.flags & APU_FRAME_HALF)
+    {
+        _pulse_1.half_frame();
+        _pulse_2.half_frame();
+        _triangle.half_frame();
+        _noise.half_frame();
+    }
+
+    if ((step.flags & APU_FRAME_IRQ) && !_irq_inhibit)
+        _frame_irq = true;
+
+    if (step.flags & (APU_FRAME_QUARTER | APU_FRAME_HALF))
+        update_outputs();
+
+    if (step.flags & APU_FRAME_WRAP)
+    {
+        reset_frame_counter(_frame_next);
+    }
+    else
+    {
+        _frame_step++;
+        _frame_next = _frame_start + s_frame_steps[_frame_counter_mode][_frame_step].cycle;
+    }
+}
+
+void nes_apu::reset_frame_counter(int64_t start)
+{
+    _frame_start = start;
+    _frame_step = 0;
+    _frame_next = start + s_frame_steps[_frame_counter_mode][0].cycle;
+}
+
+void nes_apu::update_irq()
+{
+    _system->cpu()->set_irq(nes_irq_source_apu, _frame_irq || _dmc.irq());
+}
+
+void nes_apu::update_next_event_cycle()
+{
+    int64_t next = _dmc.next_irq_cycle();
+    if (!_irq_inhibit && !_frame_irq)
+    {
+        for (int i = _frame_step; i < 6; ++i)
+        {
+            const nes_apu_frame_step &step = s_frame_steps[_frame_counter_mode][i];
+            if (step.flags & APU_FRAME_IRQ)
+            {
+                if (_frame_start + step.cycle < next)
+                    next = _frame_start + step.cycle;
+                break;
+            }
+            if (step.flags & APU_FRAME_WRAP)
+                break;
+        }
+    }
+
+    _next_event_cycle = (next == INT64_MAX) ? nes_cycle_t(INT64_MAX) : nes_cycle_t(nes_cpu_cycle_t(next));
+}
+
+void nes_apu::write_reg(uint16_t addr, uint8_t val)
+{
+    switch (addr)
+    {
+    case 0x4000: _pulse_1.write_duty(val); break;
+    case 0x4001: _pulse_1.write_sweep(val); break;
+    case 0x4002: _pulse_1.write_timer_low(val); break;
+    case 0x4003: _pulse_1.write_length_counter(val); break;
+    case 0x4004: _pulse_2.write_duty(val); break;
+    case 0x4005: _pulse_2.write_sweep(val); break;
+    case 0x4006: _pulse_2.write_timer_low(val); break;
+    case 0x4007: _pulse_2.write_length_counter(val); break;
+    case 0x4008: _triangle.write_linear_counter(val); break;
+    case 0x400a: _triangle.write_timer_low(val); break;
+    case 0x400b: _triangle.write_length_counter(val); break;
+    case 0x400c: _noise.write_volume(val); break;
+    case 0x400e: _noise.write_period(val); break;
+    case 0x400f: _noise.write_length_counter(val); break;
+    case 0x4010: _dmc.write_flags(val); break;
+    case 0x4011: _dmc.write_direct_load(val); break;
+    case 0x4012: _dmc.write_sample_addr(val); break;
+    case 0x4013: _dmc.write_sample_length(val); break;
+    case 0x4015: write_status(val); return;
+    case 0x4017: write_frame_counter(val); return;
+    default: return;
+    }
+
+    update_outputs();
+    update_irq();
+    update_next_event_cycle();
+}
+
+void nes_apu::write_status(uint8_t val)
+{
+    _pulse_1.set_enabled(val & 0x1);
+    _pulse_2.set_enabled(val & 0x2);
+    _triangle.set_enabled(val & 0x4);
+    _noise.set_enabled(val & 0x8);
+    _dmc.set_enabled(val & 0x10, _mem);
+
+    update_outputs();
+    update_irq();
+    update_next_event_cycle();
+}
+
+uint8_t nes_apu::read_status()
+{
+    uint8_t status = 0;
+    if (_pulse_1.is_active())
+        status |= 0x1;
+    if (_pulse_2.is_active())
+        status |= 0x2;
+    if (_triangle.is_active())
+        status |= 0x4;
+    if (_noise.is_active())
+        status |= 0x8;
+    if (_dmc.is_active())
+        status |= 0x10;
+    if (_frame_irq)
+        status |= 0x40;
+    if (_dmc.irq())
+        status |= 0x80;
+
+    // Reading clears the frame interrupt flag (but not the DMC one)
+    _frame_irq = false;
+    update_irq();
+    update_next_event_cycle();
+
+    return status;
+}
+
+void nes_apu::write_frame_counter(uint8_t val)
+{
+    _frame_counter_mode = val >> 7;
+    _irq_inhibit = val & 0x40;
+    if (_irq_inhibit)
+        _frame_irq = false;
+
+    // Sequence restarts 3 or 4 CPU cycles later depending on whether the write lands on an APU cycle
+    reset_frame_counter(_cycle + ((_cycle & 1) ? 4 : 3));
+
+    // 5-step mode clocks everything right away
+    if (_frame_counter_mode)
+    {
+        _pulse_1.quarter_frame();
+        _pulse_2.quarter_frame();
+        _triangle.quarter_frame();
+        _noise.quarter_frame();
+        _pulse_1.half_frame();
+        _pulse_2.half_frame();
+        _triangle.half_frame();
+        _noise.half_frame();
+        update_outputs();
+    }
+
+    update_irq();
+    update_next_event_cycle();
+}
@@ -0,0 +1,44 @@
+#include "stdafx.h"
+
+#include "nes_audio_rate_control.h"
+
+using namespace std;
+
+// Weight of the newest level in the running average. The level jumps around by a whole device buffer depending
+// on whether the audio callback ran just before or after the update, which shouldn't wobble the pitch
+#define AUDIO_RATE_CONTROL_SMOOTHING (1.0 / 16)
+
+nes_audio_rate_control::nes_audio_rate_control(double target_level, double max_adjust)
+    :_target_level(target_level), _max_adjust(max_adjust)
+{
+    assert(target_level > 0);
+    assert(max_adjust >= 0 && max_adjust < 1);
+
+    reset();
+}
+
+void nes_audio_rate_control::reset()
+{
+    _average_level = 0;
+    _ratio = 1.0;
+    _update_count = 0;
+}
+
+double nes_audio_rate_control::update(size_t level)
+{
+    if (_update_count == 0)
+        _average_level = double(level);
+    else
+        _average_level += (double(level) - _average_level) * AUDIO_RATE_CONTROL_SMOOTHING;
+    _update_count++;
+
+    // -1 when full at twice the target, 1 when empty
+    double error = (_target_level - _average_level) / _target_level;
+    if (error > 1)
+        error = 1;
+    else if (error < -1)
+        error = -1;
+
+    _ratio = 1.0 + _max_adjust * error;
+    return _ratio;
+}
@@ -0,0 +1,210 @@
+#include "stdafx.h"
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "nes_batch.h"
+#include "nes_movie.h"
+
+using namespace std;
+
+//
+// Queue of job indices owned by a worker - the worker takes from the back, and others steal from the front
+//
+struct nes_batch_queue
+{
+    mutex lock;
+    deque<size_t> jobs;
+
+    bool pop_back(size_t &job)
+    {
+        lock_guard<mutex> guard(lock);
+        if (jobs.empty())
+            return false;
+
+        job = jobs.back();
+        jobs.pop_back();
+        return true;
+    }
+
+    bool steal_front(size_t &job)
+    {
+        lock_guard<mutex> guard(lock);
+        if (jobs.empty())
+            return false;
+
+        job = jobs.front();
+        jobs.pop_front();
+        return true;
+    }
+};
+
+static void run_job(const nes_batch_job &job, shared_ptr<nes_mapper> rom, nes_batch_result &result)
+{
+    auto start = chrono::steady_clock::now();
+
+    nes_system system;
+    system.power_on();
+
+    // Each instance needs its own mapper registers, while ROM is shared
+    system.load_mapper(rom->clone(), nes_rom_exec_mode_reset);
+
+    nes_movie movie;
+    unique_ptr<nes_movie_player> player;
+    uint32_t frame_count = job.frame_count;
+    if (!job.movie_path.empty())
+    {
+        if (!movie.load(job.movie_path.c_str()))
+        {
+            result.error = "Failed to load movie '" + job.movie_path + "'";
+            return;
+        }
+
+        if (!movie.is_rom_loaded(system))
+        {
+            result.error = "Movie '" + job.movie_path + "' isn't recorded with '" + job.rom_path + "'";
+            return;
+        }
+
+        player = make_unique<nes_movie_player>(system, movie);
+        if (frame_count == 0 || frame_count > movie.frame_count())
+            frame_count = movie.frame_count();
+    }
+
+    result.success = true;
+    for (uint32_t i = 0; i < frame_count; ++i)
+    {
+        if (job.on_frame)
+            job.on_frame(system, i);
+
+        result.frames_run++;
+        if (player)
+        {
+            if (!player->run_frame())
+            {
+                result.success = false;
+                result.error = "Frame " + to_string(i) + " doesn't match the movie";
+                break;
+            }
+        }
+        else if (system.run_frame() & nes_system_event_stop)
+        {
+            break;
+        }
+    }
+
+    result.hash = nes_movie::hash(system);
+    if (job.keep_state)
+        system.save_state(result.state);
+    if (job.keep_frame_buffer)
+    {
+        uint8_t *frame_buffer = system.ppu()->frame_buffer();
+        result.frame_buffer.assign(frame_buffer, frame_buffer + PPU_SCREEN_X * PPU_SCREEN_Y);
+    }
+
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+nes_batch_runner::nes_batch_runner(uint32_t thread_count)
+{
+    if (thread_count == 0)
+        thread_count = thread::hardware_concurrency();
+    if (thread_count == 0)
+        thread_count = 1;
+
+    _thread_count = thread_count;
+}
+
+vector<nes_batch_result> nes_batch_runner::run(const vector<nes_batch_job> &jobs)
+{
+    auto start = chrono::steady_clock::now();
+
+    vector<nes_batch_result> results(jobs.size());
+
+    // Read each ROM once up front - workers only clone the mapper
+    map<string, shared_ptr<nes_mapper>> roms;
+    vector<shared_ptr<nes_mapper>> job_roms(jobs.size());
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        auto &rom = roms[jobs[i].rom_path];
+        if (!rom)
+        {
+            try
+            {
+                rom = nes_rom_loader::load_from(jobs[i].rom_path.c_str());
+            }
+            catch (std::exception &)
+            {
+                rom = nullptr;
+            }
+        }
+
+        job_roms[i] = rom;
+        if (!rom)
+            results[i].error = "Failed to load ROM '" + jobs[i].rom_path + "'";
+    }
+
+    // Deal the jobs out round-robin - stealing evens out the rest
+    uint32_t thread_count = _thread_count;
+    if (thread_count > jobs.size())
+        thread_count = uint32_t(jobs.size());
+
+    vector<unique_ptr<nes_batch_queue>> queues;
+    for (uint32_t i = 0; i < thread_count; ++i)
+        queues.push_back(make_unique<nes_batch_queue>());
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        if (job_roms[i])
+            queues[i % thread_count]->jobs.push_back(i);
+    }
+
+    auto worker = [&](uint32_t id) {
+        while (true)
+        {
+            size_t job_id;
+            bool found = queues[id]->pop_back(job_id);
+            for (uint32_t i = 1; !found && i < thread_count; ++i)
+                found = queues[(id + i) % thread_count]->steal_front(job_id);
+
+            // Jobs are only added up front - nothing left anywhere means we are done
+            if (!found)
+                break;
+
+            try
+            {
+                run_job(jobs[job_id], job_roms[job_id], results[job_id]);
+            }
+            catch (std::exception &ex)
+            {
+                results[job_id].success = false;
+                results[job_id].error = ex.what();
+            }
+        }
+    };
+
+    vector<thread> threads;
+    for (uint32_t i = 1; i < thread_count; ++i)
+        threads.emplace_back(worker, i);
+
+    // This thread is a worker too
+    if (thread_count > 0)
+        worker(0);
+
+    for (auto &thread : threads)
+        thread.join();
+
+    _summary = nes_batch_summary();
+    _summary.job_count = uint32_t(jobs.size());
+    for (auto &result : results)
+    {
+        if (!result.success)
+            _summary.failed_count++;
+        _summary.frame_count += result.frames_run;
+    }
+    _summary.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    return results;
+}
@@ -2,19 +2,27 @@
 #include "nes_cpu.h"
 #include "nes_system.h"
 #include "nes_trace.h"
+#include "nes_apu.h"
 
 void nes_cpu::power_on(nes_system *system)
 {
     _system = system;
     _mem = system->ram();
     _ppu = system->ppu();
+    _apu = system->apu();
     _cycle = nes_cycle_t(0);
     _nmi_pending = false;
+    _irq_line = 0;
     _dma_pending = false;
 
     _is_stop_at_addr = false;
     _stop_at_infinite_loop = false;
 
+    _idle_loop_skip = true;
+    _idle_loop_check = false;
+    _idle_loop.valid = false;
+    _idle_cycles = nes_cycle_t(0);
+
     // @TODO - Simulate full power-on state
     // http://wiki.nesdev.com/w/index.php/CPU_power_up_state
     _context.P = 0x24;          // @TODO - Should be 0x34 - but temporarily set to 0x24 to match nintendulator baseline 
@@ -28,6 +36,29 @@ void nes_cpu::reset()
 
 }
 
+void nes_cpu::save_state(nes_state_writer &writer)
+{
+    writer.write(_context);
+    writer.write(_cycle);
+    writer.write(_nmi_pending);
+    writer.write(_irq_line);
+    writer.write(_dma_pending);
+    writer.write(_dma_addr);
+}
+
+void nes_cpu::load_state(nes_state_reader &reader)
+{
+    reader.read(_context);
+    reader.read(_cycle);
+    reader.read(_nmi_pending);
+    reader.read(_irq_line);
+    reader.read(_dma_pending);
+    reader.read(_dma_addr);
+
+    _idle_loop_check = false;
+    _idle_loop.valid = false;
+}
+
 void nes_cpu::poke(uint16_t addr, uint8_t value)
 { 
     _mem->set_byte(addr, value); 
@@ -37,47 +68,358 @@ void nes_cpu::step_to(nes_cycle_t new_count)
 {
     // we are asked to proceed to new_count - keep executing one instruction
     while (_cycle < new_count && !_system->stop_requested())
-        exec_one_instruction();    
-}
-
-#define IS_ALU_OP_CODE_(op, offset, mode) case nes_op_code::op##_base + offset : NES_TRACE4(get_op_str(#op, nes_addr_mode::nes_addr_mode_##mode)); op(nes_addr_mode::nes_addr_mode_##mode); break; 
-#define IS_ALU_OP_CODE(op) \
-    IS_ALU_OP_CODE_(op, 0x9, imm) \
-    IS_ALU_OP_CODE_(op, 0x5, zp) \
-    IS_ALU_OP_CODE_(op, 0x15, zp_ind_x) \
-    IS_ALU_OP_CODE_(op, 0xd, abs) \
-    IS_ALU_OP_CODE_(op, 0x1d, abs_x) \
-    IS_ALU_OP_CODE_(op, 0x19, abs_y) \
-    IS_ALU_OP_CODE_(op, 0x1, ind_x) \
-    IS_ALU_OP_CODE_(op, 0x11, ind_y)
-
-#define IS_ALU_OP_CODE_NO_IMM(op) \
-    IS_ALU_OP_CODE_(op, 0x5, zp) \
-    IS_ALU_OP_CODE_(op, 0x15, zp_ind_x) \
-    IS_ALU_OP_CODE_(op, 0xd, abs) \
-    IS_ALU_OP_CODE_(op, 0x1d, abs_x) \
-    IS_ALU_OP_CODE_(op, 0x19, abs_y) \
-    IS_ALU_OP_CODE_(op, 0x1, ind_x) \
-    IS_ALU_OP_CODE_(op, 0x11, ind_y)
-
-#define IS_RMW_OP_CODE_(op, opcode, offset, mode) case opcode + offset : NES_TRACE4(get_op_str(#op, nes_addr_mode::nes_addr_mode_##mode)); op(nes_addr_mode::nes_addr_mode_##mode); break; 
-#define IS_RMW_OP_CODE(op, opcode) \
-    IS_RMW_OP_CODE_(op, opcode, 0x6, zp) \
-    IS_RMW_OP_CODE_(op, opcode, 0xa, acc) \
-    IS_RMW_OP_CODE_(op, opcode, 0x16, zp_ind_x) \
-    IS_RMW_OP_CODE_(op, opcode, 0xe, abs) \
-    IS_RMW_OP_CODE_(op, opcode, 0x1e, abs_x)
-
-#define IS_OP_CODE(op, opcode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_imp)); op(nes_addr_mode_imp); break;
-#define IS_OP_CODE_MODE(op, opcode, mode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_##mode)); op(nes_addr_mode_##mode); break;
-
-#define IS_UNOFFICIAL_OP_CODE(op, opcode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_imp, false)); op(nes_addr_mode_imp); break;
-#define IS_UNOFFICIAL_OP_CODE_MODE(op, opcode, mode) case opcode : NES_TRACE4(get_op_str(#op, nes_addr_mode_##mode, false)); op(nes_addr_mode_##mode); break;
+    {
+        // PPU catches up lazily when we access its state, but it also needs to catch up when it might
+        // raise NMI / end the frame so that we observe those at exactly the same instruction boundary
+        if (_cycle >= _ppu->next_event_cycle())
+        {
+            _ppu->step_to(_cycle);
+            if (_system->stop_requested())
+                break;
+        }
+
+        // Same for APU raising IRQ
+        if (_cycle >= _apu->next_event_cycle())
+            _apu->step_to(_cycle);
+
+        if (_idle_loop_check && skip_idle_loop(new_count))
+            continue;
+
+        exec_one_instruction();
+    }
+}
+
+//
+// All 256 op codes - this table drives both execution (s_op_table) and disassembly (get_op_str)
+// so they can never disagree with each other
+// Columns: op code, instruction, addressing mode, cycles, +1 cycle when crossing page boundary, is official,
+// is read only (only reads memory and updates registers/flags - no writes, stack or control flow)
+//
+// Cycle counts follow http://obelisk.me.uk/6502/reference.html. Note that stores (STA) and read-modify-write
+// instructions always take the page crossing cycle, and unofficial read-modify-write instructions take 2
+// more cycles on top of that. Branches add their own extra cycles when taken.
+//
+#define NES_CPU_OP_TABLE(OP) \
+    OP(0x00, BRK, imp,        7, 0, 1, 0) \
+    OP(0x01, ORA, ind_x,      6, 0, 1, 1) \
+    OP(0x02, KIL, imp,        0, 0, 1, 0) \
+    OP(0x03, SLO, ind_x,      8, 0, 0, 0) \
+    OP(0x04, NOP, zp,         3, 0, 0, 1) \
+    OP(0x05, ORA, zp,         3, 0, 1, 1) \
+    OP(0x06, ASL, zp,         5, 0, 1, 0) \
+    OP(0x07, SLO, zp,         5, 0, 0, 0) \
+    OP(0x08, PHP, imp,        3, 0, 1, 0) \
+    OP(0x09, ORA, imm,        2, 0, 1, 1) \
+    OP(0x0a, ASL, acc,        2, 0, 1, 1) \
+    OP(0x0b, ANC, imm,        2, 0, 0, 1) \
+    OP(0x0c, NOP, abs,        4, 0, 0, 1) \
+    OP(0x0d, ORA, abs,        4, 0, 1, 1) \
+    OP(0x0e, ASL, abs,        6, 0, 1, 0) \
+    OP(0x0f, SLO, abs,        6, 0, 0, 0) \
+    OP(0x10, BPL, rel,        2, 0, 1, 0) \
+    OP(0x11, ORA, ind_y,      5, 1, 1, 1) \
+    OP(0x12, KIL, imp,        0, 0, 1, 0) \
+    OP(0x13, SLO, ind_y,      8, 0, 0, 0) \
+    OP(0x14, NOP, zp_ind_x,   4, 0, 0, 1) \
+    OP(0x15, ORA, zp_ind_x,   4, 0, 1, 1) \
+    OP(0x16, ASL, zp_ind_x,   6, 0, 1, 0) \
+    OP(0x17, SLO, zp_ind_x,   6, 0, 0, 0) \
+    OP(0x18, CLC, imp,        2, 0, 1, 1) \
+    OP(0x19, ORA, abs_y,      4, 1, 1, 1) \
+    OP(0x1a, NOP, imp,        2, 0, 0, 1) \
+    OP(0x1b, SLO, abs_y,      7, 0, 0, 0) \
+    OP(0x1c, NOP, abs_x,      4, 1, 0, 1) \
+    OP(0x1d, ORA, abs_x,      4, 1, 1, 1) \
+    OP(0x1e, ASL, abs_x,      7, 0, 1, 0) \
+    OP(0x1f, SLO, abs_x,      7, 0, 0, 0) \
+    OP(0x20, JSR, abs_jmp,    6, 0, 1, 0) \
+    OP(0x21, AND, ind_x,      6, 0, 1, 1) \
+    OP(0x22, KIL, imp,        0, 0, 1, 0) \
+    OP(0x23, RLA, ind_x,      8, 0, 0, 0) \
+    OP(0x24, BIT, zp,         3, 0, 1, 1) \
+    OP(0x25, AND, zp,         3, 0, 1, 1) \
+    OP(0x26, ROL, zp,         5, 0, 1, 0) \
+    OP(0x27, RLA, zp,         5, 0, 0, 0) \
+    OP(0x28, PLP, imp,        4, 0, 1, 0) \
+    OP(0x29, AND, imm,        2, 0, 1, 1) \
+    OP(0x2a, ROL, acc,        2, 0, 1, 1) \
+    OP(0x2b, ANC, imm,        2, 0, 0, 1) \
+    OP(0x2c, BIT, abs,        4, 0, 1, 1) \
+    OP(0x2d, AND, abs,        4, 0, 1, 1) \
+    OP(0x2e, ROL, abs,        6, 0, 1, 0) \
+    OP(0x2f, RLA, abs,        6, 0, 0, 0) \
+    OP(0x30, BMI, rel,        2, 0, 1, 0) \
+    OP(0x31, AND, ind_y,      5, 1, 1, 1) \
+    OP(0x32, KIL, imp,        0, 0, 1, 0) \
+    OP(0x33, RLA, ind_y,      8, 0, 0, 0) \
+    OP(0x34, NOP, zp_ind_x,   4, 0, 0, 1) \
+    OP(0x35, AND, zp_ind_x,   4, 0, 1, 1) \
+    OP(0x36, ROL, zp_ind_x,   6, 0, 1, 0) \
+    OP(0x37, RLA, zp_ind_x,   6, 0, 0, 0) \
+    OP(0x38, SEC, imp,        2, 0, 1, 1) \
+    OP(0x39, AND, abs_y,      4, 1, 1, 1) \
+    OP(0x3a, NOP, imp,        2, 0, 0, 1) \
+    OP(0x3b, RLA, abs_y,      7, 0, 0, 0) \
+    OP(0x3c, NOP, abs_x,      4, 1, 0, 1) \
+    OP(0x3d, AND, abs_x,      4, 1, 1, 1) \
+    OP(0x3e, ROL, abs_x,      7, 0, 1, 0) \
+    OP(0x3f, RLA, abs_x,      7, 0, 0, 0) \
+    OP(0x40, RTI, imp,        6, 0, 1, 0) \
+    OP(0x41, EOR, ind_x,      6, 0, 1, 1) \
+    OP(0x42, KIL, imp,        0, 0, 1, 0) \
+    OP(0x43, SRE, ind_x,      8, 0, 0, 0) \
+    OP(0x44, NOP, zp,         3, 0, 0, 1) \
+    OP(0x45, EOR, zp,         3, 0, 1, 1) \
+    OP(0x46, LSR, zp,         5, 0, 1, 0) \
+    OP(0x47, SRE, zp,         5, 0, 0, 0) \
+    OP(0x48, PHA, imp,        3, 0, 1, 0) \
+    OP(0x49, EOR, imm,        2, 0, 1, 1) \
+    OP(0x4a, LSR, acc,        2, 0, 1, 1) \
+    OP(0x4b, ALR, imm,        2, 0, 0, 1) \
+    OP(0x4c, JMP, abs_jmp,    3, 0, 1, 0) \
+    OP(0x4d, EOR, abs,        4, 0, 1, 1) \
+    OP(0x4e, LSR, abs,        6, 0, 1, 0) \
+    OP(0x4f, SRE, abs,        6, 0, 0, 0) \
+    OP(0x50, BVC, rel,        2, 0, 1, 0) \
+    OP(0x51, EOR, ind_y,      5, 1, 1, 1) \
+    OP(0x52, KIL, imp,        0, 0, 1, 0) \
+    OP(0x53, SRE, ind_y,      8, 0, 0, 0) \
+    OP(0x54, NOP, zp_ind_x,   4, 0, 0, 1) \
+    OP(0x55, EOR, zp_ind_x,   4, 0, 1, 1) \
+    OP(0x56, LSR, zp_ind_x,   6, 0, 1, 0) \
+    OP(0x57, SRE, zp_ind_x,   6, 0, 0, 0) \
+    OP(0x58, CLI, imp,        2, 0, 1, 0) \
+    OP(0x59, EOR, abs_y,      4, 1, 1, 1) \
+    OP(0x5a, NOP, imp,        2, 0, 0, 1) \
+    OP(0x5b, SRE, abs_y,      7, 0, 0, 0) \
+    OP(0x5c, NOP, abs_x,      4, 1, 0, 1) \
+    OP(0x5d, EOR, abs_x,      4, 1, 1, 1) \
+    OP(0x5e, LSR, abs_x,      7, 0, 1, 0) \
+    OP(0x5f, SRE, abs_x,      7, 0, 0, 0) \
+    OP(0x60, RTS, imp,        6, 0, 1, 0) \
+    OP(0x61, ADC, ind_x,      6, 0, 1, 1) \
+    OP(0x62, KIL, imp,        0, 0, 1, 0) \
+    OP(0x63, RRA, ind_x,      8, 0, 0, 0) \
+    OP(0x64, NOP, zp,         3, 0, 0, 1) \
+    OP(0x65, ADC, zp,         3, 0, 1, 1) \
+    OP(0x66, ROR, zp,         5, 0, 1, 0) \
+    OP(0x67, RRA, zp,         5, 0, 0, 0) \
+    OP(0x68, PLA, imp,        4, 0, 1, 0) \
+    OP(0x69, ADC, imm,        2, 0, 1, 1) \
+    OP(0x6a, ROR, acc,        2, 0, 1, 1) \
+    OP(0x6b, ARR, imm,        2, 0, 0, 1) \
+    OP(0x6c, JMP, ind_jmp,    5, 0, 1, 0) \
+    OP(0x6d, ADC, abs,        4, 0, 1, 1) \
+    OP(0x6e, ROR, abs,        6, 0, 1, 0) \
+    OP(0x6f, RRA, abs,        6, 0, 0, 0) \
+    OP(0x70, BVS, rel,        2, 0, 1, 0) \
+    OP(0x71, ADC, ind_y,      5, 1, 1, 1) \
+    OP(0x72, KIL, imp,        0, 0, 1, 0) \
+    OP(0x73, RRA, ind_y,      8, 0, 0, 0) \
+    OP(0x74, NOP, zp_ind_x,   4, 0, 0, 1) \
+    OP(0x75, ADC, zp_ind_x,   4, 0, 1, 1) \
+    OP(0x76, ROR, zp_ind_x,   6, 0, 1, 0) \
+    OP(0x77, RRA, zp_ind_x,   6, 0, 0, 0) \
+    OP(0x78, SEI, imp,        2, 0, 1, 0) \
+    OP(0x79, ADC, abs_y,      4, 1, 1, 1) \
+    OP(0x7a, NOP, imp,        2, 0, 0, 1) \
+    OP(0x7b, RRA, abs_y,      7, 0, 0, 0) \
+    OP(0x7c, NOP, abs_x,      4, 1, 0, 1) \
+    OP(0x7d, ADC, abs_x,      4, 1, 1, 1) \
+    OP(0x7e, ROR, abs_x,      7, 0, 1, 0) \
+    OP(0x7f, RRA, abs_x,      7, 0, 0, 0) \
+    OP(0x80, NOP, imm,        2, 0, 0, 1) \
+    OP(0x81, STA, ind_x,      6, 0, 1, 0) \
+    OP(0x82, NOP, imm,        2, 0, 0, 1) \
+    OP(0x83, SAX, ind_x,      6, 0, 0, 0) \
+    OP(0x84, STY, zp,         3, 0, 1, 0) \
+    OP(0x85, STA, zp,         3, 0, 1, 0) \
+    OP(0x86, STX, zp,         3, 0, 1, 0) \
+    OP(0x87, SAX, zp,         3, 0, 0, 0) \
+    OP(0x88, DEY, imp,        2, 0, 1, 1) \
+    OP(0x89, NOP, imm,        2, 0, 0, 1) \
+    OP(0x8a, TXA, imp,        2, 0, 1, 1) \
+    OP(0x8b, XAA, imm,        2, 0, 0, 0) \
+    OP(0x8c, STY, abs,        4, 0, 1, 0) \
+    OP(0x8d, STA, abs,        4, 0, 1, 0) \
+    OP(0x8e, STX, abs,        4, 0, 1, 0) \
+    OP(0x8f, SAX, abs,        4, 0, 0, 0) \
+    OP(0x90, BCC, rel,        2, 0, 1, 0) \
+    OP(0x91, STA, ind_y,      6, 0, 1, 0) \
+    OP(0x92, KIL, imp,        0, 0, 1, 0) \
+    OP(0x93, AHX, ind_y,      6, 0, 0, 0) \
+    OP(0x94, STY, zp_ind_x,   4, 0, 1, 0) \
+    OP(0x95, STA, zp_ind_x,   4, 0, 1, 0) \
+    OP(0x96, STX, zp_ind_y,   4, 0, 1, 0) \
+    OP(0x97, SAX, zp_ind_y,   4, 0, 0, 0) \
+    OP(0x98, TYA, imp,        2, 0, 1, 1) \
+    OP(0x99, STA, abs_y,      5, 0, 1, 0) \
+    OP(0x9a, TXS, imp,        2, 0, 1, 0) \
+    OP(0x9b, TAS, abs_y,      5, 0, 0, 0) \
+    OP(0x9c, ILL, imp,        2, 0, 0, 0) \
+    OP(0x9d, STA, abs_x,      5, 0, 1, 0) \
+    OP(0x9e, ILL, imp,        2, 0, 0, 0) \
+    OP(0x9f, AHX, abs_y,      5, 0, 0, 0) \
+    OP(0xa0, LDY, imm,        2, 0, 1, 1) \
+    OP(0xa1, LDA, ind_x,      6, 0, 1, 1) \
+    OP(0xa2, LDX, imm,        2, 0, 1, 1) \
+    OP(0xa3, LAX, ind_x,      6, 0, 0, 1) \
+    OP(0xa4, LDY, zp,         3, 0, 1, 1) \
+    OP(0xa5, LDA, zp,         3, 0, 1, 1) \
+    OP(0xa6, LDX, zp,         3, 0, 1, 1) \
+    OP(0xa7, LAX, zp,         3, 0, 0, 1) \
+    OP(0xa8, TAY, imp,        2, 0, 1, 1) \
+    OP(0xa9, LDA, imm,        2, 0, 1, 1) \
+    OP(0xaa, TAX, imp,        2, 0, 1, 1) \
+    OP(0xab, LAX, imm,        2, 0, 0, 1) \
+    OP(0xac, LDY, abs,        4, 0, 1, 1) \
+    OP(0xad, LDA, abs,        4, 0, 1, 1) \
+    OP(0xae, LDX, abs,        4, 0, 1, 1) \
+    OP(0xaf, LAX, abs,        4, 0, 0, 1) \
+    OP(0xb0, BCS, rel,        2, 0, 1, 0) \
+    OP(0xb1, LDA, ind_y,      5, 1, 1, 1) \
+    OP(0xb2, KIL, imp,        0, 0, 1, 0) \
+    OP(0xb3, LAX, ind_y,      5, 1, 0, 1) \
+    OP(0xb4, LDY, zp_ind_x,   4, 0, 1, 1) \
+    OP(0xb5, LDA, zp_ind_x,   4, 0, 1, 1) \
+    OP(0xb6, LDX, zp_ind_y,   4, 0, 1, 1) \
+    OP(0xb7, LAX, zp_ind_y,   4, 0, 0, 1) \
+    OP(0xb8, CLV, imp,        2, 0, 1, 1) \
+    OP(0xb9, LDA, abs_y,      4, 1, 1, 1) \
+    OP(0xba, TSX, imp,        2, 0, 1, 1) \
+    OP(0xbb, LAS, abs_y,      4, 1, 0, 0) \
+    OP(0xbc, LDY, abs_x,      4, 1, 1, 1) \
+    OP(0xbd, LDA, abs_x,      4, 1, 1, 1) \
+    OP(0xbe, LDX, abs_y,      4, 1, 1, 1) \
+    OP(0xbf, LAX, abs_y,      4, 1, 0, 1) \
+    OP(0xc0, CPY, imm,        2, 0, 1, 1) \
+    OP(0xc1, CMP, ind_x,      6, 0, 1, 1) \
+    OP(0xc2, NOP, imm,        2, 0, 0, 1) \
+    OP(0xc3, DCP, ind_x,      8, 0, 0, 0) \
+    OP(0xc4, CPY, zp,         3, 0, 1, 1) \
+    OP(0xc5, CMP, zp,         3, 0, 1, 1) \
+    OP(0xc6, DEC, zp,         5, 0, 1, 0) \
+    OP(0xc7, DCP, zp,         5, 0, 0, 0) \
+    OP(0xc8, INY, imp,        2, 0, 1, 1) \
+    OP(0xc9, CMP, imm,        2, 0, 1, 1) \
+    OP(0xca, DEX, imp,        2, 0, 1, 1) \
+    OP(0xcb, AXS, imm,        2, 0, 0, 1) \
+    OP(0xcc, CPY, abs,        4, 0, 1, 1) \
+    OP(0xcd, CMP, abs,        4, 0, 1, 1) \
+    OP(0xce, DEC, abs,        6, 0, 1, 0) \
+    OP(0xcf, DCP, abs,        6, 0, 0, 0) \
+    OP(0xd0, BNE, rel,        2, 0, 1, 0) \
+    OP(0xd1, CMP, ind_y,      5, 1, 1, 1) \
+    OP(0xd2, KIL, imp,        0, 0, 1, 0) \
+    OP(0xd3, DCP, ind_y,      8, 0, 0, 0) \
+    OP(0xd4, NOP, zp_ind_x,   4, 0, 0, 1) \
+    OP(0xd5, CMP, zp_ind_x,   4, 0, 1, 1) \
+    OP(0xd6, DEC, zp_ind_x,   6, 0, 1, 0) \
+    OP(0xd7, DCP, zp_ind_x,   6, 0, 0, 0) \
+    OP(0xd8, CLD, imp,        2, 0, 1, 0) \
+    OP(0xd9, CMP, abs_y,      4, 1, 1, 1) \
+    OP(0xda, NOP, imp,        2, 0, 0, 1) \
+    OP(0xdb, DCP, abs_y,      7, 0, 0, 0) \
+    OP(0xdc, NOP, abs_x,      4, 1, 0, 1) \
+    OP(0xdd, CMP, abs_x,      4, 1, 1, 1) \
+    OP(0xde, DEC, abs_x,      7, 0, 1, 0) \
+    OP(0xdf, DCP, abs_x,      7, 0, 0, 0) \
+    OP(0xe0, CPX, imm,        2, 0, 1, 1) \
+    OP(0xe1, SBC, ind_x,      6, 0, 1, 1) \
+    OP(0xe2, NOP, imm,        2, 0, 0, 1) \
+    OP(0xe3, ISC, ind_x,      8, 0, 0, 0) \
+    OP(0xe4, CPX, zp,         3, 0, 1, 1) \
+    OP(0xe5, SBC, zp,         3, 0, 1, 1) \
+    OP(0xe6, INC, zp,         5, 0, 1, 0) \
+    OP(0xe7, ISC, zp,         5, 0, 0, 0) \
+    OP(0xe8, INX, imp,        2, 0, 1, 1) \
+    OP(0xe9, SBC, imm,        2, 0, 1, 1) \
+    OP(0xea, NOP, imp,        2, 0, 1, 1) \
+    OP(0xeb, SBC, imm,        2, 0, 0, 1) \
+    OP(0xec, CPX, abs,        4, 0, 1, 1) \
+    OP(0xed, SBC, abs,        4, 0, 1, 1) \
+    OP(0xee, INC, abs,        6, 0, 1, 0) \
+    OP(0xef, ISC, abs,        6, 0, 0, 0) \
+    OP(0xf0, BEQ, rel,        2, 0, 1, 0) \
+    OP(0xf1, SBC, ind_y,      5, 1, 1, 1) \
+    OP(0xf2, KIL, imp,        0, 0, 1, 0) \
+    OP(0xf3, ISC, ind_y,      8, 0, 0, 0) \
+    OP(0xf4, NOP, zp_ind_x,   4, 0, 0, 1) \
+    OP(0xf5, SBC, zp_ind_x,   4, 0, 1, 1) \
+    OP(0xf6, INC, zp_ind_x,   6, 0, 1, 0) \
+    OP(0xf7, ISC, zp_ind_x,   6, 0, 0, 0) \
+    OP(0xf8, SED, imp,        2, 0, 1, 0) \
+    OP(0xf9, SBC, abs_y,      4, 1, 1, 1) \
+    OP(0xfa, NOP, imp,        2, 0, 0, 1) \
+    OP(0xfb, ISC, abs_y,      7, 0, 0, 0) \
+    OP(0xfc, NOP, abs_x,      4, 1, 0, 1) \
+    OP(0xfd, SBC, abs_x,      4, 1, 1, 1) \
+    OP(0xfe, INC, abs_x,      7, 0, 1, 0) \
+    OP(0xff, ISC, abs_x,      7, 0, 0, 0)
+
+struct nes_op_info
+{
+    uint8_t op_code;
+    const char *name;
+    nes_addr_mode addr_mode;
+    uint8_t cycles;
+    bool page_penalty;
+    bool is_official;
+    bool is_read_only;
+};
+
+#define NES_OP_INFO(op_code, op, mode, cycles, page_penalty, is_official, is_read_only) \
+    { op_code, #op, nes_addr_mode_##mode, cycles, page_penalty, is_official, is_read_only },
+
+static constexpr nes_op_info s_op_info[] = 
+{
+    NES_CPU_OP_TABLE(NES_OP_INFO)
+};
+
+static constexpr bool is_op_info_ordered()
+{
+    for (int i = 0; i < 0x100; ++i)
+    {
+        if (s_op_info[i].op_code != i)
+            return false;
+    }
+
+    return true;
+}
+
+static_assert(sizeof(s_op_info) / sizeof(s_op_info[0]) == 0x100, "Op code table should have exactly 256 entries");
+static_assert(is_op_info_ordered(), "Op code table should be ordered by op code");
+
+template <nes_cpu::op_handler_t handler, nes_addr_mode addr_mode, int cycles, bool page_penalty>
+void nes_cpu::exec_op(nes_cpu &cpu)
+{
+    operand_t op = cpu.decode_operand<addr_mode>();
+    (cpu.*handler)(op);
+
+    if (page_penalty && op.is_page_crossing)
+        cpu.step_cpu(nes_cpu_cycle_t(cycles + 1));
+    else
+        cpu.step_cpu(nes_cpu_cycle_t(cycles));
+}
+
+#define NES_OP_FUNC(op_code, op, mode, cycles, page_penalty, is_official, is_read_only) \
+    &nes_cpu::exec_op<&nes_cpu::op, nes_addr_mode_##mode, cycles, page_penalty>,
+
+const nes_cpu::op_func_t nes_cpu::s_op_table[] = 
+{
+    NES_CPU_OP_TABLE(NES_OP_FUNC)
+};
 
 void nes_cpu::NMI()
 {
     NES_TRACE3("[NES_CPU] NMI interrupt");
 
+    _idle_loop.valid = false;
+
+    nes_trace_ring *trace = _system->trace_ring();
+    if (trace)
+        trace->record_event(nes_trace_event_nmi, _cycle.count(), PC(), 0);
+
     // As per neswiki: NMI should set I(bit 5) but clear B(bit 4)
     // http://wiki.nesdev.com/w/index.php/CPU_status_flag_behavior
     push_word(PC());
@@ -87,11 +429,39 @@ void nes_cpu::NMI()
     PC() = peek_word(NMI_HANDLER);
 }
 
+void nes_cpu::IRQ()
+{
+    NES_TRACE3("[NES_CPU] IRQ interrupt");
+
+    _idle_loop.valid = false;
+
+    nes_trace_ring *trace = _system->trace_ring();
+    if (trace)
+        trace->record_event(nes_trace_event_irq, _cycle.count(), PC(), _irq_line);
+
+    // Same as NMI, except that it is masked by interrupt flag - which it sets so that the handler isn't
+    // interrupted again while the line is still asserted
+    push_word(PC());
+    push_byte(P() | 0x20);
+    set_interrupt_flag(true);
+
+    step_cpu(7);
+    PC() = peek_word(IRQ_HANDLER);
+}
+
 void nes_cpu::OAMDMA()
 {
     NES_TRACE3("[NES_CPU] OAMDMA at " << _dma_addr);
 
-    _system->ppu()->oam_dma(_dma_addr);
+    _idle_loop.valid = false;
+
+    nes_trace_ring *trace = _system->trace_ring();
+    if (trace)
+        trace->record_event(nes_trace_event_oam_dma, _cycle.count(), PC(), _dma_addr);
+
+    // PPU needs to finish rendering with the old OAM first
+    _ppu->step_to(_cycle);
+    _ppu->oam_dma(_dma_addr);
 
     // The entire DMA takes 513 or 514 cycles
     // http://wiki.nesdev.com/w/index.php/PPU_registers#OAMDMA
@@ -122,243 +492,158 @@ void nes_cpu::exec_one_instruction()
 
         _dma_pending = false;
     }
+    else if (_irq_line && !is_interrupt())
+    {
+        IRQ();
+    }
     else
     {
         // next op
         auto op_code = decode_byte();
 
-        // Let's start with a switch / case
-        // Compiler should do good enough job to create a jump table
-        // The problem with starting with my own table is that it get massive with lots of empty entries before I code
-        // up any instructions.
-        switch (op_code)
-        {
-        IS_ALU_OP_CODE(ADC)
-        IS_ALU_OP_CODE(AND)
-        IS_ALU_OP_CODE(CMP)
-        IS_ALU_OP_CODE(EOR)
-        IS_ALU_OP_CODE(ORA)
-        IS_ALU_OP_CODE(SBC)
-        IS_ALU_OP_CODE_NO_IMM(STA)
-        IS_ALU_OP_CODE(LDA)
-
-        IS_RMW_OP_CODE(ASL, 0x0)
-        IS_RMW_OP_CODE(ROL, 0x20)
-        IS_RMW_OP_CODE(LSR, 0x40)
-        IS_RMW_OP_CODE(ROR, 0x60)
-
-        IS_OP_CODE_MODE(LDX, 0xa2, imm)
-        IS_OP_CODE_MODE(LDX, 0xa6, zp)
-        IS_OP_CODE_MODE(LDX, 0xb6, zp_ind_y)
-        IS_OP_CODE_MODE(LDX, 0xae, abs)
-        IS_OP_CODE_MODE(LDX, 0xbe, abs_y)
-        IS_OP_CODE_MODE(LDY, 0xa0, imm)
-        IS_OP_CODE_MODE(LDY, 0xa4, zp)
-        IS_OP_CODE_MODE(LDY, 0xb4, zp_ind_x)
-        IS_OP_CODE_MODE(LDY, 0xac, abs)
-        IS_OP_CODE_MODE(LDY, 0xbc, abs_x)
-
-        IS_OP_CODE_MODE(STX, 0x86, zp)
-        IS_OP_CODE_MODE(STX, 0x96, zp_ind_y)
-        IS_OP_CODE_MODE(STX, 0x8e, abs)
-        IS_OP_CODE_MODE(STY, 0x84, zp)
-        IS_OP_CODE_MODE(STY, 0x94, zp_ind_x)
-        IS_OP_CODE_MODE(STY, 0x8c, abs)
-
-        IS_OP_CODE_MODE(CPX, 0xe0, imm)
-        IS_OP_CODE_MODE(CPX, 0xe4, zp)
-        IS_OP_CODE_MODE(CPX, 0xec, abs)
-        IS_OP_CODE_MODE(CPY, 0xc0, imm)
-        IS_OP_CODE_MODE(CPY, 0xc4, zp)
-        IS_OP_CODE_MODE(CPY, 0xcc, abs)
-
-        IS_OP_CODE(TAX, 0xaa)
-        IS_OP_CODE(TAY, 0xa8)
-        IS_OP_CODE(TSX, 0xba)
-        IS_OP_CODE(TXA, 0x8a)
-        IS_OP_CODE(TXS, 0x9a)
-        IS_OP_CODE(TYA, 0x98)
-
-        IS_OP_CODE_MODE(INC, 0xe6, zp)
-        IS_OP_CODE_MODE(INC, 0xf6, zp_ind_x)
-        IS_OP_CODE_MODE(INC, 0xee, abs)
-        IS_OP_CODE_MODE(INC, 0xfe, abs_x)
-        IS_OP_CODE(INX, 0xe8)
-        IS_OP_CODE(INY, 0xc8)
-        IS_OP_CODE_MODE(DEC, 0xc6, zp)
-        IS_OP_CODE_MODE(DEC, 0xd6, zp_ind_x)
-        IS_OP_CODE_MODE(DEC, 0xce, abs)
-        IS_OP_CODE_MODE(DEC, 0xde, abs_x)
-        IS_OP_CODE(DEX, 0xca)
-        IS_OP_CODE(DEY, 0x88)
-
-        IS_OP_CODE(SEC, 0x38)
-        IS_OP_CODE(SED, 0xf8)
-        IS_OP_CODE(SEI, 0x78)
-        IS_OP_CODE(CLC, 0x18)
-        IS_OP_CODE(CLD, 0xd8)
-        IS_OP_CODE(CLI, 0x58)
-        IS_OP_CODE(CLV, 0xB8)
-
-        IS_OP_CODE_MODE(JMP, 0x4c, abs_jmp)
-        IS_OP_CODE_MODE(JMP, 0x6c, ind_jmp)
-        
-        IS_OP_CODE_MODE(BCC, 0x90, rel)
-        IS_OP_CODE_MODE(BCS, 0xb0, rel)
-        IS_OP_CODE_MODE(BEQ, 0xf0, rel)
-        IS_OP_CODE_MODE(BMI, 0x30, rel)
-        IS_OP_CODE_MODE(BNE, 0xd0, rel)
-        IS_OP_CODE_MODE(BPL, 0x10, rel)
-        IS_OP_CODE_MODE(BVC, 0x50, rel)
-        IS_OP_CODE_MODE(BVS, 0x70, rel)
-
-        IS_OP_CODE_MODE(BIT, 0x24, zp)
-        IS_OP_CODE_MODE(BIT, 0x2c, abs)
-
-        IS_OP_CODE(PHA, 0x48)
-        IS_OP_CODE(PHP, 0x08)
-        IS_OP_CODE(PLA, 0x68)
-        IS_OP_CODE(PLP, 0x28)
-
-        IS_OP_CODE(RTI, 0x40)
-        IS_OP_CODE_MODE(JSR, 0x20, abs_jmp)
-
-        IS_OP_CODE(RTS, 0x60)
-
-        IS_OP_CODE(KIL, 0x02)
-        IS_OP_CODE(KIL, 0x12)
-        IS_OP_CODE(KIL, 0x22)
-        IS_OP_CODE(KIL, 0x32)
-        IS_OP_CODE(KIL, 0x42)
-        IS_OP_CODE(KIL, 0x52)
-        IS_OP_CODE(KIL, 0x62)
-        IS_OP_CODE(KIL, 0x72)
-        IS_OP_CODE(KIL, 0x92)
-        IS_OP_CODE(KIL, 0xB2)
-        IS_OP_CODE(KIL, 0xd2)
-        IS_OP_CODE(KIL, 0xf2)
-
-        IS_OP_CODE(BRK, 0x00)
-
-        // The real NOP
-        IS_OP_CODE_MODE(NOP, 0xea, imp)
-
-        //===============================================================================
-        // Unofficial instructions
-        //===============================================================================
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x80, imm)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x04, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x44, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x64, zp)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x0c, abs)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x14, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x34, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x54, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x74, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xd4, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xf4, zp_ind_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x1c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x3c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x5c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x7c, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xdc, abs_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xfc, abs_x)
-       
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x89, imm)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x82, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xc2, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xe2, imm)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x1a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x3a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x5a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0x7a, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xda, imp)
-        IS_UNOFFICIAL_OP_CODE_MODE(NOP, 0xfa, imp)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x03, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x07, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ANC, 0x0b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x0f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x13, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x17, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x1b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SLO, 0x1f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x23, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x27, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ANC, 0x2b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x2f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x33, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x37, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x3b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RLA, 0x3f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x43, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x47, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ALR, 0x4b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x4f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x53, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x57, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x5b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SRE, 0x5f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x63, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x67, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(ARR, 0x6b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x6f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x73, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x77, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x7b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(RRA, 0x7f, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x83, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x87, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(XAA, 0x8b, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x8f, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(AHX, 0x93, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(SAX, 0x97, zp_ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(TAS, 0x9b, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(AHX, 0x9f, abs_y)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xa3, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xa7, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xab, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xaf, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xb3, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xb7, zp_ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAS, 0xbb, zp_ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(LAX, 0xbf, abs_y)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xc3, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xc7, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(AXS, 0xcb, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xcf, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xd3, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xd7, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xdb, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(DCP, 0xdf, abs_x)
-
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xe3, ind_x)     
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xe7, zp)
-        IS_UNOFFICIAL_OP_CODE_MODE(SBC, 0xeb, imm)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xef, abs)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xf3, ind_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xf7, zp_ind_x)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xfb, abs_y)
-        IS_UNOFFICIAL_OP_CODE_MODE(ISC, 0xff, abs_x)
+        NES_TRACE4(get_op_str(op_code));
 
-        default:
-            NES_TRACE0("[NES_CPU] Unrecognized instruction or illegal instruction!");
-            assert(false);
+        nes_trace_ring *trace = _system->trace_ring();
+        if (trace)
+            trace_instruction(*trace, op_code);
+
+        s_op_table[op_code](*this);
+    }
+}
+
+void nes_cpu::trace_instruction(nes_trace_ring &trace, uint8_t op_code)
+{
+    nes_trace_record rec;
+    rec.cycle = _cycle.count();
+    rec.pc = PC() - 1;
+    rec.type = nes_trace_event_instruction;
+    rec.op_code = op_code;
+    rec.operand[0] = _mem->peek_byte(PC());
+    rec.operand[1] = _mem->peek_byte(PC() + 1);
+    rec.a = A();
+    rec.x = X();
+    rec.y = Y();
+    rec.p = P();
+    rec.s = S();
+    rec.value = 0;
+    rec.data = 0;
+    trace.record(rec);
+}
+
+bool nes_cpu::skip_idle_loop(nes_cycle_t new_count)
+{
+    _idle_loop_check = false;
+
+    // Tracing and stopping at an address need to see every instruction
+    bool tracing = (_system->trace_ring() != nullptr);
+#if NES_TRACE_MAX_LEVEL >= 4
+    // NES_TRACE4 logs every instruction - compiled out along with it
+    tracing = tracing || nes_tracer::get().is_enabled(nes_tracer_level_diag);
+#endif
+
+    if (!_idle_loop_skip || _is_stop_at_addr || _nmi_pending || _dma_pending || (_irq_line && !is_interrupt()) || tracing)
+    {
+        _idle_loop.valid = false;
+        return false;
+    }
+
+    uint16_t head = PC();
+    if (!_idle_loop.valid || _idle_loop.head != head || _idle_loop.tail != _idle_loop_tail)
+    {
+        _idle_loop.valid = true;
+        _idle_loop.head = head;
+        _idle_loop.tail = _idle_loop_tail;
+        _idle_loop.kind = get_idle_loop_kind(head, _idle_loop_tail);
+        _idle_loop.context = _context;
+        _idle_loop.cycle = _cycle;
+        return false;
+    }
+
+    if (_idle_loop.kind == idle_loop_kind_none)
+        return false;
+
+    // The body is straight-line code, so we've run exactly one iteration since last time
+    nes_cpu_context &last = _idle_loop.context;
+    nes_cycle_t last_cycle = _idle_loop.cycle;
+    bool same = (last.A == A() && last.X == X() && last.Y == Y() && last.S == S() && last.P == P());
+    _idle_loop.context = _context;
+    _idle_loop.cycle = _cycle;
+    if (!same)
+        return false;
+
+    // Every iteration we skip needs to finish by the time anything it reads may change
+    nes_cycle_t until = _ppu->next_event_cycle();
+    if (_apu->next_event_cycle() < until)
+        until = _apu->next_event_cycle();
+    if (_idle_loop.kind == idle_loop_kind_ppu_status)
+    {
+        // The last iteration read PPUSTATUS after last_cycle, and saw the same thing as the one before
+        nes_cycle_t status_cycle = _ppu->next_status_change_cycle(last_cycle);
+        if (status_cycle < until)
+            until = status_cycle;
+    }
+    if (new_count < until)
+        until = new_count;
+
+    int64_t loop_cycles = (_cycle - last_cycle).count();
+    int64_t loop_count = (until - _cycle).count() / loop_cycles;
+    if (loop_count <= 0)
+        return false;
+
+    nes_cycle_t skipped = nes_cycle_t(loop_count * loop_cycles);
+    _cycle += skipped;
+    _idle_cycles += skipped;
+    _idle_loop.cycle = _cycle;
+
+    return true;
+}
+
+nes_cpu::idle_loop_kind nes_cpu::get_idle_loop_kind(uint16_t head, uint16_t tail)
+{
+    idle_loop_kind kind = idle_loop_kind_memory;
+    uint16_t pc = head;
+    while (pc < tail)
+    {
+        uint8_t op_code = _mem->peek_byte(pc);
+        const nes_op_info &info = s_op_info[op_code];
+        if (!info.is_official || !info.is_read_only)
+            return idle_loop_kind_none;
+
+        uint16_t addr;
+        switch (info.addr_mode)
+        {
+        case nes_addr_mode::nes_addr_mode_imp:
+        case nes_addr_mode::nes_addr_mode_acc:
+        case nes_addr_mode::nes_addr_mode_imm:
             break;
+        case nes_addr_mode::nes_addr_mode_zp:
+        case nes_addr_mode::nes_addr_mode_abs:
+            addr = _mem->peek_byte(pc + 1);
+            if (info.addr_mode == nes_addr_mode::nes_addr_mode_abs)
+                addr |= uint16_t(_mem->peek_byte(pc + 2)) << 8;
+
+            if ((addr & 0xe007) == 0x2002)
+                kind = idle_loop_kind_ppu_status;
+            else if (addr >= 0x2000 && addr < 0x6000)
+                return idle_loop_kind_none;          // other I/O registers have side effects
+            break;
+        default:
+            // indexed addresses might change between iterations - not worth it
+            return idle_loop_kind_none;
         }
+
+        pc += 1 + get_operand_size(info.addr_mode);
     }
+
+    if (pc != tail)
+        return idle_loop_kind_none;
+
+    // Closed by JMP abs or a conditional branch
+    uint8_t op_code = _mem->peek_byte(tail);
+    if (op_code != 0x4c && s_op_info[op_code].addr_mode != nes_addr_mode::nes_addr_mode_rel)
+        return idle_loop_kind_none;
+
+    return kind;
 }
 
 static void append_space(string &str)
@@ -386,7 +671,7 @@ static void append_word(string &str, uint16_t val)
     append_byte(str, val & 0xff);
 }
 
-static void align(string &str, int loc)
+static void align(string &str, size_t loc)
 {
     if (str.size() < loc)
         str.append(loc - str.size(), ' ');
@@ -397,38 +682,14 @@ static void align(string &str, int loc)
 // 0         1         2         3         4         5         6         7         8
 // 012345678901234567890123456789012345678901234567890123456789012345678901234567890
 // C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:  0
-string nes_cpu::get_op_str(const char *op, nes_addr_mode addr_mode, bool is_official)
+string nes_cpu::get_op_str(uint8_t op_code)
 {
     nes_ppu_protect protect(_ppu);
 
-    int operand_size = 0;
-    switch (addr_mode)
-    {
-        case nes_addr_mode::nes_addr_mode_imp: 
-        case nes_addr_mode::nes_addr_mode_acc:
-            break;
-
-        case nes_addr_mode::nes_addr_mode_rel: 
-        case nes_addr_mode::nes_addr_mode_imm:
-        case nes_addr_mode::nes_addr_mode_zp:
-        case nes_addr_mode::nes_addr_mode_zp_ind_x:
-        case nes_addr_mode::nes_addr_mode_zp_ind_y:
-        case nes_addr_mode::nes_addr_mode_ind_x:
-        case nes_addr_mode::nes_addr_mode_ind_y:
-            operand_size = 1;
-            break;
-
-        case nes_addr_mode::nes_addr_mode_ind_jmp:
-        case nes_addr_mode::nes_addr_mode_abs:
-        case nes_addr_mode::nes_addr_mode_abs_jmp:
-        case nes_addr_mode::nes_addr_mode_abs_x:
-        case nes_addr_mode::nes_addr_mode_abs_y:
-            operand_size = 2;
-            break;
+    const nes_op_info &info = s_op_info[op_code];
+    nes_addr_mode addr_mode = info.addr_mode;
 
-        default:
-            assert(false);
-    }
+    int operand_size = get_operand_size(addr_mode);
 
     string msg;
 
@@ -448,7 +709,7 @@ string nes_cpu::get_op_str(const char *op, nes_addr_mode addr_mode, bool is_offi
         append_space(msg);
     }
 
-    if (is_official)
+    if (info.is_official)
     {
         align(msg, 16);
     }
@@ -458,7 +719,7 @@ string nes_cpu::get_op_str(const char *op, nes_addr_mode addr_mode, bool is_offi
         msg.append("*");
     }
 
-    msg.append(op);
+    msg.append(info.name);
     append_operand_str(msg, addr_mode);
 
     align(msg, 48);
@@ -497,6 +758,133 @@ string nes_cpu::get_op_str(const char *op, nes_addr_mode addr_mode, bool is_offi
     return msg;
 }
 
+int nes_cpu::get_operand_size(nes_addr_mode addr_mode)
+{
+    switch (addr_mode)
+    {
+        case nes_addr_mode::nes_addr_mode_imp: 
+        case nes_addr_mode::nes_addr_mode_acc:
+            return 0;
+
+        case nes_addr_mode::nes_addr_mode_rel: 
+        case nes_addr_mode::nes_addr_mode_imm:
+        case nes_addr_mode::nes_addr_mode_zp:
+        case nes_addr_mode::nes_addr_mode_zp_ind_x:
+        case nes_addr_mode::nes_addr_mode_zp_ind_y:
+        case nes_addr_mode::nes_addr_mode_ind_x:
+        case nes_addr_mode::nes_addr_mode_ind_y:
+            return 1;
+
+        case nes_addr_mode::nes_addr_mode_ind_jmp:
+        case nes_addr_mode::nes_addr_mode_abs:
+        case nes_addr_mode::nes_addr_mode_abs_jmp:
+        case nes_addr_mode::nes_addr_mode_abs_x:
+        case nes_addr_mode::nes_addr_mode_abs_y:
+            return 2;
+
+        default:
+            assert(false);
+            return 0;
+    }
+}
+
+// C000  4C F5 C5  JMP $C5F5
+void nes_cpu::append_instruction_str(string &str, uint16_t pc, uint8_t op_code, const uint8_t *operand)
+{
+    const nes_op_info &info = s_op_info[op_code];
+    nes_addr_mode addr_mode = info.addr_mode;
+    int operand_size = get_operand_size(addr_mode);
+    size_t start = str.size();
+
+    append_word(str, pc);
+    align(str, start + 6);
+
+    append_byte(str, op_code);
+    append_space(str);
+    for (int i = 0; i < operand_size; ++i)
+    {
+        append_byte(str, operand[i]);
+        append_space(str);
+    }
+
+    if (info.is_official)
+    {
+        align(str, start + 16);
+    }
+    else
+    {
+        align(str, start + 15);
+        str.append("*");
+    }
+
+    str.append(info.name);
+    append_space(str);
+
+    uint16_t operand_word = operand[0] + (uint16_t(operand[1]) << 8);
+    switch (addr_mode)
+    {
+    case nes_addr_mode::nes_addr_mode_imp:
+        break;
+    case nes_addr_mode::nes_addr_mode_acc:
+        str.append("A");
+        break;
+    case nes_addr_mode::nes_addr_mode_imm:
+        str.append("#$");
+        append_byte(str, operand[0]);
+        break;
+    case nes_addr_mode::nes_addr_mode_rel:
+        str.append("$");
+        append_word(str, uint16_t(pc + 2 + int8_t(operand[0])));
+        break;
+    case nes_addr_mode::nes_addr_mode_zp:
+        str.append("$");
+        append_byte(str, operand[0]);
+        break;
+    case nes_addr_mode::nes_addr_mode_zp_ind_x:
+        str.append("$");
+        append_byte(str, operand[0]);
+        str.append(",X");
+        break;
+    case nes_addr_mode::nes_addr_mode_zp_ind_y:
+        str.append("$");
+        append_byte(str, operand[0]);
+        str.append(",Y");
+        break;
+    case nes_addr_mode::nes_addr_mode_abs_jmp:
+    case nes_addr_mode::nes_addr_mode_abs:
+        str.append("$");
+        append_word(str, operand_word);
+        break;
+    case nes_addr_mode::nes_addr_mode_abs_x:
+        str.append("$");
+        append_word(str, operand_word);
+        str.append(",X");
+        break;
+    case nes_addr_mode::nes_addr_mode_abs_y:
+        str.append("$");
+        append_word(str, operand_word);
+        str.append(",Y");
+        break;
+    case nes_addr_mode::nes_addr_mode_ind_jmp:
+        str.append("($");
+        append_word(str, operand_word);
+        str.append(")");
+        break;
+    case nes_addr_mode::nes_addr_mode_ind_x:
+        str.append("($");
+        append_byte(str, operand[0]);
+        str.append(",X)");
+        break;
+    case nes_addr_mode::nes_addr_mode_ind_y:
+        str.append("($");
+        append_byte(str, operand[0]);
+        str.append("),Y");
+        break;
+    default:
+        assert(false);
+    }
+}
+
 void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
 {
     append_space(str);
@@ -628,41 +1016,10 @@ void nes_cpu::append_operand_str(string &str, nes_addr_mode addr_mode)
     }
 }
 
-nes_cpu_cycle_t nes_cpu::get_cpu_cycle(operand_t operand, nes_addr_mode mode)
-{
-    switch (mode)
-    {
-    case nes_addr_mode_acc:
-    case nes_addr_mode_imm:
-        return nes_cpu_cycle_t(2);
-
-    case nes_addr_mode_zp:
-        return nes_cpu_cycle_t(3);
-
-    case nes_addr_mode_zp_ind_x:
-    case nes_addr_mode_zp_ind_y:
-    case nes_addr_mode_abs:
-        return nes_cpu_cycle_t(4);
-
-    case nes_addr_mode_abs_x:
-    case nes_addr_mode_abs_y:
-        return nes_cpu_cycle_t(operand.is_page_crossing ? 5 : 4);
-
-    case nes_addr_mode_ind_x:
-        return nes_cpu_cycle_t(6);
-        
-    case nes_addr_mode_ind_y:
-        return nes_cpu_cycle_t(operand.is_page_crossing ? 6 : 5);
-
-    default:
-        assert(false);
-        return nes_cpu_cycle_t(0);
-    }
-}
-
 nes_cpu_cycle_t nes_cpu::get_branch_cycle(bool cond, uint16_t new_addr, int8_t rel)
 {
-    int cycle = 2;
+    // 2 cycles are already accounted for in the op table
+    int cycle = 0;
 
     if (cond)
     {
@@ -679,24 +1036,6 @@ nes_cpu_cycle_t nes_cpu::get_branch_cycle(bool cond, uint16_t new_addr, int8_t r
     return nes_cpu_cycle_t(cycle);
 }
 
-#define BEGIN_CYCLE() { nes_cpu_cycle_t __cycle_count(0);
-#define IS_CYCLE(mode, cycle) if (addr_mode == nes_addr_mode_##mode) __cycle_count = nes_cpu_cycle_t(cycle);
-#define END_CYCLE() step_cpu(__cycle_count); }
-#define END_CYCLE_RETURN() return __cycle_count; }
-
-nes_cpu_cycle_t nes_cpu::get_shift_cycle(nes_addr_mode addr_mode)
-{
-    BEGIN_CYCLE()
-    {
-        IS_CYCLE(acc, 2);
-        IS_CYCLE(zp, 5);
-        IS_CYCLE(zp_ind_x, 6);
-        IS_CYCLE(abs, 6);
-        IS_CYCLE(abs_x, 7);
-    }
-    END_CYCLE_RETURN()
-}
-
 void nes_cpu::step_cpu(int64_t cpu_cycle)
 {
     _cycle += nes_cpu_cycle_t(cpu_cycle);
@@ -708,14 +1047,10 @@ void nes_cpu::step_cpu(nes_cpu_cycle_t cpu_cycle)
 }
 
 // Add with carry
-void nes_cpu::ADC(nes_addr_mode addr_mode)
+void nes_cpu::ADC(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     _ADC(val);
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 void nes_cpu::_ADC(uint8_t val)
@@ -742,23 +1077,18 @@ void nes_cpu::_ADC(uint8_t val)
 }
 
 // Logical AND
-void nes_cpu::AND(nes_addr_mode addr_mode)
+void nes_cpu::AND(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     A() &= val;
 
     // flags    
     calc_alu_flag(A());
-    
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // Compare 
-void nes_cpu::CMP(nes_addr_mode addr_mode)
+void nes_cpu::CMP(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);;
 
     // flags
@@ -767,50 +1097,35 @@ void nes_cpu::CMP(nes_addr_mode addr_mode)
     set_carry_flag(A() >= val);
     set_zero_flag(diff == 0);
     set_negative_flag(diff & 0x80);
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // Exclusive OR 
-void nes_cpu::EOR(nes_addr_mode addr_mode)
+void nes_cpu::EOR(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
 
     A() ^= val;
 
     // flags
     calc_alu_flag(A());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // Logical Inclusive OR
-void nes_cpu::ORA(nes_addr_mode addr_mode)
+void nes_cpu::ORA(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
 
     A() |= val;
 
     calc_alu_flag(A());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // Subtract with carry
-void nes_cpu::SBC(nes_addr_mode addr_mode)
+void nes_cpu::SBC(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
 
     _SBC(val);
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 void nes_cpu::_SBC(uint8_t val)
@@ -819,24 +1134,19 @@ void nes_cpu::_SBC(uint8_t val)
 }
 
 // Load Accumulator
-void nes_cpu::LDA(nes_addr_mode addr_mode)
+void nes_cpu::LDA(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
 
     A() = val;
 
     // flags
     calc_alu_flag(A());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // ASL - Arithmetic shift left
-void nes_cpu::ASL(nes_addr_mode addr_mode) 
+void nes_cpu::ASL(operand_t op) 
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     uint8_t new_val = val << 1;
     write_operand(op, new_val);
@@ -848,15 +1158,12 @@ void nes_cpu::ASL(nes_addr_mode addr_mode)
     // http://obelisk.me.uk/6502/reference.html#ASL incorrectly states ASL detects A == 0
     set_zero_flag(new_val == 0); 
     set_negative_flag(new_val & 0x80);
-
-    // cycle count
-    step_cpu(get_shift_cycle(addr_mode));
 }
 
-void nes_cpu::branch(bool cond, nes_addr_mode addr_mode)
+void nes_cpu::branch(bool cond, operand_t op)
 {
-    assert(addr_mode == nes_addr_mode_rel);
-    int8_t rel = (int8_t) decode_byte();
+    assert(op.kind == operand_kind_imm);
+    int8_t rel = (int8_t) op.addr_or_value;
     if (cond)
     {
         PC() += rel;
@@ -865,34 +1172,36 @@ void nes_cpu::branch(bool cond, nes_addr_mode addr_mode)
             _system->stop();
             _stop_at_infinite_loop = false;
         }
+
+        if (rel < 0)
+            jump_back(PC() - rel - 2);
     }
 
-    // cycle count
+    // extra cycles when branch is taken
     step_cpu(get_branch_cycle(cond, PC(), rel));
 }
 
 // BCC - Branch if Carry Clear
-void nes_cpu::BCC(nes_addr_mode addr_mode) 
+void nes_cpu::BCC(operand_t op) 
 {
-    branch(!get_carry(), addr_mode);
+    branch(!get_carry(), op);
 }
 
 // BCS - Branch if Carry Set 
-void nes_cpu::BCS(nes_addr_mode addr_mode) 
+void nes_cpu::BCS(operand_t op) 
 {
-    branch(get_carry(), addr_mode);
+    branch(get_carry(), op);
 }
 
 // BEQ - Branch if Equal
-void nes_cpu::BEQ(nes_addr_mode addr_mode) 
+void nes_cpu::BEQ(operand_t op) 
 {
-    branch(is_zero(), addr_mode);
+    branch(is_zero(), op);
 }
 
 // BIT - Bit test
-void nes_cpu::BIT(nes_addr_mode addr_mode) 
+void nes_cpu::BIT(operand_t op) 
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     uint8_t new_val = val & A();
 
@@ -900,66 +1209,59 @@ void nes_cpu::BIT(nes_addr_mode addr_mode)
     set_zero_flag(new_val == 0);
     set_overflow_flag(val & 0x40);
     set_negative_flag(val & 0x80);
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // BMI - Branch if minus
-void nes_cpu::BMI(nes_addr_mode addr_mode) 
+void nes_cpu::BMI(operand_t op) 
 {
-    branch(is_negative(), addr_mode);
+    branch(is_negative(), op);
 }
 
 // BNE - Branch if not equal
-void nes_cpu::BNE(nes_addr_mode addr_mode) 
+void nes_cpu::BNE(operand_t op) 
 {
-    branch(!is_zero(), addr_mode);
+    branch(!is_zero(), op);
 }
 
 // BPL - Branch if positive 
-void nes_cpu::BPL(nes_addr_mode addr_mode) 
+void nes_cpu::BPL(operand_t op) 
 {
-    branch(!is_negative(), addr_mode);
+    branch(!is_negative(), op);
 }
 
 // BRK - Force interrupt
-void nes_cpu::BRK(nes_addr_mode addr_mode) 
+void nes_cpu::BRK(operand_t op) 
 {
-    // cycle count
-    step_cpu(7);
-
     _system->stop();
 }
 
 // BVC - Branch if overflow clear
-void nes_cpu::BVC(nes_addr_mode addr_mode) 
+void nes_cpu::BVC(operand_t op) 
 {
-    branch(!is_overflow(), addr_mode);
+    branch(!is_overflow(), op);
 }
 
 // BVS - Branch if overflow set
-void nes_cpu::BVS(nes_addr_mode addr_mode) 
+void nes_cpu::BVS(operand_t op) 
 {
-    branch(is_overflow(), addr_mode);
+    branch(is_overflow(), op);
 }
 
 // CLC - Clear carry flag
-void nes_cpu::CLC(nes_addr_mode addr_mode) { set_carry_flag(false); step_cpu(nes_cpu_cycle_t(2)); }
+void nes_cpu::CLC(operand_t op) { set_carry_flag(false); }
 
 // CLD - Clear decimal mode
-void nes_cpu::CLD(nes_addr_mode addr_mode) { set_decimal_flag(false); step_cpu(nes_cpu_cycle_t(2)); }
+void nes_cpu::CLD(operand_t op) { set_decimal_flag(false); }
 
 // CLI - Clear interrupt disable
-void nes_cpu::CLI(nes_addr_mode addr_mode) { set_interrupt_flag(false); step_cpu(nes_cpu_cycle_t(2)); }
+void nes_cpu::CLI(operand_t op) { set_interrupt_flag(false); }
 
 // CLV - Clear overflow flag
-void nes_cpu::CLV(nes_addr_mode addr_mode) { set_overflow_flag(false); step_cpu(nes_cpu_cycle_t(2)); }
+void nes_cpu::CLV(operand_t op) { set_overflow_flag(false); }
 
 // CPX - Compare X register
-void nes_cpu::CPX(nes_addr_mode addr_mode) 
+void nes_cpu::CPX(operand_t op) 
 {
-    auto op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
 
     // flags
@@ -968,15 +1270,11 @@ void nes_cpu::CPX(nes_addr_mode addr_mode)
     set_carry_flag(X() >= val);
     set_zero_flag(diff == 0);
     set_negative_flag(diff & 0x80);
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // CPY - Compare Y register
-void nes_cpu::CPY(nes_addr_mode addr_mode) 
+void nes_cpu::CPY(operand_t op) 
 {
-    auto op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);;
 
     // flags
@@ -985,147 +1283,103 @@ void nes_cpu::CPY(nes_addr_mode addr_mode)
     set_carry_flag(Y() >= val);
     set_zero_flag(diff == 0);
     set_negative_flag(diff & 0x80);
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // DEC - Decrement memory
-void nes_cpu::DEC(nes_addr_mode addr_mode) 
+void nes_cpu::DEC(operand_t op) 
 {
-    uint16_t addr = decode_operand_addr(addr_mode);
-    uint8_t new_val = peek(addr) - 1;
-    poke(addr, new_val);
+    uint8_t new_val = read_operand(op) - 1;
+    write_operand(op, new_val);
 
     calc_alu_flag(new_val);
-
-    BEGIN_CYCLE() 
-    {
-        IS_CYCLE(zp, 5);
-        IS_CYCLE(zp_ind_x, 6);
-        IS_CYCLE(abs, 6);
-        IS_CYCLE(abs_x, 7);
-    } 
-    END_CYCLE()
 }
 
 // DEX - Decrement X register
-void nes_cpu::DEX(nes_addr_mode addr_mode) 
+void nes_cpu::DEX(operand_t op) 
 { 
     X()--; 
     calc_alu_flag(X());
-
-    // cycle count
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // DEY - Decrement Y register
-void nes_cpu::DEY(nes_addr_mode addr_mode) 
+void nes_cpu::DEY(operand_t op) 
 { 
     Y()--; 
     calc_alu_flag(Y());
-    
-    // cycle count
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // INC - Increment memory
-void nes_cpu::INC(nes_addr_mode addr_mode) 
+void nes_cpu::INC(operand_t op) 
 {
-    uint16_t addr = decode_operand_addr(addr_mode);
-    uint8_t new_val = peek(addr) + 1;
-    poke(addr, new_val);
+    uint8_t new_val = read_operand(op) + 1;
+    write_operand(op, new_val);
 
     // flags
     calc_alu_flag(new_val);
-
-    BEGIN_CYCLE() 
-    {
-        IS_CYCLE(zp, 5);
-        IS_CYCLE(zp_ind_x, 6);
-        IS_CYCLE(abs, 6);
-        IS_CYCLE(abs_x, 7);
-    } 
-    END_CYCLE()
 }
 
 // INX - Increment X
-void nes_cpu::INX(nes_addr_mode addr_mode) 
+void nes_cpu::INX(operand_t op) 
 {
     X() = X() + 1;
 
     calc_alu_flag(X());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // INY - Increment Y
-void nes_cpu::INY(nes_addr_mode addr_mode) 
+void nes_cpu::INY(operand_t op) 
 {
     Y() = Y() + 1;
 
     calc_alu_flag(Y());
-    
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // JMP - Jump 
-void nes_cpu::JMP(nes_addr_mode addr_mode) 
+void nes_cpu::JMP(operand_t op) 
 {
-    assert(addr_mode == nes_addr_mode_abs_jmp || addr_mode == nes_addr_mode_ind_jmp);
+    assert(op.kind == operand_kind_addr);
 
-    uint16_t old_pc = PC();
-    auto addr = decode_operand_addr(addr_mode);
+    auto addr = op.addr_or_value;
     if (addr == PC() - 1 && _stop_at_infinite_loop)
     {
         _system->stop();
     }
 
+    uint16_t tail = PC() - 3;
     PC() = addr;
+    jump_back(tail);
     
     // No impact to flags
-    step_cpu(addr_mode == nes_addr_mode_abs_jmp ? 3 : 5);
 }
 
 // JSR - Jump to subroutine
-void nes_cpu::JSR(nes_addr_mode addr_mode) 
+void nes_cpu::JSR(operand_t op) 
 {
-    // note: we push the actual return address -1, which is the current place (before decoding the 16-bit addr) + 1
-    push_word(PC() + 1);
+    // note: we push the actual return address -1, which is the last byte of the JSR instruction
+    push_word(PC() - 1);
 
-    PC() = decode_operand_addr(addr_mode);
-
-    step_cpu(6);
+    PC() = op.addr_or_value;
 }
 
 // LDX - Load X register
-void nes_cpu::LDX(nes_addr_mode addr_mode) 
+void nes_cpu::LDX(operand_t op) 
 {
-    operand_t op = decode_operand(addr_mode);
     X() = read_operand(op);
 
     calc_alu_flag(X());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // LDY - Load Y register
-void nes_cpu::LDY(nes_addr_mode addr_mode) 
+void nes_cpu::LDY(operand_t op) 
 {
-    operand_t op = decode_operand(addr_mode);
     Y() = read_operand(op);
 
     calc_alu_flag(Y());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // LSR - Logical shift right
-void nes_cpu::LSR(nes_addr_mode addr_mode)
+void nes_cpu::LSR(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     uint8_t new_val = (val >> 1);
     write_operand(op, new_val);
@@ -1137,60 +1391,41 @@ void nes_cpu::LSR(nes_addr_mode addr_mode)
     // http://obelisk.me.uk/6502/reference.html#LSR incorrectly states ASL detects A == 0
     set_zero_flag(new_val == 0);
     set_negative_flag(new_val & 0x80);
-
-    // cycle count
-    step_cpu(get_shift_cycle(addr_mode));
 }
 
 // NOP - NOP
-void nes_cpu::NOP(nes_addr_mode addr_mode) 
+void nes_cpu::NOP(operand_t op) 
 {
     // For effective NOP (op codes that are "effectively" no-op but not the real NOP 0xea)
-    // We always needed to decode the parameter
-    if (addr_mode != nes_addr_mode::nes_addr_mode_imp)
-    {
-        operand_t op = decode_operand(addr_mode);
-        step_cpu(get_cpu_cycle(op, addr_mode));
-    }
-    else
-    {
-        step_cpu(nes_cpu_cycle_t(2));
-    }
+    // the parameter is already decoded (and the cycles accounted for) by the op table
 }
 
 // PHA - Push accumulator
-void nes_cpu::PHA(nes_addr_mode addr_mode) 
+void nes_cpu::PHA(operand_t op) 
 {
     push_byte(A());
-
-    step_cpu(3);
 }
 
 // PHP - Push processor status
-void nes_cpu::PHP(nes_addr_mode addr_mode) 
+void nes_cpu::PHP(operand_t op) 
 {
     // http://wiki.nesdev.com/w/index.php/CPU_status_flag_behavior
     // Set bit 5 and 4 to 1 when copy status into from PHP
     push_byte(P() | 0x30);
-    
-    step_cpu(3);
 }
 
 // PLA - Pull accumulator
-void nes_cpu::PLA(nes_addr_mode addr_mode) 
+void nes_cpu::PLA(operand_t op) 
 {
     A() = pop_byte();
 
     calc_alu_flag(A());
-
-    step_cpu(4);
 }
 
 // PLP - Pull processor status
-void nes_cpu::PLP(nes_addr_mode addr_mode) 
+void nes_cpu::PLP(operand_t op) 
 {
     _PLP();
-    step_cpu(4);
 }
 
 void nes_cpu::_PLP()
@@ -1203,9 +1438,8 @@ void nes_cpu::_PLP()
 }
 
 // ROL - Rotate left
-void nes_cpu::ROL(nes_addr_mode addr_mode)
+void nes_cpu::ROL(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     uint8_t new_val = (val << 1) | get_carry();
     write_operand(op, new_val);
@@ -1216,15 +1450,11 @@ void nes_cpu::ROL(nes_addr_mode addr_mode)
     // http://obelisk.me.uk/6502/reference.html#ROL incorrectly states zero is set if A == 0
     set_zero_flag(new_val == 0);
     set_negative_flag(new_val & 0x80);
-
-    // cycle count
-    step_cpu(get_shift_cycle(addr_mode));
 }
 
 // ROR - Rotate right
-void nes_cpu::ROR(nes_addr_mode addr_mode)
+void nes_cpu::ROR(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     uint8_t new_val = (val >> 1) | (get_carry() << 7);
     write_operand(op, new_val);
@@ -1236,189 +1466,156 @@ void nes_cpu::ROR(nes_addr_mode addr_mode)
     // http://obelisk.me.uk/6502/reference.html#ROR incorrectly states zero is set if A == 0
     set_zero_flag(new_val == 0);
     set_negative_flag(new_val & 0x80);
-
-    // cycle count
-    step_cpu(get_shift_cycle(addr_mode));
 }
 
 // RTI - Return from interrupt
-void nes_cpu::RTI(nes_addr_mode addr_mode) 
+void nes_cpu::RTI(operand_t op) 
 {
     _PLP();
 
     uint16_t addr = pop_word();
     PC() = addr;
-
-    step_cpu(6);
 }
 
 // RTS - Return from subroutine
-void nes_cpu::RTS(nes_addr_mode addr_mode) 
+void nes_cpu::RTS(operand_t op) 
 {
     // See JSR - we pushed actual return address - 1
     uint16_t addr = pop_word() + 1;
     PC() = addr;
-
-    step_cpu(6);
 }
 
 // SEC - Set carry flag
-void nes_cpu::SEC(nes_addr_mode addr_mode) { set_carry_flag(true); step_cpu(nes_cpu_cycle_t(2));  }
+void nes_cpu::SEC(operand_t op) { set_carry_flag(true); }
 
 // SED - Set decimal flag
-void nes_cpu::SED(nes_addr_mode addr_mode) { set_decimal_flag(true); step_cpu(nes_cpu_cycle_t(2)); }
+void nes_cpu::SED(operand_t op) { set_decimal_flag(true); }
 
 // SEI - Set interrupt disable
-void nes_cpu::SEI(nes_addr_mode addr_mode) { set_interrupt_flag(true); step_cpu(nes_cpu_cycle_t(2)); }
+void nes_cpu::SEI(operand_t op) { set_interrupt_flag(true); }
 
 // Store Accumulator  
-void nes_cpu::STA(nes_addr_mode addr_mode)
+void nes_cpu::STA(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     assert(op.kind == operand_kind::operand_kind_addr);;
 
     poke(op.addr_or_value, A());
 
     // Doesn't impact any flags
-
-    // this instruction forces page-crossing timing
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode));
+    // NOTE: this instruction always takes the page-crossing cycle - see the op table
 }
 
 // STX - Store X
-void nes_cpu::STX(nes_addr_mode addr_mode) 
+void nes_cpu::STX(operand_t op) 
 {
-    operand_t op = decode_operand(addr_mode);
     assert(op.kind == operand_kind::operand_kind_addr);
 
     poke(op.addr_or_value, X());
 
     // Doesn't impact any flags
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // STY- Store Y
-void nes_cpu::STY(nes_addr_mode addr_mode)
+void nes_cpu::STY(operand_t op)
 {
-    operand_t op = decode_operand(addr_mode);
     assert(op.kind == operand_kind::operand_kind_addr);
 
     poke(op.addr_or_value, Y());;
 
     // Doesn't impact any flags
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // TAX - Transfer accumulator to X 
-void nes_cpu::TAX(nes_addr_mode addr_mode) 
+void nes_cpu::TAX(operand_t op) 
 {
     X() = A();
 
     calc_alu_flag(X());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // TAY - Transfer accumulator to Y
-void nes_cpu::TAY(nes_addr_mode addr_mode)
+void nes_cpu::TAY(operand_t op)
 {
     Y() = A();
 
     calc_alu_flag(Y());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // TSX - Transfer stack pointer to X 
-void nes_cpu::TSX(nes_addr_mode addr_mode) 
+void nes_cpu::TSX(operand_t op) 
 {
     X() = S();
 
     calc_alu_flag(X());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // TXA - Transfer X to acc
-void nes_cpu::TXA(nes_addr_mode addr_mode)
+void nes_cpu::TXA(operand_t op)
 {
     A() = X();
 
     calc_alu_flag(A());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // TXS - Transfer X to stack pointer
-void nes_cpu::TXS(nes_addr_mode addr_mode)
+void nes_cpu::TXS(operand_t op)
 {
     S() = X();
 
     // Doesn't impact flags
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // TYA - Transfer Y to accumulator
-void nes_cpu::TYA(nes_addr_mode addr_mode) 
+void nes_cpu::TYA(operand_t op) 
 {
     A() = Y();
 
     calc_alu_flag(A());
-
-    step_cpu(nes_cpu_cycle_t(2));
 }
 
 // KIL - Kill?
-void nes_cpu::KIL(nes_addr_mode addr_mode)
+void nes_cpu::KIL(operand_t op)
 {
     _system->stop();
 }
 
+// ILL - Any op code that we don't recognize
+void nes_cpu::ILL(operand_t op)
+{
+    NES_TRACE0("[NES_CPU] Unrecognized instruction or illegal instruction!");
+    assert(false);
+}
+
 //===================================================================================
 // Unofficial OP codes
 //===================================================================================
 
-void nes_cpu::ALR(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::ANC(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::ARR(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::AXS(nes_addr_mode addr_mode) { assert(false); }
+void nes_cpu::ALR(operand_t op) { assert(false); }
+void nes_cpu::ANC(operand_t op) { assert(false); }
+void nes_cpu::ARR(operand_t op) { assert(false); }
+void nes_cpu::AXS(operand_t op) { assert(false); }
 
 // LAX - LDA value then TAX
-void nes_cpu::LAX(nes_addr_mode addr_mode)
+void nes_cpu::LAX(operand_t op)
 {
     // LDA + TAX
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     X() = A() = val;
 
     // flags
     calc_alu_flag(X());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // SAX - AND A X
-void nes_cpu::SAX(nes_addr_mode addr_mode) 
+void nes_cpu::SAX(operand_t op) 
 {
-    operand_t op = decode_operand(addr_mode);
     write_operand(op, A() & X());
-
-    // cycle count
-    step_cpu(get_cpu_cycle(op, addr_mode));
 }
 
 // DCP - DEC value then CMP value
-void nes_cpu::DCP(nes_addr_mode addr_mode) 
+void nes_cpu::DCP(operand_t op) 
 {
     // DEC
-    auto op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     val--;
     write_operand(op, val);
@@ -1429,34 +1626,24 @@ void nes_cpu::DCP(nes_addr_mode addr_mode)
     set_carry_flag(A() >= val);
     set_zero_flag(diff == 0);
     set_negative_flag(diff & 0x80);
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
 // ISC - INC value then SBC value 
-void nes_cpu::ISC(nes_addr_mode addr_mode) 
+void nes_cpu::ISC(operand_t op) 
 {
     // INC
-    auto op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     val++;
     write_operand(op, val);
 
     // SBC
     _SBC(val);
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
 // RLA - ROL value then AND value
-void nes_cpu::RLA(nes_addr_mode addr_mode) 
+void nes_cpu::RLA(operand_t op) 
 {
     // ROL
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     uint8_t new_val = (val << 1) | get_carry();
     write_operand(op, new_val);
@@ -1468,16 +1655,11 @@ void nes_cpu::RLA(nes_addr_mode addr_mode)
 
     // flags    
     calc_alu_flag(A());
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
-void nes_cpu::RRA(nes_addr_mode addr_mode) 
+void nes_cpu::RRA(operand_t op) 
 { 
     // ROR
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     uint8_t new_val = (val >> 1) | (get_carry() << 7);
     write_operand(op, new_val);
@@ -1486,17 +1668,12 @@ void nes_cpu::RRA(nes_addr_mode addr_mode)
 
     // ADC
     _ADC(new_val);
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
 // SLO - ASL value then ORA value
-void nes_cpu::SLO(nes_addr_mode addr_mode) 
+void nes_cpu::SLO(operand_t op) 
 { 
     // ASL
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     uint8_t new_val = val << 1;
     write_operand(op, new_val);
@@ -1507,17 +1684,12 @@ void nes_cpu::SLO(nes_addr_mode addr_mode)
     A() |= new_val;
 
     calc_alu_flag(A());
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
 // SRE - LSR value then EOR value
-void nes_cpu::SRE(nes_addr_mode addr_mode) 
+void nes_cpu::SRE(operand_t op) 
 {
     // LSR
-    operand_t op = decode_operand(addr_mode);
     uint8_t val = read_operand(op);
     uint8_t new_val = (val >> 1);
     write_operand(op, new_val);
@@ -1530,13 +1702,9 @@ void nes_cpu::SRE(nes_addr_mode addr_mode)
 
     // flags
     calc_alu_flag(A());
-
-    // cycle count forces page crossing behavior (then +2)
-    op.is_page_crossing = true;
-    step_cpu(get_cpu_cycle(op, addr_mode) + nes_cpu_cycle_t(2));
 }
 
-void nes_cpu::XAA(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::AHX(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::TAS(nes_addr_mode addr_mode) { assert(false); }
-void nes_cpu::LAS(nes_addr_mode addr_mode) { assert(false); }
\ No newline at end of file
+void nes_cpu::XAA(operand_t op) { assert(false); }
+void nes_cpu::AHX(operand_t op) { assert(false); }
+void nes_cpu::TAS(operand_t op) { assert(false); }
+void nes_cpu::LAS(operand_t op) { assert(false); }
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include "stdafx.h"
+
+#include "nes_frame_pacer.h"
+
+#include <thread>
+
+using namespace std;
+
+// Falling behind by more than this many frames resets the schedule instead of running frames back to back
+#define FRAME_PACER_MAX_LAG 4
+
+// Stop sleeping this long before the deadline and yield the rest of the way
+#define FRAME_PACER_SPIN_SECONDS 0.002
+
+// External clocks can't be slept against directly - check them this often
+#define FRAME_PACER_POLL_SECONDS 0.001
+
+nes_frame_pacer::nes_frame_pacer(double frame_rate)
+    :_frame_rate(frame_rate), _next(0), _started(false), _frame_count(0), _late_count(0)
+{
+    assert(frame_rate > 0);
+
+    _period = 1 / frame_rate;
+    _start = steady_clock::now();
+}
+
+void nes_frame_pacer::set_clock(function<double()> clock)
+{
+    _clock = clock;
+    reset();
+}
+
+double nes_frame_pacer::now()
+{
+    if (_clock)
+        return _clock();
+
+    return duration<double>(steady_clock::now() - _start).count();
+}
+
+void nes_frame_pacer::wait_frame()
+{
+    double cur = now();
+    if (!_started)
+    {
+        _next = cur;
+        _started = true;
+    }
+    else if (cur - _next > _period * FRAME_PACER_MAX_LAG)
+    {
+        // Most likely stalled (window dragged, debugger, etc) - a burst of frames would only look worse
+        _next = cur;
+        _late_count++;
+    }
+
+    while (cur < _next)
+    {
+        double remaining = _next - cur;
+        if (_clock)
+            this_thread::sleep_for(duration<double>(min(remaining, FRAME_PACER_POLL_SECONDS)));
+        else if (remaining > FRAME_PACER_SPIN_SECONDS)
+            this_thread::sleep_for(duration<double>(remaining - FRAME_PACER_SPIN_SECONDS));
+        else
+            this_thread::yield();
+
+        cur = now();
+    }
+
+    // Schedule against the deadline rather than when we woke up so that oversleeping doesn't accumulate
+    _next += _period;
+    _frame_count++;
+}
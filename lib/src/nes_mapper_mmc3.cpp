@@ -2,19 +2,19 @@
 
 //
 // Called when mapper is loaded into memory
-// Useful when all you need is a one-time memcpy
+// PRG banks are mapped directly into CPU address space - bank switching only updates the page table
 //
 void nes_mapper_mmc3::on_load_ram(nes_memory &mem)
 {
     // $E000~$FFFF is always the last bank
-    mem.set_bytes(0xe000, _prg_rom->data() + _prg_rom->size() - 0x2000, 0x2000);
+    mem.map_prg(0xe000, _prg_rom->data() + _prg_rom->size() - 0x2000, 0x2000);
 
     _mem = &mem;
 }
 
 //
 // Called when mapper is loaded into PPU
-// Useful when all you need is a one-time memcpy
+// CHR banks are mapped directly into pattern tables as they are switched
 //
 void nes_mapper_mmc3::on_load_ppu(nes_ppu &ppu)
 {
@@ -38,6 +38,20 @@ void nes_mapper_mmc3::get_info(nes_mapper_info &info)
         info.flags = nes_mapper_flags(info.flags | nes_mapper_flags_vertical_mirroring);
 }
 
+void nes_mapper_mmc3::save_state(nes_state_writer &writer)
+{
+    writer.write(_vertical_mirroring);
+    writer.write(_bank_select);
+    writer.write(_prev_prg_mode);
+}
+
+void nes_mapper_mmc3::load_state(nes_state_reader &reader)
+{
+    reader.read(_vertical_mirroring);
+    reader.read(_bank_select);
+    reader.read(_prev_prg_mode);
+}
+
 void nes_mapper_mmc3::write_reg(uint16_t addr, uint8_t val)
 {
     if (addr <= 0x9fff)
@@ -121,11 +135,11 @@ void nes_mapper_mmc3::write_bank_data(uint8_t val)
         // the second last 8KB bank
         if (_bank_select & 0x40)
         {
-            _mem->set_bytes(0x8000, _prg_rom->data() + _prg_rom->size() - 0x4000, 0x2000);
+            _mem->map_prg(0x8000, _prg_rom->data() + _prg_rom->size() - 0x4000, 0x2000);
         }
         else
         {
-            _mem->set_bytes(0xc000, _prg_rom->data() + _prg_rom->size() - 0x4000, 0x2000);
+            _mem->map_prg(0xc000, _prg_rom->data() + _prg_rom->size() - 0x4000, 0x2000);
         }
     }
 
@@ -155,7 +169,7 @@ void nes_mapper_mmc3::write_bank_data(uint8_t val)
         if (_prg_rom->size() < offset + size)
             return;
 
-        _mem->set_bytes(addr, _prg_rom->data() + offset, size);
+        _mem->map_prg(addr, _prg_rom->data() + offset, size);
     }
     else
     {
@@ -217,7 +231,7 @@ void nes_mapper_mmc3::write_bank_data(uint8_t val)
         if (_chr_rom->size() < offset + ppu_size)
             return;
 
-        _ppu->write_bytes(ppu_addr, _chr_rom->data() + offset, ppu_size);
+        _ppu->map_chr(ppu_addr, _chr_rom->data() + offset, ppu_size);
     }
 }
 
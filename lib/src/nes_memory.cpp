@@ -2,28 +2,181 @@
 
 void nes_memory::power_on(nes_system *system)
 {
+    for (auto &shared : _shared_ram)
+        shared = nullptr;
     memset(&_ram[0], 0, RAM_SIZE);
     _system = system;
     _ppu = _system->ppu();
     _input = _system->input();
+    _apu = _system->apu();
+
+    _mapper = nullptr;
+    reset_pages();
+}
+
+void nes_memory::reset_pages()
+{
+    for (int page = 0; page < RAM_PAGE_COUNT; ++page)
+    {
+        uint8_t *ptr;
+        if (page < 0x20)
+        {
+            // $0000~$07ff mirrored 4 times all the way up to $1fff - resolve mirrors here once
+            ptr = &_ram[0] + ((page & 0x7) << 8);
+        }
+        else if (page < 0x41)
+        {
+            // $2000~$3fff PPU registers, and $4000~$401f APU/IO registers
+            ptr = nullptr;
+        }
+        else
+        {
+            ptr = &_ram[0] + (page << 8);
+        }
+
+        _read_pages[page] = ptr;
+        _write_pages[page] = ptr;
+    }
+}
+
+void nes_memory::share_pages()
+{
+    bool has_private_page = false;
+    for (auto &shared : _shared_ram)
+    {
+        if (!shared)
+        {
+            has_private_page = true;
+            break;
+        }
+    }
+
+    // Already shared from last fork
+    if (!has_private_page)
+        return;
+
+    // Moving the vector keeps the buffer - existing page pointers to RAM now point to the shared image
+    auto image = make_shared<vector<uint8_t>>(std::move(_ram));
+    _ram = vector<uint8_t>(RAM_SIZE);
+    for (auto &shared : _shared_ram)
+    {
+        if (!shared)
+            shared = image;
+    }
+
+    // Only RAM pages are writable - all writes go through write_byte_slow to copy the page first
+    for (auto &page : _write_pages)
+        page = nullptr;
+}
+
+void nes_memory::unshare_page(int ram_page)
+{
+    auto &shared = _shared_ram[ram_page];
+    if (!shared)
+        return;
+
+    uint8_t *shared_page = shared->data() + (ram_page << 8);
+    uint8_t *private_page = &_ram[0] + (ram_page << 8);
+    memcpy(private_page, shared_page, 0x100);
+    shared = nullptr;
+
+    // Internal RAM is mirrored 4 times
+    int mirror_count = (ram_page < 0x8) ? 4 : 1;
+    for (int i = 0; i < mirror_count; ++i)
+    {
+        int page = ram_page + i * 0x8;
+        if (_read_pages[page] == shared_page)
+        {
+            _read_pages[page] = private_page;
+            _write_pages[page] = private_page;
+        }
+    }
+}
+
+void nes_memory::fork_to(nes_memory &child)
+{
+    share_pages();
+
+    for (int page = 0; page < RAM_PAGE_COUNT; ++page)
+    {
+        child._shared_ram[page] = _shared_ram[page];
+        child._read_pages[page] = _read_pages[page];
+        child._write_pages[page] = _write_pages[page];
+    }
+
+    child._mapper_info = _mapper_info;
+}
+
+void nes_memory::map_prg(uint16_t addr, uint8_t *rom, size_t size)
+{
+    assert((addr & 0xff) == 0);
+    assert((size & 0xff) == 0);
+    assert(addr + size <= RAM_SIZE);
+
+    int first_page = addr >> 8;
+    int page_count = int(size >> 8);
+    for (int i = 0; i < page_count; ++i)
+    {
+        _read_pages[first_page + i] = rom + (i << 8);
+
+        // ROM is read only
+        _write_pages[first_page + i] = nullptr;
+    }
+}
+
+void nes_memory::sync_ppu()
+{
+    _ppu->step_to(_system->cpu()->cycle());
+}
+
+void nes_memory::sync_apu()
+{
+    _apu->step_to(_system->cpu()->cycle());
 }
 
 uint8_t nes_memory::read_io_reg(uint16_t addr)
 {
+    if ((addr & 0xfff8) == 0x2000)
+        sync_ppu();
+    else if (addr == 0x4015)
+        sync_apu();
+
+    uint8_t val;
     switch (addr)
     {
-    case 0x2002: return _ppu->read_PPUSTATUS();
-    case 0x2004: return _ppu->read_OAMDATA();
-    case 0x2007: return _ppu->read_PPUDATA();
-    case 0x4016: return _input->read_CONTROLLER(0);
-    case 0x4017: return _input->read_CONTROLLER(1);
+    case 0x2002: val = _ppu->read_PPUSTATUS(); break;
+    case 0x2004: val = _ppu->read_OAMDATA(); break;
+    case 0x2007: val = _ppu->read_PPUDATA(); break;
+    case 0x4015: val = _apu->read_status(); break;
+    case 0x4016: val = _input->read_CONTROLLER(0); break;
+    case 0x4017: val = _input->read_CONTROLLER(1); break;
+    default: val = _ppu->read_latch(); break;
     }
 
-    return _ppu->read_latch();
+    nes_trace_ring *trace = _system->trace_ring();
+    if (trace)
+    {
+        auto cpu = _system->cpu();
+        trace->record_event(nes_trace_event_reg_read, cpu->cycle().count(), cpu->PC(), addr, val);
+    }
+
+    return val;
 }
 
 void nes_memory::write_io_reg(uint16_t addr, uint8_t val)
 {
+    if ((addr & 0xfff8) == 0x2000 || addr == 0x4014)
+        sync_ppu();
+    else if (addr >= 0x4000 && addr <= 0x4017 && addr != 0x4016)
+        sync_apu();
+
+    nes_trace_ring *trace = _system->trace_ring();
+    if (trace)
+    {
+        auto cpu = _system->cpu();
+        trace->record_event(nes_trace_event_reg_write, cpu->cycle().count(), cpu->PC(), addr, val);
+    }
+
     switch (addr)
     {
     case 0x2000: _ppu->write_PPUCTRL(val); return;
@@ -35,25 +188,85 @@ void nes_memory::write_io_reg(uint16_t addr, uint8_t val)
     case 0x2007: _ppu->write_PPUDATA(val); return;
     case 0x4014: _ppu->write_OAMDMA(val); return;
     case 0x4016: _input->write_CONTROLLER(val); return;
-    case 0x4017: _input->write_CONTROLLER(val); return;
     }
 
+    // $4000~$4013, $4015, $4017
+    if (addr >= 0x4000 && addr <= 0x4017)
+        _apu->write_reg(addr, val);
+
     _ppu->write_latch(val);
 }
 
+void nes_memory::save_state(nes_state_writer &writer)
+{
+    for (int page = 0; page < RAM_PAGE_COUNT; ++page)
+        writer.write_bytes(ram_page(page), 0x100);
+
+    // PRG banks currently mapped - RAM shared with forks is saved as if it's in _ram
+    uint8_t *rom = _mapper ? _mapper->prg_rom().data() : nullptr;
+    size_t rom_size = _mapper ? _mapper->prg_rom().size() : 0;
+    for (int page = 0; page < RAM_PAGE_COUNT; ++page)
+    {
+        uint8_t *read_page = _read_pages[page];
+        uint8_t *write_page = _write_pages[page];
+        if (is_shared_page(page))
+            read_page = write_page = &_ram[0] + (ram_page_index(page) << 8);
+
+        writer.write_ptr(read_page, &_ram[0], RAM_SIZE, rom, rom_size);
+        writer.write_ptr(write_page, &_ram[0], RAM_SIZE, rom, rom_size);
+    }
+
+    if (_mapper)
+        _mapper->save_state(writer);
+}
+
+void nes_memory::load_state(nes_state_reader &reader)
+{
+    for (auto &shared : _shared_ram)
+        shared = nullptr;
+    reader.read_bytes(&_ram[0], RAM_SIZE);
+
+    uint8_t *rom = _mapper ? _mapper->prg_rom().data() : nullptr;
+    for (int page = 0; page < RAM_PAGE_COUNT; ++page)
+    {
+        _read_pages[page] = reader.read_ptr(&_ram[0], rom);
+        _write_pages[page] = reader.read_ptr(&_ram[0], rom);
+    }
+
+    if (_mapper)
+        _mapper->load_state(reader);
+}
+
 void nes_memory::load_mapper(shared_ptr<nes_mapper> &mapper)
 {
     // unset previous mapper
     _mapper = nullptr;
+    reset_pages();
 
-    // Give mapper a chance to copy all the bytes needed
+    // Give mapper a chance to copy all the bytes needed, or map PRG ROM
     mapper->on_load_ram(*this);
 
     _mapper = mapper;
     _mapper->get_info(_mapper_info);
+
+    if (_mapper_info.flags & nes_mapper_flags_has_registers)
+    {
+        // Writes to mapper registers need to go through the mapper
+        for (int page = _mapper_info.reg_start >> 8; page <= (_mapper_info.reg_end >> 8); ++page)
+            _write_pages[page] = nullptr;
+    }
 }
 
-void nes_memory::set_byte(uint16_t addr, uint8_t val)
+uint8_t nes_memory::read_byte_slow(uint16_t addr)
+{
+    redirect_addr(addr);
+    if (is_io_reg(addr))
+        return read_io_reg(addr);
+
+    return ram_page(addr >> 8)[addr & 0xff];
+}
+
+void nes_memory::write_byte_slow(uint16_t addr, uint8_t val)
 {
     redirect_addr(addr);
     if (is_io_reg(addr))
@@ -66,10 +279,19 @@ void nes_memory::set_byte(uint16_t addr, uint8_t val)
     {
         if (addr >= _mapper_info.reg_start && addr <= _mapper_info.reg_end)
         {
+            // bank switching / mirroring changes what PPU sees
+            sync_ppu();
             _mapper->write_reg(addr, val);
             return;
         }
     }
 
+    // Page is readable but not writable - this is either ROM where writes are ignored, or RAM shared with
+    // other forks that needs to be copied first
+    uint8_t *page = _read_pages[addr >> 8];
+    if (page && page != ram_page(addr >> 8))
+        return;
+
+    unshare_page(addr >> 8);
     _ram[addr] = val;
-}
\ No newline at end of file
+}
@@ -0,0 +1,231 @@
+#include "stdafx.h"
+
+#include "nes_movie.h"
+
+using namespace std;
+
+bool nes_movie::save(const char *path)
+{
+    ofstream file(path, std::ofstream::out | std::ofstream::binary);
+    if (!file)
+        return false;
+
+    nes_movie_header header;
+    header.magic = NES_MOVIE_MAGIC;
+    header.version = NES_MOVIE_VERSION;
+    header.flags = _flags;
+    header.frame_count = frame_count();
+    header.prg_rom_size = _prg_rom_size;
+    header.chr_rom_size = _chr_rom_size;
+    file.write((char *)&header, sizeof(header));
+
+    for (auto &frame : _frames)
+    {
+        file.write((char *)frame.buttons, sizeof(frame.buttons));
+        if (has_hash())
+            file.write((char *)&frame.hash, sizeof(frame.hash));
+    }
+
+    return bool(file);
+}
+
+bool nes_movie::load(const char *path)
+{
+    clear();
+
+    ifstream file(path, std::ifstream::in | std::ifstream::binary);
+    if (!file)
+        return false;
+
+    nes_movie_header header;
+    if (!file.read((char *)&header, sizeof(header)))
+        return false;
+
+    if (header.magic != NES_MOVIE_MAGIC || header.version != NES_MOVIE_VERSION)
+    {
+        NES_TRACE1("[NES_MOVIE] Invalid movie file '" << path << "'");
+        return false;
+    }
+
+    _flags = header.flags;
+    _prg_rom_size = header.prg_rom_size;
+    _chr_rom_size = header.chr_rom_size;
+
+    // Check frame count against what's actually in the file before allocating for it - a corrupt count could
+    // otherwise ask for gigabytes
+    uint64_t frame_size = sizeof(nes_movie_frame::buttons) + (has_hash() ? sizeof(nes_movie_frame::hash) : 0);
+    auto frames_start = file.tellg();
+    file.seekg(0, std::ios::end);
+    uint64_t file_remaining = uint64_t(file.tellg() - frames_start);
+    file.seekg(frames_start);
+    if (!file || header.frame_count * frame_size > file_remaining)
+    {
+        NES_TRACE1("[NES_MOVIE] Movie file '" << path << "' is truncated");
+        clear();
+        return false;
+    }
+
+    _frames.resize(header.frame_count);
+    for (auto &frame : _frames)
+    {
+        file.read((char *)frame.buttons, sizeof(frame.buttons));
+        frame.hash = 0;
+        if (has_hash())
+            file.read((char *)&frame.hash, sizeof(frame.hash));
+    }
+
+    if (!file)
+    {
+        NES_TRACE1("[NES_MOVIE] Movie file '" << path << "' is truncated");
+        clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool nes_movie::is_rom_loaded(nes_system &system) const
+{
+    auto ram = system.ram();
+    if (!ram->has_mapper())
+        return false;
+
+    return ram->get_mapper().prg_rom().size() == _prg_rom_size &&
+           ram->get_mapper().chr_rom().size() == _chr_rom_size;
+}
+
+//
+// Fast non-cryptographic hash - 8 bytes at a time, as we hash every frame when playing back
+//
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *data, size_t size)
+{
+    const uint64_t prime = 0x9e3779b97f4a7c15ull;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t val;
+        memcpy(&val, data + i, sizeof(val));
+        hash = (hash ^ val) * prime;
+        hash ^= hash >> 32;
+    }
+
+    for (; i < size; ++i)
+    {
+        hash = (hash ^ data[i]) * prime;
+        hash ^= hash >> 32;
+    }
+
+    return hash;
+}
+
+uint64_t nes_movie::hash(nes_system &system)
+{
+    uint8_t ram[0x800];
+    system.ram()->get_bytes(ram, sizeof(ram), 0, sizeof(ram));
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = hash_bytes(hash, ram, sizeof(ram));
+    hash = hash_bytes(hash, system.ppu()->frame_buffer(), PPU_SCREEN_X * PPU_SCREEN_Y);
+
+    return hash;
+}
+
+nes_movie_recorder::nes_movie_recorder(nes_system &system, nes_movie &movie, bool record_hash)
+    :_system(system), _movie(movie)
+{
+    _movie.clear();
+    if (record_hash)
+        _movie._flags |= nes_movie_flags_has_hash;
+
+    auto ram = system.ram();
+    if (ram->has_mapper())
+    {
+        _movie._prg_rom_size = uint32_t(ram->get_mapper().prg_rom().size());
+        _movie._chr_rom_size = uint32_t(ram->get_mapper().chr_rom().size());
+    }
+}
+
+nes_movie_recorder::~nes_movie_recorder()
+{
+    for (int i = 0; i < NES_MAX_PLAYER; ++i)
+    {
+        if (_inputs[i])
+            _system.input()->unregister_input(i);
+    }
+}
+
+void nes_movie_recorder::register_input(int id, shared_ptr<nes_input_device> device)
+{
+    assert(id < NES_MAX_PLAYER);
+
+    _inputs[id] = make_shared<nes_movie_record_input>(device);
+    _system.input()->register_input(id, _inputs[id]);
+}
+
+nes_system_event nes_movie_recorder::run_frame()
+{
+    for (auto &input : _inputs)
+    {
+        if (input)
+            input->next_frame();
+    }
+
+    auto hit = _system.run_frame();
+
+    nes_movie_frame frame;
+    for (int i = 0; i < NES_MAX_PLAYER; ++i)
+        frame.buttons[i] = _inputs[i] ? _inputs[i]->buttons() : nes_button_flags_none;
+    frame.hash = _movie.has_hash() ? nes_movie::hash(_system) : 0;
+    _movie._frames.push_back(frame);
+
+    return hit;
+}
+
+nes_movie_player::nes_movie_player(nes_system &system, const nes_movie &movie)
+    :_system(system), _movie(movie), _frame_id(0)
+{
+    for (int i = 0; i < NES_MAX_PLAYER; ++i)
+    {
+        _inputs[i] = make_shared<nes_movie_play_input>();
+        _system.input()->register_input(i, _inputs[i]);
+    }
+}
+
+nes_movie_player::~nes_movie_player()
+{
+    _system.input()->unregister_all_inputs();
+}
+
+bool nes_movie_player::run_frame(bool verify)
+{
+    assert(!is_done());
+
+    auto &frame = _movie.frames()[_frame_id++];
+    for (int i = 0; i < NES_MAX_PLAYER; ++i)
+        _inputs[i]->set_buttons(frame.buttons[i]);
+
+    _system.run_frame();
+
+    if (verify && _movie.has_hash() && nes_movie::hash(_system) != frame.hash)
+    {
+        NES_TRACE1("[NES_MOVIE] Frame " << std::dec << _frame_id - 1 << " doesn't match the recording");
+        return false;
+    }
+
+    return true;
+}
+
+bool nes_movie_player::play(bool verify)
+{
+    if (!_movie.is_rom_loaded(_system))
+        return false;
+
+    while (!is_done())
+    {
+        if (!run_frame(verify))
+            return false;
+    }
+
+    return true;
+}
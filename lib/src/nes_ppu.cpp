@@ -4,6 +4,15 @@
 #include "nes_system.h"
 #include "nes_memory.h"
 
+// Sprite compositing uses the widest SIMD the compiler targets, with a scalar fallback
+#if defined(__AVX2__)
+#define NES_PPU_USE_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NES_PPU_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 nes_ppu_protect::nes_ppu_protect(nes_ppu *ppu)
 {
     _ppu = ppu;
@@ -15,6 +24,22 @@ nes_ppu_protect::~nes_ppu_protect()
     _ppu->set_protect(false);
 }
 
+//
+// Default NES palette in 0x00RRGGBB
+// http://wiki.nesdev.com/w/index.php/PPU_palettes
+//
+const uint32_t nes_ppu::s_default_palette[PPU_PALETTE_COLOR_COUNT] =
+{
+    0x545454, 0x001e74, 0x081090, 0x300088, 0x440064, 0x5c0030, 0x540400, 0x3c1800,
+    0x202a00, 0x083a00, 0x004000, 0x003c00, 0x00323c, 0x000000, 0x000000, 0x000000,
+    0x989698, 0x084cc4, 0x3032ec, 0x5c1ee4, 0x8814b0, 0xa01464, 0x982220, 0x783c00,
+    0x545a00, 0x287200, 0x087c00, 0x007628, 0x006678, 0x000000, 0x000000, 0x000000,
+    0xeceeec, 0x4c9aec, 0x787cec, 0xb062ec, 0xe454ec, 0xec58b4, 0xec6a64, 0xd48820,
+    0xa0aa00, 0x74c400, 0x4cd020, 0x38cc6c, 0x38b4cc, 0x3c3c3c, 0x000000, 0x000000,
+    0xeceeec, 0xa8ccec, 0xbcbcec, 0xd4b2ec, 0xecaeec, 0xecaed4, 0xecb4b0, 0xe4c490,
+    0xccd278, 0xb4de78, 0xa8e290, 0x98e2b4, 0xa0d6e4, 0xa0a2a0, 0x000000, 0x000000
+};
+
 nes_ppu::~nes_ppu()
 {
     _oam = nullptr;
@@ -47,8 +72,9 @@ void nes_ppu::load_mapper(shared_ptr<nes_mapper> &mapper)
 {
     // unset previous mapper
     _mapper = nullptr;
+    reset_chr_banks();
 
-    // Give mapper a chance to copy all the bytes needed
+    // Give mapper a chance to map CHR ROM
     mapper->on_load_ppu(*this);
 
     nes_mapper_info info;
@@ -63,6 +89,209 @@ void nes_ppu::set_mirroring(nes_mapper_flags flags)
     _mirroring_flags = nes_mapper_flags(flags & nes_mapper_flags_mirroring_mask);
 }
 
+//
+// Frame buffers are not part of the state - only which one is being rendered to. Everything else needed to
+// render identically from this point on is saved
+//
+void nes_ppu::save_state(nes_state_writer &writer)
+{
+    writer.write_bytes(_vram.get(), PPU_VRAM_SIZE);
+    writer.write_bytes(_oam.get(), PPU_OAM_SIZE);
+
+    uint8_t *rom = _mapper ? _mapper->chr_rom().data() : nullptr;
+    size_t rom_size = _mapper ? _mapper->chr_rom().size() : 0;
+    for (int i = 0; i < PPU_CHR_BANK_COUNT; ++i)
+    {
+        writer.write_ptr(_chr_read_banks[i], _vram.get(), PPU_VRAM_SIZE, rom, rom_size);
+        writer.write_ptr(_chr_write_banks[i], _vram.get(), PPU_VRAM_SIZE, rom, rom_size);
+    }
+
+    writer.write(_mirroring_flags);
+
+    // PPUCTRL
+    writer.write(_name_tbl_addr);
+    writer.write(_bg_pattern_tbl_addr);
+    writer.write(_sprite_pattern_tbl_addr);
+    writer.write(_ppu_addr_inc);
+    writer.write(_vblank_nmi);
+    writer.write(_use_8x16_sprite);
+    writer.write(_sprite_height);
+
+    // PPUMASK
+    writer.write(_show_bg);
+    writer.write(_show_sprites);
+    writer.write(_gray_scale_mode);
+    writer.write(_color_emphasis);
+
+    // PPUSTATUS
+    writer.write(_latch);
+    writer.write(_sprite_overflow);
+    writer.write(_vblank_started);
+    writer.write(_sprite_0_hit);
+
+    writer.write(_oam_addr);
+    writer.write(_addr_toggle);
+    writer.write(_ppu_addr);
+    writer.write(_temp_ppu_addr);
+    writer.write(_fine_x_scroll);
+    writer.write(_scroll_y);
+    writer.write(_vram_read_buf);
+
+    writer.write(_master_cycle);
+    writer.write(_scanline_cycle);
+    writer.write(_cur_scanline);
+    writer.write(_frame_count);
+
+    // rendering states
+    writer.write(_tile_index);
+    writer.write(_tile_palette_bit32);
+    writer.write(_bitplane0);
+    writer.write(_x_offset);
+    bool is_frame_buffer_1 = (_frame_buffer == _frame_buffer_1);
+    writer.write(is_frame_buffer_1);
+
+    // sprite rendering
+    writer.write(_sprite_buf);
+    writer.write(_last_sprite_id);
+    writer.write(_has_sprite_0);
+    writer.write(_mask_oam_read);
+    writer.write(_sprite_pos_y);
+    writer.write(_sprite_line);
+    writer.write(_sprite_line_front);
+}
+
+void nes_ppu::load_state(nes_state_reader &reader)
+{
+    reader.read_bytes(_vram.get(), PPU_VRAM_SIZE);
+    reader.read_bytes(_oam.get(), PPU_OAM_SIZE);
+
+    uint8_t *rom = _mapper ? _mapper->chr_rom().data() : nullptr;
+    for (int i = 0; i < PPU_CHR_BANK_COUNT; ++i)
+    {
+        _chr_read_banks[i] = reader.read_ptr(_vram.get(), rom);
+        _chr_write_banks[i] = reader.read_ptr(_vram.get(), rom);
+    }
+
+    // pattern tables are likely different
+    invalidate_tiles(0, PPU_CHR_BANK_SIZE * PPU_CHR_BANK_COUNT);
+
+    reader.read(_mirroring_flags);
+
+    // PPUCTRL
+    reader.read(_name_tbl_addr);
+    reader.read(_bg_pattern_tbl_addr);
+    reader.read(_sprite_pattern_tbl_addr);
+    reader.read(_ppu_addr_inc);
+    reader.read(_vblank_nmi);
+    reader.read(_use_8x16_sprite);
+    reader.read(_sprite_height);
+
+    // PPUMASK
+    reader.read(_show_bg);
+    reader.read(_show_sprites);
+    reader.read(_gray_scale_mode);
+    reader.read(_color_emphasis);
+
+    // PPUSTATUS
+    reader.read(_latch);
+    reader.read(_sprite_overflow);
+    reader.read(_vblank_started);
+    reader.read(_sprite_0_hit);
+
+    reader.read(_oam_addr);
+    reader.read(_addr_toggle);
+    reader.read(_ppu_addr);
+    reader.read(_temp_ppu_addr);
+    reader.read(_fine_x_scroll);
+    reader.read(_scroll_y);
+    reader.read(_vram_read_buf);
+
+    reader.read(_master_cycle);
+    reader.read(_scanline_cycle);
+    reader.read(_cur_scanline);
+    reader.read(_frame_count);
+
+    // rendering states
+    reader.read(_tile_index);
+    reader.read(_tile_palette_bit32);
+    reader.read(_bitplane0);
+    reader.read(_x_offset);
+    bool is_frame_buffer_1;
+    reader.read(is_frame_buffer_1);
+    _frame_buffer = is_frame_buffer_1 ? _frame_buffer_1 : _frame_buffer_2;
+
+    // sprite rendering
+    reader.read(_sprite_buf);
+    reader.read(_last_sprite_id);
+    reader.read(_has_sprite_0);
+    reader.read(_mask_oam_read);
+    reader.read(_sprite_pos_y);
+    reader.read(_sprite_line);
+    reader.read(_sprite_line_front);
+
+    update_next_event_cycle();
+}
+
+void nes_ppu::map_chr(uint16_t addr, uint8_t *chr, size_t size)
+{
+    assert((addr & (PPU_CHR_BANK_SIZE - 1)) == 0);
+    assert((size & (PPU_CHR_BANK_SIZE - 1)) == 0);
+    assert(addr + size <= PPU_CHR_BANK_SIZE * PPU_CHR_BANK_COUNT);
+
+    int first_bank = addr / PPU_CHR_BANK_SIZE;
+    int bank_count = int(size / PPU_CHR_BANK_SIZE);
+    for (int i = 0; i < bank_count; ++i)
+    {
+        _chr_read_banks[first_bank + i] = chr + i * PPU_CHR_BANK_SIZE;
+
+        // CHR ROM is read only
+        _chr_write_banks[first_bank + i] = nullptr;
+    }
+
+    invalidate_tiles(addr, size);
+}
+
+void nes_ppu::reset_chr_banks()
+{
+    for (int i = 0; i < PPU_CHR_BANK_COUNT; ++i)
+    {
+        _chr_read_banks[i] = _vram.get() + i * PPU_CHR_BANK_SIZE;
+        _chr_write_banks[i] = _chr_read_banks[i];
+    }
+
+    invalidate_tiles(0, PPU_CHR_BANK_SIZE * PPU_CHR_BANK_COUNT);
+}
+
+void nes_ppu::invalidate_tiles(uint16_t addr, size_t size)
+{
+    assert(addr + size <= PPU_TILE_COUNT * PPU_TILE_SIZE);
+
+    uint16_t first_tile = addr / PPU_TILE_SIZE;
+    uint16_t last_tile = uint16_t((addr + size - 1) / PPU_TILE_SIZE);
+    memset(_tile_cache_valid + first_tile, 0, last_tile - first_tile + 1);
+}
+
+void nes_ppu::decode_tile(uint16_t tile_id)
+{
+    // Each tile is 8 rows of bitplane 0 followed by 8 rows of bitplane 1
+    // http://wiki.nesdev.com/w/index.php/PPU_pattern_tables
+    uint16_t tile_addr = tile_id * PPU_TILE_SIZE;
+    for (uint8_t row = 0; row < 8; ++row)
+    {
+        uint8_t bitplane0 = read_byte(tile_addr | row);
+        uint8_t bitplane1 = read_byte(tile_addr | 0x8 | row);
+        for (int i = 7; i >= 0; --i)
+        {
+            // high bit is the left most pixel
+            uint8_t palette_index_bit01 = ((bitplane0 >> i) & 0x1) | (((bitplane1 >> i) & 0x1) << 1);
+            _tile_cache[tile_id][row][7 - i] = palette_index_bit01;
+            _tile_cache_flipped[tile_id][row][i] = palette_index_bit01;
+        }
+    }
+
+    _tile_cache_valid[tile_id] = true;
+}
+
 void nes_ppu::init()
 {
     // PPUCTRL data
@@ -78,6 +307,7 @@ void nes_ppu::init()
     _show_bg = false;
     _show_sprites = false;
     _gray_scale_mode = false;
+    _color_emphasis = 0;
 
     // PPUSTATUS
     _latch = 0;
@@ -101,13 +331,12 @@ void nes_ppu::init()
     _vram_read_buf = 0;
 
     _master_cycle = nes_cycle_t(0);
+    _next_event_cycle = nes_cycle_t(0);
     _scanline_cycle = nes_cycle_t(0);
     _cur_scanline = 0;
     _frame_count = 0;
 
     _protect_register = false;
-    _stop_after_frame = -1;
-    _auto_stop = false;
 
     _mask_oam_read = false;
     _frame_buffer = _frame_buffer_1;
@@ -130,6 +359,7 @@ void nes_ppu::power_on(nes_system *system)
     NES_TRACE1("[NES_PPU] POWER ON");
 
     init();
+    reset_chr_banks();
 
     _system = system;
 
@@ -141,11 +371,16 @@ void nes_ppu::fetch_tile()
 {
     auto scanline_render_cycle = nes_ppu_cycle_t(0);
     uint16_t cur_scanline = _cur_scanline;
+    uint8_t *frame_buffer = _frame_buffer;
     if (_scanline_cycle > nes_ppu_cycle_t(320))
     {
         // this is prefetch cycle 321~336 for next scanline
         scanline_render_cycle = _scanline_cycle - nes_ppu_cycle_t(321);
         cur_scanline = (cur_scanline + 1) % PPU_SCREEN_Y ;
+
+        // prefetch on the last visible scanline is for the first scanline of next frame, which is the other buffer
+        if (cur_scanline == 0)
+            frame_buffer = this->frame_buffer();
     }
     else
     {
@@ -160,29 +395,11 @@ void nes_ppu::fetch_tile()
 
     if (data_access_cycle == nes_ppu_cycle_t(0))
     {
-        // fetch nametable byte for current 8-pixel-tile
-        // http://wiki.nesdev.com/w/index.php/PPU_nametables
-        uint16_t name_tbl_addr = (_ppu_addr & 0xfff) | 0x2000;
-        _tile_index = read_byte(name_tbl_addr);
+        fetch_name_table_byte();
     }
     else if (data_access_cycle == nes_ppu_cycle_t(2))
     {
-        // fetch attribute table byte
-        // each attribute pixel is 4 quadrant of 2x2 tile (so total of 8x8) tile
-        // the result color byte is 2-bit (bit 3/2) for each quadrant
-        // http://wiki.nesdev.com/w/index.php/PPU_attribute_tables
-        // http://wiki.nesdev.com/w/index.php/PPU_scrolling#Wrapping_around
-        uint8_t tile_column = _ppu_addr & 0x1f;         // YY YYYX XXXX = 1 1111
-        uint8_t tile_row = (_ppu_addr & 0x3e0) >> 5;    // YY YYYX XXXX = 11 1110 0000
-        uint8_t tile_attr_column = (tile_column >> 2) & 0x7;
-        uint8_t tile_attr_row = (tile_row >> 2) & 0x7;
-        uint16_t attr_tbl_addr = 0x23c0 | (_ppu_addr & 0x0c00) | (tile_attr_row << 3) | tile_attr_column;
-        uint8_t color_byte = read_byte(attr_tbl_addr);
-
-        // each quadrant has 2x2 tile and each row/column has 4 tiles, so divide by 2 (& 0x2 is faster)
-        uint8_t _quadrant_id = (tile_row & 0x2) + ((tile_column & 0x2) >> 1);
-        uint8_t color_bit32 = (color_byte & (0x3 << (_quadrant_id * 2))) >> (_quadrant_id * 2); 
-        _tile_palette_bit32 = color_bit32 << 2;
+        fetch_attribute_table_byte();
     }
     else if (data_access_cycle == nes_ppu_cycle_t(4))
     {
@@ -229,34 +446,154 @@ void nes_ppu::fetch_tile()
             if (tile > 31) return;
         }
 
+        // Logic-only frames keep just what sprite 0 hit needs for the visible cycles. Prefetch for the next
+        // scanline still renders so that a rendered frame following a logic-only one starts out complete
+        bool logic_only = _logic_only && _scanline_cycle <= nes_ppu_cycle_t(256);
+
         for (int i = start_bit; i >= end_bit; --i)
         {
             uint8_t column_mask = 1 << i;
             uint8_t tile_palette_bit01 = ((_bitplane0 & column_mask) >> i) | ((bitplane1 & column_mask) >> i << 1);
-            uint8_t color_4_bit = _tile_palette_bit32 | tile_palette_bit01;
-
-            _pixel_cycle[i] = get_palette_color(/* is_background = */ true, color_4_bit);
 
             uint16_t frame_addr = uint16_t(cur_scanline) * PPU_SCREEN_X + _x_offset++;
             if (frame_addr >= sizeof(_frame_buffer_1))
                 continue;
-            _frame_buffer[frame_addr] = _pixel_cycle[i];
+
+            if (!logic_only)
+            {
+                uint8_t color_4_bit = _tile_palette_bit32 | tile_palette_bit01;
+                _pixel_cycle[i] = get_palette_color(/* is_background = */ true, color_4_bit);
+                frame_buffer[frame_addr] = _pixel_cycle[i];
+            }
 
             // record the palette index just for sprite 0 hit detection
             // the detection use palette 0 instead of actual color
             _frame_buffer_bg[frame_addr] = tile_palette_bit01;
         }
 
-        // Increment X position
-        if ((_ppu_addr & 0x1f) == 0x1f)
+        increment_x();
+    }
+}
+
+// Render background for cycle 1~256 of current visible scanline in one go
+// This is only correct if nothing can observe or change PPU state in the middle of the scanline - see step_to
+void nes_ppu::fetch_tile_scanline()
+{
+    // palette can't change in the middle of the scanline - look them up once
+    uint8_t palette[16];
+    if (!_logic_only)
+    {
+        for (uint8_t i = 0; i < 16; ++i)
+            palette[i] = get_palette_color(/* is_background = */ true, i);
+    }
+
+    uint8_t tile_row_index = (_cur_scanline + _scroll_y) % 8;
+    uint8_t *frame_line = _frame_buffer + _cur_scanline * PPU_SCREEN_X;
+    uint8_t *frame_line_bg = _frame_buffer_bg + _cur_scanline * PPU_SCREEN_X;
+
+    // With fine X scroll the last tile is partially visible
+    int last_tile = (_fine_x_scroll > 0) ? 32 : 31;
+
+    // The first two tiles were already rendered in the prefetch cycles (321~336) of previous scanline
+    for (int tile = 2; tile <= 33; ++tile)
+    {
+        fetch_name_table_byte();
+        fetch_attribute_table_byte();
+
+        if (tile > last_tile)
+            continue;
+
+        const uint8_t *tile_row = get_tile_row(_bg_pattern_tbl_addr | (uint16_t(_tile_index) << 4), tile_row_index, /* flip = */ false);
+        int pixel_count = (tile == 32) ? _fine_x_scroll : 8;
+        if (_logic_only)
         {
-            // Wrap to the next name table
-            _ppu_addr &= ~0x1f;
-            _ppu_addr ^= 0x0400;
+            // only sprite 0 hit detection looks at background
+            for (int i = 0; i < pixel_count; ++i)
+                frame_line_bg[_x_offset++] = tile_row[i];
         }
         else
         {
-            _ppu_addr++;
+            for (int i = 0; i < pixel_count; ++i)
+            {
+                uint8_t x = _x_offset++;
+                frame_line[x] = palette[_tile_palette_bit32 | tile_row[i]];
+                frame_line_bg[x] = tile_row[i];
+            }
+        }
+
+        increment_x();
+    }
+
+    increment_y();
+}
+
+void nes_ppu::fetch_name_table_byte()
+{
+    // fetch nametable byte for current 8-pixel-tile
+    // http://wiki.nesdev.com/w/index.php/PPU_nametables
+    uint16_t name_tbl_addr = (_ppu_addr & 0xfff) | 0x2000;
+    _tile_index = read_byte(name_tbl_addr);
+}
+
+void nes_ppu::fetch_attribute_table_byte()
+{
+    // fetch attribute table byte
+    // each attribute pixel is 4 quadrant of 2x2 tile (so total of 8x8) tile
+    // the result color byte is 2-bit (bit 3/2) for each quadrant
+    // http://wiki.nesdev.com/w/index.php/PPU_attribute_tables
+    // http://wiki.nesdev.com/w/index.php/PPU_scrolling#Wrapping_around
+    uint8_t tile_column = _ppu_addr & 0x1f;         // YY YYYX XXXX = 1 1111
+    uint8_t tile_row = (_ppu_addr & 0x3e0) >> 5;    // YY YYYX XXXX = 11 1110 0000
+    uint8_t tile_attr_column = (tile_column >> 2) & 0x7;
+    uint8_t tile_attr_row = (tile_row >> 2) & 0x7;
+    uint16_t attr_tbl_addr = 0x23c0 | (_ppu_addr & 0x0c00) | (tile_attr_row << 3) | tile_attr_column;
+    uint8_t color_byte = read_byte(attr_tbl_addr);
+
+    // each quadrant has 2x2 tile and each row/column has 4 tiles, so divide by 2 (& 0x2 is faster)
+    uint8_t _quadrant_id = (tile_row & 0x2) + ((tile_column & 0x2) >> 1);
+    uint8_t color_bit32 = (color_byte & (0x3 << (_quadrant_id * 2))) >> (_quadrant_id * 2); 
+    _tile_palette_bit32 = color_bit32 << 2;
+}
+
+void nes_ppu::increment_x()
+{
+    // Increment X position
+    if ((_ppu_addr & 0x1f) == 0x1f)
+    {
+        // Wrap to the next name table
+        _ppu_addr &= ~0x1f;
+        _ppu_addr ^= 0x0400;
+    }
+    else
+    {
+        _ppu_addr++;
+    }
+}
+
+void nes_ppu::increment_y()
+{
+    if ((_ppu_addr & 0x7000) != 0x7000)
+    {
+        // Increase fine Y position (within tile)
+        _ppu_addr += 0x1000;
+    }
+    else
+    {
+        _ppu_addr &= ~0x7000;
+
+        // == row 29?
+        if ((_ppu_addr & 0x3e0) != 0x3a0)
+        {
+             // Increase coarse Y position (next tile)
+            _ppu_addr += 0x20;
+        }
+        else
+        {
+            // wrap around
+            _ppu_addr &= ~0x3e0;
+
+            // switch to another vertical name table
+            _ppu_addr ^= 0x0800;
         }
     }
 }
@@ -274,32 +611,7 @@ void nes_ppu::fetch_tile_pipeline()
         fetch_tile();
 
         if (_scanline_cycle == nes_ppu_cycle_t(256))
-        {
-            if ((_ppu_addr & 0x7000) != 0x7000)
-            {
-                // Increase fine Y position (within tile)
-                _ppu_addr += 0x1000;
-            }
-            else
-            {
-                _ppu_addr &= ~0x7000;
-
-                // == row 29?
-                if ((_ppu_addr & 0x3e0) != 0x3a0)
-                {
-                     // Increase coarse Y position (next tile)
-                    _ppu_addr += 0x20;
-                }
-                else
-                {
-                    // wrap around
-                    _ppu_addr &= ~0x3e0;
-
-                    // switch to another vertical name table
-                    _ppu_addr ^= 0x0800;
-                }
-            }
-        }
+            increment_y();
     }
     else if (_scanline_cycle < nes_ppu_cycle_t(321))
     {
@@ -395,8 +707,20 @@ void nes_ppu::fetch_sprite_pipeline()
         uint8_t sprite_id = sprite_cycle / 8;
         if (sprite_cycle % 8 == 4)
         {
+            if (sprite_id == 0)
+            {
+                memset(_sprite_line, 0, sizeof(_sprite_line));
+                memset(_sprite_line_front, 0, sizeof(_sprite_line_front));
+            }
+
             if (sprite_id < _last_sprite_id)
+            {
                 fetch_sprite(sprite_id);
+
+                // all sprites are in the line buffer - put them on screen
+                if (sprite_id == _last_sprite_id - 1)
+                    compose_sprite_line();
+            }
         }
     }
     else // 337->340
@@ -417,70 +741,122 @@ void nes_ppu::fetch_sprite(uint8_t sprite_id)
     if (sprite->attr & PPU_SPRITE_ATTR_VERTICAL_FLIP)
         tile_row_index = _sprite_height - 1 - tile_row_index;
 
-    uint8_t bitplane0, bitplane1;
+    uint16_t tile_addr;
     if (_use_8x16_sprite)
     {
-        bitplane0 = read_pattern_table_column_8x16_sprite(tile_index, 0, tile_row_index);
-        bitplane1 = read_pattern_table_column_8x16_sprite(tile_index, 1, tile_row_index);
+        // TTTTTTB - T is tile number and B is tile pattern table select $0000 or $1000
+        // the tiles are laid like this:
+        // 0-f: top tile        --> tile row index 0-7
+        // 10-1f: bottom tile   --> tile row index 8-f
+        tile_addr = ((uint16_t(tile_index) & 0x1) << 12) | ((uint16_t(tile_index) & ~0x1) << 4) | ((tile_row_index & 0x8) << 1);
+        tile_row_index &= 0x7;
     }
     else
     {
-        bitplane0 = read_pattern_table_column(/* sprite = */ true, tile_index, 0, tile_row_index);
-        bitplane1 = read_pattern_table_column(/* sprite = */ true, tile_index, 1, tile_row_index);
+        tile_addr = _sprite_pattern_tbl_addr | (uint16_t(tile_index) << 4);
     }
 
+    // horizontal flip simply picks the pre-flipped row
+    const uint8_t *tile_row = get_tile_row(tile_addr, tile_row_index, sprite->attr & PPU_SPRITE_ATTR_HORIZONTAL_FLIP);
+
     // bit3/2 is shared for the entire sprite (just like background attribute table)
     uint8_t palette_index_bit32 = (sprite->attr & PPU_SPRITE_ATTR_BIT32_MASK) << 2;
+    bool behind_bg = sprite->attr & PPU_SPRITE_ATTR_BEHIND_BG;
+
+    // sprites are clipped at the right edge of the screen
+    int pixel_count = PPU_SCREEN_X - sprite->pos_x;
+    if (pixel_count > 8)
+        pixel_count = 8;
+
+    if (_has_sprite_0 && sprite_id == 0)
+    {
+        // sprite 0 hit detection - any opaque sprite pixel over an opaque background pixel
+        // use the recorded 2-bit palette index instead of the actual color as some times game use all
+        // 0f 'black' palette to black out screen
+        // Done here rather than in compose_sprite_line so that hit flag shows up at the same cycle
+        const uint8_t *bg = _frame_buffer_bg + _cur_scanline * PPU_SCREEN_X + sprite->pos_x;
+        for (int x = 0; x < pixel_count; ++x)
+        {
+            if (tile_row[x] && bg[x])
+            {
+                _sprite_0_hit = true;
+                break;
+            }
+        }
+    }
 
-    // loop all bits - high -> low
-    for (int i = 7; i >= 0; --i)
+    if (_logic_only)
+        return;
+
+    // Later sprites are drawn over earlier ones. Whether a behind-background pixel shows depends on the
+    // background, so keep the top most pixel of either priority and let compose_sprite_line pick
+    for (int x = 0; x < pixel_count; ++x)
     {
-        uint8_t column_mask = 1 << i;
-        uint8_t palette_index_bit01 = ((bitplane1 & column_mask) >> i << 1) | ((bitplane0 & column_mask) >> i);
+        uint8_t palette_index_bit01 = tile_row[x];
 
         // palette 0 is always background
         if (palette_index_bit01 == 0)
             continue;
 
-        uint8_t palette_index = palette_index_bit32 | palette_index_bit01;
-
-        uint8_t color = get_palette_color(/* is_background = */false, palette_index);
-        uint16_t frame_addr = _cur_scanline * PPU_SCREEN_X + sprite->pos_x;
-        if (sprite->attr & PPU_SPRITE_ATTR_HORIZONTAL_FLIP)
-            frame_addr += i;     // low -> high in horizontal flip
-        else
-            frame_addr += 7 - i; // high -> low as usual
-
-        if (frame_addr >= sizeof(_frame_buffer_1))
-        {
-            // part of the sprite might be over
-            continue;
-        }
+        uint8_t color = get_palette_color(/* is_background = */false, palette_index_bit32 | palette_index_bit01);
+        _sprite_line[sprite->pos_x + x] = color | PPU_SPRITE_LINE_OPAQUE;
+        if (!behind_bg)
+            _sprite_line_front[sprite->pos_x + x] = color | PPU_SPRITE_LINE_OPAQUE;
+    }
+}
 
-        bool is_sprite_0 = (_has_sprite_0 && sprite_id == 0);
-        bool behind_bg = sprite->attr & PPU_SPRITE_ATTR_BEHIND_BG;
-        if (behind_bg || is_sprite_0)
-        {
-            // use the recorded 2-bit palette index for sprite 0 hit detection
-            // don't use the actual color as some times game use all 0f 'black' palette to black out screen
-            bool overlap = (_frame_buffer_bg[frame_addr] != 0);
-            if (overlap)
-            {
-                if (is_sprite_0)
-                {
-                    // sprite 0 hit detection
-                    _sprite_0_hit = true;
-                }
+//
+// Merge sprite line buffers into the current scanline:
+// background pixel 0 (transparent) - top most sprite pixel of either priority
+// otherwise - top most sprite pixel in front of background
+//
+void nes_ppu::compose_sprite_line()
+{
+    if (_logic_only)
+        return;
 
-                if (behind_bg)
-                {
-                    // behind background
-                    continue;
-                }
-             }
-        }
+    uint8_t *frame_line = _frame_buffer + _cur_scanline * PPU_SCREEN_X;
+    const uint8_t *frame_line_bg = _frame_buffer_bg + _cur_scanline * PPU_SCREEN_X;
 
-        _frame_buffer[frame_addr] = color;
+    int x = 0;
+#if defined(NES_PPU_USE_AVX2)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i color_mask = _mm256_set1_epi8(PPU_SPRITE_LINE_COLOR_MASK);
+    for (; x < PPU_SCREEN_X; x += 32)
+    {
+        __m256i bg = _mm256_loadu_si256((const __m256i *)(frame_line_bg + x));
+        __m256i any = _mm256_loadu_si256((const __m256i *)(_sprite_line + x));
+        __m256i front = _mm256_loadu_si256((const __m256i *)(_sprite_line_front + x));
+        __m256i frame = _mm256_loadu_si256((const __m256i *)(frame_line + x));
+
+        __m256i sprite = _mm256_blendv_epi8(front, any, _mm256_cmpeq_epi8(bg, zero));
+        __m256i opaque = _mm256_cmpgt_epi8(zero, sprite);       // PPU_SPRITE_LINE_OPAQUE is the sign bit
+        frame = _mm256_blendv_epi8(frame, _mm256_and_si256(sprite, color_mask), opaque);
+        _mm256_storeu_si256((__m256i *)(frame_line + x), frame);
+    }
+#elif defined(NES_PPU_USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i color_mask = _mm_set1_epi8(PPU_SPRITE_LINE_COLOR_MASK);
+    for (; x < PPU_SCREEN_X; x += 16)
+    {
+        __m128i bg = _mm_loadu_si128((const __m128i *)(frame_line_bg + x));
+        __m128i any = _mm_loadu_si128((const __m128i *)(_sprite_line + x));
+        __m128i front = _mm_loadu_si128((const __m128i *)(_sprite_line_front + x));
+        __m128i frame = _mm_loadu_si128((const __m128i *)(frame_line + x));
+
+        // no blendv in SSE2 - select with and/andnot/or
+        __m128i bg_transparent = _mm_cmpeq_epi8(bg, zero);
+        __m128i sprite = _mm_or_si128(_mm_and_si128(bg_transparent, any), _mm_andnot_si128(bg_transparent, front));
+        __m128i opaque = _mm_cmplt_epi8(sprite, zero);          // PPU_SPRITE_LINE_OPAQUE is the sign bit
+        frame = _mm_or_si128(_mm_and_si128(opaque, _mm_and_si128(sprite, color_mask)), _mm_andnot_si128(opaque, frame));
+        _mm_storeu_si128((__m128i *)(frame_line + x), frame);
+    }
+#endif
+    for (; x < PPU_SCREEN_X; ++x)
+    {
+        uint8_t sprite = frame_line_bg[x] ? _sprite_line_front[x] : _sprite_line[x];
+        if (sprite & PPU_SPRITE_LINE_OPAQUE)
+            frame_line[x] = sprite & PPU_SPRITE_LINE_COLOR_MASK;
     }
 }
 
@@ -488,6 +864,14 @@ void nes_ppu::step_to(nes_cycle_t count)
 {
     while (_master_cycle < count && !_system->stop_requested())
     {     
+        if (_cur_scanline <= 239 && _scanline_cycle == nes_ppu_cycle_t(0) && count - _master_cycle >= nes_ppu_cycle_t(256))
+        {
+            // Fast path - we are running through cycle 256 of a visible scanline without stopping, which means
+            // CPU can't touch PPU registers or switch CHR banks in the middle (it always syncs PPU first)
+            step_scanline_fast();
+            continue;
+        }
+
         step_ppu(nes_ppu_cycle_t(1));
 
         if (_cur_scanline <= 239)
@@ -504,6 +888,7 @@ void nes_ppu::step_to(nes_cycle_t count)
             {
                 NES_TRACE4("[NES_PPU] SCANLINE = 241, VBlank BEGIN");
                 _vblank_started = true;
+                _system->signal_event(nes_system_event_vblank);
                 if (_vblank_nmi)
                 {
                     // Request NMI so that games can do their rendering
@@ -546,6 +931,192 @@ void nes_ppu::step_to(nes_cycle_t count)
             }
         }
     }
+
+    update_next_event_cycle();
+}
+
+// Run cycle 1~256 of current visible scanline, with background rendered in one batch
+void nes_ppu::step_scanline_fast()
+{
+    if (_show_sprites && _cur_scanline != 0)
+    {
+        // sprite evaluation still runs per cycle - it is cheap compared to background
+        for (int i = 1; i <= 256; ++i)
+        {
+            step_ppu(nes_ppu_cycle_t(1));
+            fetch_sprite_pipeline();
+        }
+    }
+    else
+    {
+        step_ppu(nes_ppu_cycle_t(256));
+    }
+
+    if (_show_bg)
+        fetch_tile_scanline();
+}
+
+void nes_ppu::set_output(void *pixels, int pitch, nes_pixel_format format)
+{
+    _output_pixels = pixels;
+    _output_pitch = pitch;
+    if (_output_format != format)
+    {
+        _output_format = format;
+        build_palette_lut();
+    }
+}
+
+void nes_ppu::set_palette(const uint32_t *rgb)
+{
+    memcpy(_palette_rgb, rgb, sizeof(_palette_rgb));
+    build_palette_lut();
+}
+
+void nes_ppu::build_palette_lut()
+{
+    for (int emphasis = 0; emphasis < 8; ++emphasis)
+    {
+        for (int color = 0; color < PPU_PALETTE_COLOR_COUNT; ++color)
+        {
+            int r = (_palette_rgb[color] >> 16) & 0xff;
+            int g = (_palette_rgb[color] >> 8) & 0xff;
+            int b = _palette_rgb[color] & 0xff;
+
+            // Emphasizing a color darkens the other two - approximate with ~0.82 attenuation
+            // $xE/$xF columns are black and not affected
+            // http://wiki.nesdev.com/w/index.php/NTSC_video#Color_Tint_Bits
+            if ((color & 0xe) != 0xe)
+            {
+                if (emphasis & 0x1) { g = g * 209 / 256; b = b * 209 / 256; }
+                if (emphasis & 0x2) { r = r * 209 / 256; b = b * 209 / 256; }
+                if (emphasis & 0x4) { r = r * 209 / 256; g = g * 209 / 256; }
+            }
+
+            uint32_t val;
+            switch (_output_format)
+            {
+            case nes_pixel_format_rgb565:
+                val = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+                break;
+            case nes_pixel_format_yuy2:
+            {
+                // BT.601 limited range - Y in bit 0~7, U in bit 8~15, V in bit 16~23
+                int y = 16 + (66 * r + 129 * g + 25 * b + 128) / 256;
+                int u = 128 + (-38 * r - 74 * g + 112 * b + 128) / 256;
+                int v = 128 + (112 * r - 94 * g - 18 * b + 128) / 256;
+                val = uint32_t(y) | (uint32_t(u) << 8) | (uint32_t(v) << 16);
+                break;
+            }
+            default:
+                val = 0xff000000 | (r << 16) | (g << 8) | b;
+                break;
+            }
+
+            _palette_lut[(emphasis << 6) | color] = val;
+        }
+    }
+}
+
+// Write the completed scanline into output surface
+void nes_ppu::output_scanline(int scanline)
+{
+    const uint8_t *line = _frame_buffer + scanline * PPU_SCREEN_X;
+    uint8_t *dest = (uint8_t *)_output_pixels + scanline * _output_pitch;
+
+    // grayscale mode only keeps the column 0 (gray) colors
+    uint8_t color_mask = _gray_scale_mode ? 0x30 : 0x3f;
+    const uint32_t *lut = _palette_lut + (_color_emphasis << 6);
+
+    switch (_output_format)
+    {
+    case nes_pixel_format_argb8888:
+    {
+        uint32_t *pixels = (uint32_t *)dest;
+        for (int x = 0; x < PPU_SCREEN_X; ++x)
+            pixels[x] = lut[line[x] & color_mask];
+        break;
+    }
+    case nes_pixel_format_rgb565:
+    {
+        uint16_t *pixels = (uint16_t *)dest;
+        for (int x = 0; x < PPU_SCREEN_X; ++x)
+            pixels[x] = uint16_t(lut[line[x] & color_mask]);
+        break;
+    }
+    case nes_pixel_format_yuy2:
+    {
+        // each pair of pixels share the averaged chroma
+        for (int x = 0; x < PPU_SCREEN_X; x += 2)
+        {
+            uint32_t yuv0 = lut[line[x] & color_mask];
+            uint32_t yuv1 = lut[line[x + 1] & color_mask];
+            dest[x * 2] = uint8_t(yuv0);
+            dest[x * 2 + 1] = uint8_t((((yuv0 >> 8) & 0xff) + ((yuv1 >> 8) & 0xff)) / 2);
+            dest[x * 2 + 2] = uint8_t(yuv1);
+            dest[x * 2 + 3] = uint8_t((((yuv0 >> 16) & 0xff) + ((yuv1 >> 16) & 0xff)) / 2);
+        }
+        break;
+    }
+    }
+}
+
+void nes_ppu::update_next_event_cycle()
+{
+    int64_t frame_cycle = _cur_scanline * PPU_SCANLINE_CYCLE.count() + _scanline_cycle.count();
+    int64_t vblank_cycle = 241 * PPU_SCANLINE_CYCLE.count() + 1;
+    int64_t frame_end_cycle = PPU_SCANLINE_COUNT * PPU_SCANLINE_CYCLE.count();
+
+    int64_t next_cycle;
+    if (frame_cycle < vblank_cycle)
+    {
+        next_cycle = vblank_cycle;
+    }
+    else
+    {
+        // odd frame skips the last cycle - always assume the shorter frame as being early is harmless
+        next_cycle = frame_end_cycle - 1;
+    }
+
+    if (_system->event_mask() & nes_system_event_scanline)
+    {
+        int64_t scanline_end_cycle = (_cur_scanline + 1) * PPU_SCANLINE_CYCLE.count();
+        if (_cur_scanline == PPU_SCANLINE_COUNT - 1)
+            scanline_end_cycle--;
+        if (scanline_end_cycle < next_cycle)
+            next_cycle = scanline_end_cycle;
+    }
+
+    _next_event_cycle = _master_cycle + nes_cycle_t(next_cycle - frame_cycle);
+}
+
+nes_cycle_t nes_ppu::next_status_change_cycle(nes_cycle_t from)
+{
+    // Sprite 0 hit and sprite overflow can change at pretty much any cycle while sprites are being evaluated
+    if (_show_sprites && (_cur_scanline < PPU_SCREEN_Y || _cur_scanline == PPU_SCANLINE_COUNT - 1))
+        return from;
+
+    // PPU might have caught up past from already - we need to include whatever happened in between
+    int64_t frame_cycle = _cur_scanline * PPU_SCANLINE_CYCLE.count() + _scanline_cycle.count();
+    frame_cycle -= (_master_cycle - from).count();
+    if (frame_cycle < 0)
+        return from;
+
+    // Otherwise only vblank flag changes and flags getting cleared at pre-render scanline (see step_to)
+    static const int64_t s_change_cycles[] = {
+        241 * PPU_SCANLINE_CYCLE.count() + 1,                   // vblank starts
+        260 * PPU_SCANLINE_CYCLE.count() + 341 - 12,            // vblank ends early (@HACK in step_to)
+        261 * PPU_SCANLINE_CYCLE.count(),                       // vblank ends, sprite 0 hit cleared
+        PPU_SCANLINE_COUNT * PPU_SCANLINE_CYCLE.count() - 1,    // end of frame (odd frames skip a cycle)
+    };
+
+    for (auto cycle : s_change_cycles)
+    {
+        if (frame_cycle < cycle)
+            return from + nes_cycle_t(cycle - frame_cycle);
+    }
+
+    return from;
 }
 
 void nes_ppu::step_ppu(nes_ppu_cycle_t count)
@@ -557,6 +1128,9 @@ void nes_ppu::step_ppu(nes_ppu_cycle_t count)
 
     if (_scanline_cycle >= PPU_SCANLINE_CYCLE)
     {
+        if (_output_pixels && _cur_scanline < PPU_SCREEN_Y && !_logic_only)
+            output_scanline(_cur_scanline);
+
         _scanline_cycle %= PPU_SCANLINE_CYCLE;
         _cur_scanline++;
         if (_cur_scanline >= PPU_SCANLINE_COUNT)
@@ -566,12 +1140,18 @@ void nes_ppu::step_ppu(nes_ppu_cycle_t count)
             _frame_count++;
             NES_TRACE4("[NES_PPU] FRAME " << std::dec << _frame_count << " ------ ");
 
-            if (_auto_stop && _frame_count > _stop_after_frame)
-            {
-                NES_TRACE1("[NES_PPU] FRAME exceeding " << std::dec << _stop_after_frame << " -> stopping...");
-                _system->stop();
-            }
+            nes_trace_ring *trace = _system->trace_ring();
+            if (trace)
+                trace->record_event(nes_trace_event_frame, _master_cycle.count(), _system->cpu()->PC(), _frame_count);
+
+            _system->signal_event(nes_system_event_frame);
         }
         NES_TRACE4("[NES_PPU] SCANLINE " << std::dec << (uint32_t) _cur_scanline << " ------ ");
+
+        nes_trace_ring *trace = _system->trace_ring();
+        if (trace)
+            trace->record_event(nes_trace_event_scanline, _master_cycle.count(), _system->cpu()->PC(), _cur_scanline);
+
+        _system->signal_event(nes_system_event_scanline);
     }
 }
\ No newline at end of file
@@ -0,0 +1,215 @@
+#include "stdafx.h"
+
+#include "nes_rewind.h"
+#include "nes_system.h"
+
+using namespace std;
+
+//
+// Encoded snapshot is a sequence of runs:
+// uint16 count of unchanged bytes (XOR is zero), uint16 count of changed bytes, followed by the changed bytes
+// XOR'ed with the base
+//
+#define REWIND_MAX_RUN 0xffff
+
+// Unchanged runs shorter than this are cheaper to keep as part of the changed bytes
+#define REWIND_MIN_UNCHANGED_RUN 4
+
+nes_rewind::nes_rewind(size_t buffer_size, uint32_t max_frames, uint32_t interval)
+    :_buf(buffer_size), _entries(max_frames), _interval(interval)
+{
+    assert(max_frames > 0);
+    assert(interval > 0);
+
+    clear();
+}
+
+void nes_rewind::clear()
+{
+    _first = 0;
+    _count = 0;
+    _keyframe_valid = false;
+}
+
+size_t nes_rewind::used_size()
+{
+    size_t size = 0;
+    for (uint32_t i = 0; i < _count; ++i)
+        size += entry(i).size;
+
+    return size;
+}
+
+bool nes_rewind::push(nes_system &system)
+{
+    system.save_state(_state);
+
+    // A different ROM is loaded - the old history can't be restored anymore
+    if (_keyframe.size() != _state.size())
+        clear();
+
+    bool is_keyframe = (!_keyframe_valid || _count == 0 || newest().index + 1 >= _interval);
+    encode(_state, is_keyframe ? nullptr : _keyframe.data());
+
+    // Make room - dropping the oldest keyframes along with their deltas
+    size_t size = _encoded.size();
+    size_t pos = 0;
+    while (_count > 0)
+    {
+        if (_count < _entries.size())
+        {
+            size_t tail = oldest().offset;
+            size_t head = newest().offset + newest().size;
+            if (tail < head)
+            {
+                // free space is [head, end) and [0, tail)
+                if (head + size <= _buf.size())
+                {
+                    pos = head;
+                    break;
+                }
+                if (size <= tail)
+                {
+                    pos = 0;
+                    break;
+                }
+            }
+            else if (head + size <= tail)
+            {
+                // wrapped around - free space is [head, tail)
+                pos = head;
+                break;
+            }
+        }
+
+        drop_oldest();
+    }
+
+    if (_count == 0 && !is_keyframe)
+    {
+        // we've dropped the keyframe this delta is against
+        is_keyframe = true;
+        encode(_state, nullptr);
+        size = _encoded.size();
+    }
+
+    if (size > _buf.size())
+        return false;
+
+    memcpy(_buf.data() + pos, _encoded.data(), size);
+
+    nes_rewind_entry snapshot;
+    snapshot.offset = pos;
+    snapshot.size = uint32_t(size);
+    snapshot.index = is_keyframe ? 0 : newest().index + 1;
+    _count++;
+    newest() = snapshot;
+
+    if (is_keyframe)
+    {
+        _keyframe = _state;
+        _keyframe_valid = true;
+    }
+
+    return true;
+}
+
+bool nes_rewind::rewind(nes_system &system, uint32_t frames)
+{
+    if (frames == 0 || frames > _count)
+        return false;
+
+    uint32_t target_id = _count - frames;
+    nes_rewind_entry target = entry(target_id);
+
+    // Keyframe first - the deltas are all against the keyframe
+    _state.assign(_keyframe.size(), 0);
+    decode(entry(target_id - target.index), _state);
+    if (target.index > 0)
+    {
+        // remaining deltas after this are against the same keyframe - keep it for the next push
+        _keyframe = _state;
+        _keyframe_valid = true;
+        decode(target, _state);
+    }
+    else
+    {
+        // the keyframe is popped so the next push starts a new one
+        _keyframe_valid = false;
+    }
+
+    _count = target_id;
+
+    return system.load_state(_state);
+}
+
+void nes_rewind::drop_oldest()
+{
+    do
+    {
+        _first = (_first + 1) % _entries.size();
+        _count--;
+    } while (_count > 0 && oldest().index != 0);
+}
+
+void nes_rewind::encode(const vector<uint8_t> &state, const uint8_t *base)
+{
+    _encoded.clear();
+
+    const uint8_t *cur = state.data();
+    size_t size = state.size();
+    auto diff = [&](size_t i) { return base ? uint8_t(cur[i] ^ base[i]) : cur[i]; };
+
+    size_t i = 0;
+    while (i < size)
+    {
+        size_t unchanged = 0;
+        while (i < size && unchanged < REWIND_MAX_RUN && diff(i) == 0)
+        {
+            i++;
+            unchanged++;
+        }
+
+        size_t changed_start = i;
+        while (i < size && i - changed_start < REWIND_MAX_RUN)
+        {
+            if (diff(i) == 0)
+            {
+                // stop at a long enough unchanged run (or trailing unchanged bytes)
+                size_t run = 1;
+                while (run < REWIND_MIN_UNCHANGED_RUN && i + run < size && diff(i + run) == 0)
+                    run++;
+                if (run == REWIND_MIN_UNCHANGED_RUN || i + run == size)
+                    break;
+            }
+            i++;
+        }
+        size_t changed = i - changed_start;
+
+        _encoded.push_back(uint8_t(unchanged));
+        _encoded.push_back(uint8_t(unchanged >> 8));
+        _encoded.push_back(uint8_t(changed));
+        _encoded.push_back(uint8_t(changed >> 8));
+        for (size_t j = changed_start; j < i; ++j)
+            _encoded.push_back(diff(j));
+    }
+}
+
+void nes_rewind::decode(const nes_rewind_entry &snapshot, vector<uint8_t> &state)
+{
+    const uint8_t *encoded = _buf.data() + snapshot.offset;
+    const uint8_t *encoded_end = encoded + snapshot.size;
+
+    size_t pos = 0;
+    while (encoded < encoded_end)
+    {
+        size_t unchanged = encoded[0] | (encoded[1] << 8);
+        size_t changed = encoded[2] | (encoded[3] << 8);
+        encoded += 4;
+
+        pos += unchanged;
+        assert(pos + changed <= state.size());
+        for (size_t i = 0; i < changed; ++i)
+            state[pos++] ^= *encoded++;
+    }
+}
@@ -3,6 +3,7 @@
 #include "nes_cpu.h"
 #include "nes_system.h"
 #include "nes_ppu.h"
+#include "nes_apu.h"
 
 using namespace std;
 
@@ -12,18 +13,32 @@ nes_system::nes_system()
     _cpu = make_unique<nes_cpu>();
     _ppu = make_unique<nes_ppu>();
     _input = make_unique<nes_input>();
+    _apu = make_unique<nes_apu>();
 
     _components.push_back(_ram.get());
     _components.push_back(_cpu.get());
     _components.push_back(_ppu.get());
     _components.push_back(_input.get());
+    _components.push_back(_apu.get());
 }
                          
 nes_system::~nes_system() {}
 
+void nes_system::enable_trace_ring(size_t capacity)
+{
+    _trace_ring = make_unique<nes_trace_ring>(capacity);
+}
+
+void nes_system::disable_trace_ring()
+{
+    _trace_ring.reset();
+}
+
 void nes_system::init()
 {
     _stop_requested = false;
+    _event_mask = nes_system_event_none;
+    _event_hit = nes_system_event_none;
     _master_cycle = nes_cycle_t(0);
 }
 
@@ -53,7 +68,11 @@ void nes_system::run_program(vector<uint8_t> &&program, uint16_t addr)
 
 void nes_system::load_rom(const char *rom_path, nes_rom_exec_mode mode)
 {
-    auto mapper = nes_rom_loader::load_from(rom_path);
+    load_mapper(nes_rom_loader::load_from(rom_path), mode);
+}
+
+void nes_system::load_mapper(shared_ptr<nes_mapper> mapper, nes_rom_exec_mode mode)
+{
     _ram->load_mapper(mapper);
     _ppu->load_mapper(mapper);
 
@@ -70,6 +89,103 @@ void nes_system::load_rom(const char *rom_path, nes_rom_exec_mode mode)
     }
 }
 
+void nes_system::save_state(vector<uint8_t> &state)
+{
+    state.clear();
+
+    nes_state_header header;
+    header.magic = NES_STATE_MAGIC;
+    header.version = NES_STATE_VERSION;
+    header.size = 0;    // patched below
+    get_rom_size(header.prg_rom_size, header.chr_rom_size);
+
+    nes_state_writer writer(state);
+    writer.write(header);
+    writer.write(_master_cycle);
+    for (auto comp : _components)
+        comp->save_state(writer);
+
+    ((nes_state_header *)state.data())->size = uint32_t(state.size());
+}
+
+bool nes_system::load_state(const uint8_t *state, size_t size)
+{
+    if (size < sizeof(nes_state_header))
+        return false;
+
+    nes_state_header header;
+    memcpy(&header, state, sizeof(header));
+
+    uint32_t prg_rom_size, chr_rom_size;
+    get_rom_size(prg_rom_size, chr_rom_size);
+    if (header.magic != NES_STATE_MAGIC || header.version != NES_STATE_VERSION || header.size != size ||
+        header.prg_rom_size != prg_rom_size || header.chr_rom_size != chr_rom_size)
+    {
+        NES_TRACE1("[NES_SYSTEM] Invalid savestate");
+        return false;
+    }
+
+    nes_state_reader reader(state, size);
+    reader.read(header);
+    reader.read(_master_cycle);
+    for (auto comp : _components)
+        comp->load_state(reader);
+
+    assert(reader.offset() == size);
+
+    return true;
+}
+
+unique_ptr<nes_system> nes_system::fork()
+{
+    auto child = make_unique<nes_system>();
+    fork_to(*child);
+
+    return child;
+}
+
+void nes_system::fork_to(nes_system &child)
+{
+    assert(&child != this);
+
+    child.power_on();
+    child._master_cycle = _master_cycle;
+
+    if (_ram->has_mapper())
+    {
+        // Mapper registers are copied while ROM is shared
+        auto mapper = _ram->get_mapper().clone();
+        child._ram->load_mapper(mapper);
+        child._ppu->load_mapper(mapper);
+    }
+
+    _ram->fork_to(*child._ram);
+
+    // The rest is small enough to simply copy over
+    vector<uint8_t> state;
+    nes_state_writer writer(state);
+    _cpu->save_state(writer);
+    _ppu->save_state(writer);
+    _input->save_state(writer);
+    _apu->save_state(writer);
+
+    nes_state_reader reader(state.data(), state.size());
+    child._cpu->load_state(reader);
+    child._ppu->load_state(reader);
+    child._input->load_state(reader);
+    child._apu->load_state(reader);
+}
+
+void nes_system::get_rom_size(uint32_t &prg_rom_size, uint32_t &chr_rom_size)
+{
+    prg_rom_size = chr_rom_size = 0;
+    if (_ram->has_mapper())
+    {
+        prg_rom_size = uint32_t(_ram->get_mapper().prg_rom().size());
+        chr_rom_size = uint32_t(_ram->get_mapper().chr_rom().size());
+    }
+}
+
 void nes_system::run_rom(const char *rom_path, nes_rom_exec_mode mode)
 {
     load_rom(rom_path, mode);
@@ -79,7 +195,8 @@ void nes_system::run_rom(const char *rom_path, nes_rom_exec_mode mode)
 
 void nes_system::test_loop()
 {
-    auto tick = nes_cycle_t(1);
+    // There is no need to step 1 cycle at a time - components stop right away when stop is requested
+    auto tick = nes_cycle_t(PPU_SCANLINE_CYCLE * PPU_SCANLINE_COUNT);
     while (!_stop_requested)
     {
         step(tick);
@@ -93,7 +210,71 @@ void nes_system::step(nes_cycle_t count)
     // Manually step the individual components instead of all components
     // This saves a loop and also it's kinda stupid to step components that doesn't require stepping in the
     // first place. Such as ram / controller, etc. 
+    // CPU drives the PPU as needed, so PPU only needs to catch up with whatever is left at the end
     _cpu->step_to(_master_cycle);
     _ppu->step_to(_master_cycle);
+
+    // APU follows CPU rather than PPU - everything it played so far becomes samples in one go
+    _apu->step_to(_cpu->cycle());
+    _apu->end_frame();
+
+    // We've returned early at an event - PPU is exactly at the event
+    if (_event_hit)
+        _master_cycle = _ppu->cycle();
+}
+
+nes_system_event nes_system::run_until(int event_mask)
+{
+    _event_mask = event_mask;
+    _event_hit = nes_system_event_none;
+
+    // PPU needs to know it has new events to stop at
+    _ppu->update_next_event_cycle();
+
+    auto tick = nes_cycle_t(PPU_SCANLINE_CYCLE * PPU_SCANLINE_COUNT);
+    while (!stop_requested())
+    {
+        step(tick);
+    }
+
+    int hit = _event_hit;
+    if (_stop_requested)
+        hit |= nes_system_event_stop;
+
+    _event_mask = nes_system_event_none;
+    _event_hit = nes_system_event_none;
+    _ppu->update_next_event_cycle();
+
+    return nes_system_event(hit);
+}
+
+nes_system_event nes_system::run_frames(int count)
+{
+    bool logic_only = _ppu->is_logic_only();
+
+    nes_system_event hit = nes_system_event_none;
+    for (int i = 0; i < count; ++i)
+    {
+        _ppu->set_logic_only(logic_only || i < count - 1);
+        hit = run_frame();
+        if (hit & nes_system_event_stop)
+            break;
+    }
+
+    _ppu->set_logic_only(logic_only);
+    return hit;
+}
+
+nes_system_event nes_system::run_scanlines(int count)
+{
+    nes_system_event hit = nes_system_event_none;
+    for (int i = 0; i < count; ++i)
+    {
+        hit = run_until(nes_system_event_scanline);
+        if (hit & nes_system_event_stop)
+            break;
+    }
+
+    return hit;
 }
     
\ No newline at end of file
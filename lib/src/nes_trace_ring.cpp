@@ -0,0 +1,209 @@
+#include "stdafx.h"
+
+#include <chrono>
+
+#include "nes_trace_ring.h"
+
+using namespace std;
+
+// Records formatted per fwrite when streaming or dumping
+#define NES_TRACE_RING_BATCH 1024
+
+nes_trace_ring::nes_trace_ring(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    _records = make_unique<nes_trace_record[]>(size);
+    _mask = size - 1;
+    _head = 0;
+    _tail = 0;
+    _streaming = false;
+    _stop_requested = false;
+}
+
+nes_trace_ring::~nes_trace_ring()
+{
+    stop_streaming();
+}
+
+size_t nes_trace_ring::read(nes_trace_record *dest, size_t count)
+{
+    uint64_t head = _head.load(std::memory_order_acquire);
+    uint64_t tail = _tail.load(std::memory_order_relaxed);
+
+    size_t available = size_t(head - tail);
+    if (count > available)
+        count = available;
+
+    for (size_t i = 0; i < count; ++i)
+        dest[i] = _records[(tail + i) & _mask];
+
+    // Hand the slots back to the producer only after we are done copying
+    _tail.store(tail + count, std::memory_order_release);
+    return count;
+}
+
+static const char s_hex_digits[] = "0123456789ABCDEF";
+
+static void append_hex(string &str, uint32_t val, int digits)
+{
+    char buf[8];
+    for (int i = digits - 1; i >= 0; --i)
+    {
+        buf[i] = s_hex_digits[val & 0xf];
+        val >>= 4;
+    }
+    str.append(buf, digits);
+}
+
+static void append_reg(string &str, const char *name, uint8_t val)
+{
+    str.append(name);
+    append_hex(str, val, 2);
+    str.append(1, ' ');
+}
+
+void nes_trace_ring::format(string &str, const nes_trace_record &rec)
+{
+    // Formatting is the bottleneck of streaming, so stay away from printf-style formatting for the common cases
+    switch (rec.type)
+    {
+    case nes_trace_event_instruction:
+    {
+        // Same layout as nes_cpu::get_op_str so that logs can be diffed against each other
+        size_t start = str.size();
+        nes_cpu::append_instruction_str(str, rec.pc, rec.op_code, rec.operand);
+        if (str.size() < start + 48)
+            str.append(start + 48 - str.size(), ' ');
+        append_reg(str, "A:", rec.a);
+        append_reg(str, "X:", rec.x);
+        append_reg(str, "Y:", rec.y);
+        append_reg(str, "P:", rec.p);
+        append_reg(str, "SP:", rec.s);
+
+        int cycle = int(rec.cycle % PPU_SCANLINE_CYCLE.count());
+        char buf[8] = { 'C', 'Y', 'C', ':', ' ', ' ', ' ' };
+        for (int i = 6; i >= 4; --i)
+        {
+            buf[i] = char('0' + cycle % 10);
+            cycle /= 10;
+            if (cycle == 0)
+                break;
+        }
+        str.append(buf, 7);
+        break;
+    }
+    case nes_trace_event_nmi:
+        str.append("[NES_CPU] NMI interrupt at ");
+        append_hex(str, rec.pc, 4);
+        break;
+    case nes_trace_event_irq:
+        str.append("[NES_CPU] IRQ interrupt at ");
+        append_hex(str, rec.pc, 4);
+        break;
+    case nes_trace_event_oam_dma:
+        str.append("[NES_CPU] OAMDMA at ");
+        append_hex(str, rec.data, 4);
+        break;
+    case nes_trace_event_reg_read:
+    case nes_trace_event_reg_write:
+        str.append(rec.type == nes_trace_event_reg_read ? "[NES_MEM] read $" : "[NES_MEM] write $");
+        append_hex(str, rec.data, 4);
+        str.append(" = ");
+        append_hex(str, rec.value, 2);
+        break;
+    case nes_trace_event_scanline:
+        str.append("[NES_PPU] SCANLINE ");
+        str.append(to_string(rec.data));
+        str.append(" ------ ");
+        break;
+    case nes_trace_event_frame:
+        str.append("[NES_PPU] FRAME ");
+        str.append(to_string(rec.data));
+        str.append(" ------ ");
+        break;
+    default:
+        str.append("[NES_TRACE] unknown event ");
+        str.append(to_string(rec.type));
+        break;
+    }
+}
+
+void nes_trace_ring::write_records(FILE *file, string &text, nes_trace_record *buf, size_t count)
+{
+    text.clear();
+    for (size_t i = 0; i < count; ++i)
+    {
+        format(text, buf[i]);
+        text.append(1, '\n');
+    }
+
+    fwrite(text.data(), 1, text.size(), file);
+}
+
+bool nes_trace_ring::dump(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    auto buf = make_unique<nes_trace_record[]>(NES_TRACE_RING_BATCH);
+    string text;
+    size_t count;
+    while ((count = read(buf.get(), NES_TRACE_RING_BATCH)) > 0)
+        write_records(file, text, buf.get(), count);
+
+    fclose(file);
+    return true;
+}
+
+bool nes_trace_ring::start_streaming(const char *path)
+{
+    assert(!_streaming);
+
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    _stop_requested = false;
+    _streaming = true;
+    _stream_thread = thread(&nes_trace_ring::stream_loop, this, file);
+    return true;
+}
+
+void nes_trace_ring::stop_streaming()
+{
+    if (!_streaming)
+        return;
+
+    _stop_requested = true;
+    _stream_thread.join();
+    _streaming = false;
+}
+
+void nes_trace_ring::stream_loop(FILE *file)
+{
+    auto buf = make_unique<nes_trace_record[]>(NES_TRACE_RING_BATCH);
+    string text;
+    while (true)
+    {
+        // Check stop before reading so that everything recorded before stop_streaming makes it out
+        bool stop = _stop_requested;
+
+        size_t count = read(buf.get(), NES_TRACE_RING_BATCH);
+        if (count > 0)
+        {
+            write_records(file, text, buf.get(), count);
+            continue;
+        }
+
+        if (stop)
+            break;
+
+        this_thread::sleep_for(chrono::microseconds(100));
+    }
+
+    fclose(file);
+}
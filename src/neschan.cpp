@@ -3,17 +3,19 @@
 
 #include "stdafx.h"
 #include "neschan.h"
+#include <atomic>
 #include <iostream>
+#include <thread>
 
 using namespace std;
 
-inline uint32_t make_argb(uint8_t r, uint8_t g, uint8_t b)
-{
-    return (r << 16) | (g << 8) | b;
-}
-
 #define JOYSTICK_DEADZONE 8000
 
+#define AUDIO_SAMPLE_RATE 44100
+#define AUDIO_DEVICE_SAMPLES 512        // per callback - about 12ms
+#define AUDIO_RING_CAPACITY 4096        // about 90ms - several frames of headroom either way
+#define AUDIO_LATENCY_FRAMES 2          // buffer level that rate control holds, on top of the device buffer
+
 class neschan_exception : runtime_error 
 {
 public :
@@ -138,6 +140,41 @@ const SDL_GameControllerButton sdl_game_controller::s_buttons[] = {
     SDL_CONTROLLER_BUTTON_DPAD_RIGHT
 };
 
+//
+// What the emulation thread sees as a controller. SDL devices are polled on the main thread, which pumps SDL
+// events (SDL expects joystick and keyboard state to be read there), and their buttons are relayed here
+//
+class sdl_input_relay : public nes_input_device
+{
+public :
+    sdl_input_relay()
+        :_buttons(0)
+    {
+    }
+
+    // Emulation thread
+    virtual nes_button_flags poll_status()
+    {
+        return nes_button_flags(_buttons.load(std::memory_order_relaxed));
+    }
+
+    // Main thread
+    void set_status(nes_button_flags flags)
+    {
+        _buttons.store(uint8_t(flags), std::memory_order_relaxed);
+    }
+
+private :
+    atomic<uint8_t> _buttons;
+};
+
+// Runs on SDL's audio thread - must not block, so it only ever pulls from the lock-free ring
+static void sdl_audio_callback(void *userdata, Uint8 *stream, int len)
+{
+    auto audio_ring = reinterpret_cast<nes_audio_ring *>(userdata);
+    audio_ring->read(reinterpret_cast<int16_t *>(stream), len / sizeof(int16_t));
+}
+
 int main(int argc, char *argv[])
 {
     // Initialize SDL with everything (video, audio, joystick, events, etc)
@@ -152,21 +189,24 @@ int main(int argc, char *argv[])
     }
 
     const char *error = nullptr;
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
         SDL_ShowSimpleMessageBox(
             SDL_MESSAGEBOX_ERROR,
             "Usage error",
-            "Usage: neschan <rom_file_path>", 
+            "Usage: neschan <rom_file_path> [record_movie_file_path]", 
             NULL);
         return -1;
     }
 
-    SDL_Window *sdl_window;
-    SDL_Renderer *sdl_renderer;
-    SDL_CreateWindowAndRenderer(PPU_SCREEN_X * 2, PPU_SCREEN_Y * 2, SDL_WINDOW_SHOWN, &sdl_window, &sdl_renderer);
+    SDL_Window *sdl_window = SDL_CreateWindow(
+        "NESChan v0.1 by yizhang82",
+        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+        PPU_SCREEN_X * 2, PPU_SCREEN_Y * 2,
+        SDL_WINDOW_SHOWN);
 
-    SDL_SetWindowTitle(sdl_window, "NESChan v0.1 by yizhang82");
+    // Present waits for vsync so the render thread sleeps rather than spins
+    SDL_Renderer *sdl_renderer = SDL_CreateRenderer(sdl_window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
     SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");  // make the scaled rendering look smoother.
     SDL_RenderSetLogicalSize(sdl_renderer, PPU_SCREEN_X, PPU_SCREEN_Y);
@@ -197,40 +237,122 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    vector<uint32_t> pixels(PPU_SCREEN_Y * PPU_SCREEN_X);
-
-    static uint32_t palette[] = 
-    {
-        make_argb(84,  84,  84),    make_argb(0,  30, 116),    make_argb(8,  16, 144),    make_argb(48,   0, 136),   make_argb(68,   0, 100),   make_argb(92,   0,  48),   make_argb(84,   4,   0),   make_argb(60,  24,   0),   make_argb(32,  42,   0),   make_argb(8,  58,   0),   make_argb(0,  64,   0),    make_argb(0,  60,   0),    make_argb(0,  50,  60),    make_argb(0,   0,   0),   make_argb(0, 0, 0), make_argb(0, 0, 0),
-        make_argb(152, 150, 152),   make_argb(8,  76, 196),    make_argb(48,  50, 236),   make_argb(92,  30, 228),   make_argb(136,  20, 176),  make_argb(160,  20, 100),  make_argb(152,  34,  32),  make_argb(120,  60,   0),  make_argb(84,  90,   0),   make_argb(40, 114,   0),  make_argb(8, 124,   0),    make_argb(0, 118,  40),    make_argb(0, 102, 120),    make_argb(0,   0,   0),   make_argb(0, 0, 0), make_argb(0, 0, 0),
-        make_argb(236, 238, 236),   make_argb(76, 154, 236),   make_argb(120, 124, 236),  make_argb(176,  98, 236),  make_argb(228,  84, 236),  make_argb(236,  88, 180),  make_argb(236, 106, 100),  make_argb(212, 136,  32),  make_argb(160, 170,   0),  make_argb(116, 196,   0), make_argb(76, 208,  32),   make_argb(56, 204, 108),   make_argb(56, 180, 204),   make_argb(60,  60,  60),  make_argb(0, 0, 0), make_argb(0, 0, 0),
-        make_argb(236, 238, 236),   make_argb(168, 204, 236),  make_argb(188, 188, 236),  make_argb(212, 178, 236),  make_argb(236, 174, 236),  make_argb(236, 174, 212),  make_argb(236, 180, 176),  make_argb(228, 196, 144),  make_argb(204, 210, 120),  make_argb(180, 222, 120), make_argb(168, 226, 144),  make_argb(152, 226, 180),  make_argb(160, 214, 228),  make_argb(160, 162, 160), make_argb(0, 0, 0), make_argb(0, 0, 0)
+    // Optionally record all input into a movie that can be played back later
+    const char *movie_path = (argc == 3) ? argv[2] : nullptr;
+    nes_movie movie;
+    unique_ptr<nes_movie_recorder> recorder;
+    if (movie_path)
+        recorder = make_unique<nes_movie_recorder>(system, movie);
+
+    // SDL devices polled by the main loop, and the relays the emulation thread polls instead
+    vector<shared_ptr<nes_input_device>> sdl_devices;
+    vector<shared_ptr<sdl_input_relay>> input_relays;
+    auto register_input = [&](int id, shared_ptr<nes_input_device> device) {
+        auto relay = make_shared<sdl_input_relay>();
+        sdl_devices.push_back(device);
+        input_relays.push_back(relay);
+
+        if (recorder)
+            recorder->register_input(id, relay);
+        else
+            system.input()->register_input(id, relay);
     };
-    assert(sizeof(palette) == sizeof(uint32_t) * 0x40);
 
     int num_joysticks = SDL_NumJoysticks();
     NES_LOG("[NESCHAN] " << num_joysticks << " JoySticks detected.");
     if (num_joysticks == 0)
     {
-        system.input()->register_input(0, std::make_shared<sdl_keyboard_controller>());
+        register_input(0, std::make_shared<sdl_keyboard_controller>());
     }
     else
     {
         for (int i = 0; i < num_joysticks; i++)
         {
             if (i < NES_MAX_PLAYER)
-                system.input()->register_input(i, std::make_shared<sdl_game_controller>(i));
+                register_input(i, std::make_shared<sdl_game_controller>(i));
         }
     }
 
-    SDL_Event sdl_event;
-    Uint64 prev_counter = SDL_GetPerformanceCounter();
-    Uint64 count_per_second = SDL_GetPerformanceFrequency();
+    //
+    // Audio is pulled by SDL's audio thread from a ring that the emulation thread fills after each frame
+    // Without an audio device the game simply runs silent
+    //
+    nes_audio_ring audio_ring(AUDIO_RING_CAPACITY);
+
+    SDL_AudioSpec audio_want = {};
+    SDL_AudioSpec audio_have = {};
+    audio_want.freq = AUDIO_SAMPLE_RATE;
+    audio_want.format = AUDIO_S16SYS;
+    audio_want.channels = 1;
+    audio_want.samples = AUDIO_DEVICE_SAMPLES;
+    audio_want.callback = sdl_audio_callback;
+    audio_want.userdata = &audio_ring;
+    SDL_AudioDeviceID audio_device = SDL_OpenAudioDevice(NULL, 0, &audio_want, &audio_have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (audio_device == 0)
+    {
+        NES_LOG("[NESCHAN] Failed to open audio device: " << SDL_GetError());
+    }
+    else
+    {
+        system.apu()->set_sample_rate(audio_have.freq);
+    }
 
     //
-    // Game main loop
+    // Emulation runs on its own thread and hands completed frames over through a triple buffer, so that
+    // converting and presenting (SDL_RenderPresent may block on vsync) never stall emulation
+    // Input is polled by the main loop and relayed to the emulation thread (see sdl_input_relay)
     //
-    bool quit = false;
+    const int frame_pitch = PPU_SCREEN_X * sizeof(uint32_t);
+    nes_triple_buffer frames(frame_pitch * PPU_SCREEN_Y);
+    atomic<bool> quit(false);
+
+    nes_tracer_level trace_level = nes_tracer::get().level();
+    thread emulation_thread([&]() {
+        // Tracer is per thread, and from here on everything the emulator traces happens on this thread
+        INIT_TRACE_LEVEL("neschan.emulation.log", trace_level);
+
+        // One frame per tick at the NTSC frame rate - sleeps in between instead of spinning on the clock
+        nes_frame_pacer pacer;
+        vector<int16_t> samples;
+
+        // Frames follow the host clock, so audio gets stretched slightly to match the audio device instead
+        int sample_rate = (audio_device != 0) ? audio_have.freq : AUDIO_SAMPLE_RATE;
+        nes_audio_rate_control rate_control(AUDIO_LATENCY_FRAMES * sample_rate / pacer.frame_rate());
+
+        while (!quit)
+        {
+            pacer.wait_frame();
+
+            // PPU writes final pixels straight into the back frame as it completes each scanline
+            system.ppu()->set_output(frames.back(), frame_pitch, nes_pixel_format_argb8888);
+
+            if (recorder)
+                recorder->run_frame();
+            else
+                system.run_frame();
+
+            frames.publish(system.ppu()->frame_count());
+
+            if (audio_device != 0)
+            {
+                samples.resize(system.apu()->samples_available());
+                int count = system.apu()->read_samples(samples.data(), int(samples.size()));
+                audio_ring.write(samples.data(), count);
+
+                system.apu()->set_rate_adjust(rate_control.update(audio_ring.fill_level()));
+            }
+        }
+
+        system.ppu()->set_output(nullptr, 0, nes_pixel_format_argb8888);
+    });
+
+    if (audio_device != 0)
+        SDL_PauseAudioDevice(audio_device, 0);
+
+    //
+    // Game main loop - events and rendering
+    //
+    SDL_Event sdl_event;
     while (!quit)
     {
         while (SDL_PollEvent(&sdl_event) != 0)
@@ -243,52 +365,44 @@ int main(int argc, char *argv[])
             }
         }
 
-        // 
-        // Calculate delta tick as the current frame
-        // We ask the NES to step corresponding CPU cycles
-        //
-        Uint64 cur_counter = SDL_GetPerformanceCounter();
-
-        Uint64 delta_ticks = cur_counter - prev_counter;
-        prev_counter = cur_counter;
-        if (delta_ticks == 0)
-            delta_ticks = 1;
-        auto cpu_cycles = ms_to_nes_cycle((double)delta_ticks * 1000 / count_per_second);
-
-        // Avoids a scenario where the loop keeps getting longer
-        if (cpu_cycles > nes_cycle_t(NES_CLOCK_HZ))
-            cpu_cycles = nes_cycle_t(NES_CLOCK_HZ);
+        // SDL_PollEvent has just updated keyboard / joystick state
+        for (size_t i = 0; i < sdl_devices.size(); ++i)
+            input_relays[i]->set_status(sdl_devices[i]->poll_status());
 
-        for (nes_cycle_t i = nes_cycle_t(0); i < cpu_cycles; ++i)
-            system.step(nes_cycle_t(1));
-
-        //
-        // Copy frame buffer to our texture
-        // @TODO - Handle this buffer directly to PPU
-        //
-        uint32_t *cur_pixel = pixels.data();
-        uint8_t *frame_buffer = system.ppu()->frame_buffer();
-        for (int y = 0; y < PPU_SCREEN_Y; ++y)
+        if (!frames.acquire())
         {
-            for (int x = 0; x < PPU_SCREEN_X; ++x)
-            {
-                *cur_pixel = palette[(*frame_buffer & 0xff)];
-                frame_buffer++;
-                cur_pixel++;
-            }
+            SDL_Delay(1);
+            continue;
         }
 
         //
         // Render
         //
-        SDL_UpdateTexture(sdl_texture, NULL, pixels.data(), PPU_SCREEN_X * sizeof(uint32_t));
+        SDL_UpdateTexture(sdl_texture, NULL, frames.front(), frame_pitch);
         SDL_RenderClear(sdl_renderer);
         SDL_RenderCopy(sdl_renderer, sdl_texture, NULL, NULL);
         SDL_RenderPresent(sdl_renderer);
     }
 
+    emulation_thread.join();
+
+    if (audio_device != 0)
+    {
+        SDL_CloseAudioDevice(audio_device);
+        NES_LOG("[NESCHAN] Audio underrun " << audio_ring.underrun_count() << " samples, overflow " << audio_ring.overflow_count() << " samples, final rate " << system.apu()->rate_adjust());
+    }
+
+    if (recorder)
+    {
+        recorder = nullptr;
+        if (!movie.save(movie_path))
+            NES_LOG("[NESCHAN] Failed to save movie '" << movie_path << "'");
+    }
+
     // Unregister all inputs and free the game controllers
     system.input()->unregister_all_inputs();
+    input_relays.clear();
+    sdl_devices.clear();
 
     SDL_DestroyRenderer(sdl_renderer);
     SDL_DestroyTexture(sdl_texture);
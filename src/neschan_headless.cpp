@@ -0,0 +1,366 @@
+// neschan_headless.cpp : Runs a ROM without any UI (no SDL) - for automation, CI and performance work
+//
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <nes_cycle.h>
+#include <nes_component.h>
+#include <nes_state.h>
+#include <nes_system.h>
+#include <nes_memory.h>
+#include <nes_mapper.h>
+#include <nes_ppu.h>
+#include <nes_cpu.h>
+#include <nes_input.h>
+#include <nes_apu.h>
+#include <nes_movie.h>
+#include <nes_trace.h>
+#include <nes_trace_ring.h>
+#include <nes_frame_pacer.h>
+
+using namespace std;
+
+#define AUDIO_SAMPLE_RATE 44100
+
+static void usage()
+{
+    cerr << "Usage: neschan_headless <rom_file_path> [options]" << endl;
+    cerr << "  -frames <n>               run n frames (default 600, or the entire movie)" << endl;
+    cerr << "  -until <addr>=<val>       stop when the byte at CPU address (hex) equals val (hex)" << endl;
+    cerr << "  -until-loop               stop when the ROM enters an infinite loop" << endl;
+    cerr << "  -movie <file>             play back input from a movie, verifying each frame" << endl;
+    cerr << "  -no-verify                don't verify movie hashes" << endl;
+    cerr << "  -no-idle-skip             interpret idle loops instead of fast forwarding them" << endl;
+    cerr << "  -logic-only               don't render pixels except for the last frame" << endl;
+    cerr << "  -dump-frames <dir>        write every frame as <dir>/frame_<n>.ppm" << endl;
+    cerr << "  -screenshot <file>        write the last frame as a .ppm" << endl;
+    cerr << "  -audio <file>             write audio as a 16-bit mono .wav" << endl;
+    cerr << "  -trace <file>             write trace log to file (default neschan_headless.log)" << endl;
+    cerr << "  -trace-ring <file>        stream every instruction, interrupt and I/O access to file" << endl;
+}
+
+// 16-bit mono PCM - called again at the end to patch the sizes
+static void write_wav_header(FILE *file, uint32_t data_size)
+{
+    uint32_t byte_rate = AUDIO_SAMPLE_RATE * sizeof(int16_t);
+    uint32_t riff_size = 36 + data_size;
+    uint32_t fmt_size = 16;
+    uint16_t format = 1;
+    uint16_t channels = 1;
+    uint32_t sample_rate = AUDIO_SAMPLE_RATE;
+    uint16_t block_align = sizeof(int16_t);
+    uint16_t bits = 16;
+
+    fwrite("RIFF", 4, 1, file);
+    fwrite(&riff_size, 4, 1, file);
+    fwrite("WAVEfmt ", 8, 1, file);
+    fwrite(&fmt_size, 4, 1, file);
+    fwrite(&format, 2, 1, file);
+    fwrite(&channels, 2, 1, file);
+    fwrite(&sample_rate, 4, 1, file);
+    fwrite(&byte_rate, 4, 1, file);
+    fwrite(&block_align, 2, 1, file);
+    fwrite(&bits, 2, 1, file);
+    fwrite("data", 4, 1, file);
+    fwrite(&data_size, 4, 1, file);
+}
+
+static bool write_ppm(const char *path, const uint32_t *pixels)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    fprintf(file, "P6\n%d %d\n255\n", PPU_SCREEN_X, PPU_SCREEN_Y);
+
+    uint8_t line[PPU_SCREEN_X * 3];
+    for (int y = 0; y < PPU_SCREEN_Y; ++y)
+    {
+        for (int x = 0; x < PPU_SCREEN_X; ++x)
+        {
+            uint32_t pixel = pixels[y * PPU_SCREEN_X + x];
+            line[x * 3] = uint8_t(pixel >> 16);
+            line[x * 3 + 1] = uint8_t(pixel >> 8);
+            line[x * 3 + 2] = uint8_t(pixel);
+        }
+        fwrite(line, sizeof(line), 1, file);
+    }
+
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        usage();
+        return -1;
+    }
+
+    const char *rom_path = argv[1];
+    int64_t frame_limit = -1;
+    bool until_byte = false;
+    uint16_t until_addr = 0;
+    uint8_t until_val = 0;
+    bool until_loop = false;
+    const char *movie_path = nullptr;
+    bool verify = true;
+    bool idle_skip = true;
+    bool logic_only = false;
+    const char *dump_frames_dir = nullptr;
+    const char *screenshot_path = nullptr;
+    const char *audio_path = nullptr;
+    const char *trace_path = "neschan_headless.log";
+    const char *trace_ring_path = nullptr;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        bool has_value = (i + 1 < argc);
+        if (!strcmp(argv[i], "-frames") && has_value)
+        {
+            frame_limit = atoll(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-until") && has_value)
+        {
+            unsigned int addr, val;
+            if (sscanf(argv[++i], "%x=%x", &addr, &val) != 2)
+            {
+                usage();
+                return -1;
+            }
+            until_byte = true;
+            until_addr = uint16_t(addr);
+            until_val = uint8_t(val);
+        }
+        else if (!strcmp(argv[i], "-until-loop"))
+        {
+            until_loop = true;
+        }
+        else if (!strcmp(argv[i], "-movie") && has_value)
+        {
+            movie_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-no-verify"))
+        {
+            verify = false;
+        }
+        else if (!strcmp(argv[i], "-no-idle-skip"))
+        {
+            idle_skip = false;
+        }
+        else if (!strcmp(argv[i], "-logic-only"))
+        {
+            logic_only = true;
+        }
+        else if (!strcmp(argv[i], "-dump-frames") && has_value)
+        {
+            dump_frames_dir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-screenshot") && has_value)
+        {
+            screenshot_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-audio") && has_value)
+        {
+            audio_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-trace") && has_value)
+        {
+            trace_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-trace-ring") && has_value)
+        {
+            trace_ring_path = argv[++i];
+        }
+        else
+        {
+            usage();
+            return -1;
+        }
+    }
+
+    INIT_TRACE(trace_path);
+
+    nes_system system;
+    system.power_on();
+    if (until_loop)
+        system.cpu()->stop_at_infinite_loop();
+    system.cpu()->set_idle_loop_skip(idle_skip);
+
+    try
+    {
+        system.load_rom(rom_path, nes_rom_exec_mode_reset);
+    }
+    catch (std::exception &ex)
+    {
+        cerr << "Failed to load ROM '" << rom_path << "': " << ex.what() << endl;
+        return -1;
+    }
+
+    nes_movie movie;
+    unique_ptr<nes_movie_player> player;
+    if (movie_path)
+    {
+        if (!movie.load(movie_path))
+        {
+            cerr << "Failed to load movie '" << movie_path << "'" << endl;
+            return -1;
+        }
+
+        if (!movie.is_rom_loaded(system))
+        {
+            cerr << "Movie '" << movie_path << "' isn't recorded with '" << rom_path << "'" << endl;
+            return -1;
+        }
+
+        player = make_unique<nes_movie_player>(system, movie);
+        if (frame_limit < 0)
+            frame_limit = movie.frame_count();
+    }
+
+    if (frame_limit < 0)
+        frame_limit = 600;
+
+    // Movie hashes cover the frame buffer, and dumped frames need pixels
+    if (logic_only && ((movie_path && verify) || dump_frames_dir))
+    {
+        cerr << "-logic-only can't be used with -dump-frames, or -movie without -no-verify" << endl;
+        return -1;
+    }
+
+    if (trace_ring_path)
+    {
+        system.enable_trace_ring(0x10000);
+        if (!system.trace_ring())
+        {
+            cerr << "Tracing is compiled out - rebuild with NESCHAN_TRACE_MAX_LEVEL 4 or above" << endl;
+            return -1;
+        }
+
+        if (!system.trace_ring()->start_streaming(trace_ring_path))
+        {
+            cerr << "Failed to write '" << trace_ring_path << "'" << endl;
+            return -1;
+        }
+    }
+
+    // Only resolve final pixels when somebody is going to look at them
+    vector<uint32_t> pixels;
+    if (dump_frames_dir || screenshot_path)
+    {
+        pixels.resize(PPU_SCREEN_X * PPU_SCREEN_Y);
+        system.ppu()->set_output(pixels.data(), PPU_SCREEN_X * sizeof(uint32_t), nes_pixel_format_argb8888);
+    }
+
+    FILE *audio_file = nullptr;
+    vector<int16_t> samples;
+    uint32_t audio_size = 0;
+    if (audio_path)
+    {
+        audio_file = fopen(audio_path, "wb");
+        if (!audio_file)
+        {
+            cerr << "Failed to write '" << audio_path << "'" << endl;
+            return -1;
+        }
+
+        write_wav_header(audio_file, 0);
+        system.apu()->set_sample_rate(AUDIO_SAMPLE_RATE);
+    }
+
+    int result = 0;
+    int64_t frame_count = 0;
+    auto start_cycle = system.cpu()->cycle();
+    auto start_idle_cycle = system.cpu()->idle_cycles();
+    auto start = chrono::steady_clock::now();
+
+    while (frame_count < frame_limit)
+    {
+        if (logic_only)
+            system.ppu()->set_logic_only(frame_count < frame_limit - 1);
+
+        if (player)
+        {
+            if (player->is_done())
+                break;
+
+            if (!player->run_frame(verify))
+            {
+                cerr << "Frame " << player->frame_id() - 1 << " doesn't match the movie" << endl;
+                result = 1;
+                frame_count++;
+                break;
+            }
+        }
+        else
+        {
+            if (system.run_frame() & nes_system_event_stop)
+                break;
+        }
+
+        frame_count++;
+
+        if (audio_file)
+        {
+            samples.resize(system.apu()->samples_available());
+            int count = system.apu()->read_samples(samples.data(), int(samples.size()));
+            fwrite(samples.data(), sizeof(int16_t), count, audio_file);
+            audio_size += uint32_t(count * sizeof(int16_t));
+        }
+
+        if (dump_frames_dir)
+        {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/frame_%06lld.ppm", dump_frames_dir, (long long)frame_count);
+            if (!write_ppm(path, pixels.data()))
+            {
+                cerr << "Failed to write '" << path << "'" << endl;
+                return -1;
+            }
+        }
+
+        if (until_byte && system.ram()->get_byte(until_addr) == until_val)
+            break;
+    }
+
+    auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    auto cpu_cycles = duration_cast<nes_cpu_cycle_t>(system.cpu()->cycle() - start_cycle).count();
+    auto idle_cycles = duration_cast<nes_cpu_cycle_t>(system.cpu()->idle_cycles() - start_idle_cycle).count();
+
+    system.ppu()->set_output(nullptr, 0, nes_pixel_format_argb8888);
+
+    if (system.trace_ring())
+        system.trace_ring()->stop_streaming();
+
+    if (audio_file)
+    {
+        fseek(audio_file, 0, SEEK_SET);
+        write_wav_header(audio_file, audio_size);
+        fclose(audio_file);
+    }
+
+    if (screenshot_path && !write_ppm(screenshot_path, pixels.data()))
+    {
+        cerr << "Failed to write '" << screenshot_path << "'" << endl;
+        return -1;
+    }
+
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+    double fps = frame_count / elapsed;
+    printf("frames      : %lld\n", (long long)frame_count);
+    printf("time        : %.3f s\n", elapsed);
+    printf("frames/s    : %.1f (%.1fx real time)\n", fps, fps / NES_NTSC_FRAME_RATE);
+    printf("CPU         : %.2f MHz effective\n", cpu_cycles / elapsed / 1000000);
+    printf("idle        : %.1f%% of cycles skipped\n", cpu_cycles ? 100.0 * idle_cycles / cpu_cycles : 0.0);
+    printf("PC          : 0x%04x\n", system.cpu()->PC());
+
+    return result;
+}
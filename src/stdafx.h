@@ -27,6 +27,12 @@
 #include <nes_ppu.h>
 #include <nes_cpu.h>
 #include <nes_input.h>
+#include <nes_apu.h>
+#include <nes_movie.h>
+#include <nes_triple_buffer.h>
+#include <nes_frame_pacer.h>
+#include <nes_audio_ring.h>
+#include <nes_audio_rate_control.h>
 #include <nes_trace.h>
 
 #include "SDL.h"
@@ -0,0 +1,331 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_mapper.h"
+#include "nes_system.h"
+#include "nes_apu.h"
+#include "nes_audio_ring.h"
+#include "nes_audio_rate_control.h"
+#include "nes_frame_pacer.h"
+
+using namespace std;
+
+TEST_CASE("apu_tests") {
+    nes_system system;
+
+    // color_test keeps interrupt flag set and loops forever after a couple of frames, so APU registers can
+    // be poked in between frames without the ROM getting in the way
+    system.power_on();
+    system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+    system.run_frame();
+
+    auto cpu = system.cpu();
+    auto apu = system.apu();
+
+    SUBCASE("status") {
+        INIT_TRACE("neschan.apu.status.log");
+        cout << "Running [APU][status]..." << endl;
+
+        CHECK(cpu->peek(0x4015) == 0);
+
+        // Pulse 1 with a length of 2 half frames
+        cpu->poke(0x4015, 0x0f);
+        cpu->poke(0x4000, 0x1f);
+        cpu->poke(0x4002, 0xfd);
+        cpu->poke(0x4003, 0x18);
+        CHECK(cpu->peek(0x4015) == 0x01);
+        system.run_frame();
+        system.run_frame();
+        CHECK(cpu->peek(0x4015) == 0);
+
+        // Length counter can't be loaded while disabled
+        cpu->poke(0x4015, 0x00);
+        cpu->poke(0x400b, 0x08);
+        CHECK(cpu->peek(0x4015) == 0);
+
+        // Triangle with halt set keeps playing
+        cpu->poke(0x4015, 0x04);
+        cpu->poke(0x4008, 0xff);
+        cpu->poke(0x400b, 0x08);
+        system.run_frame();
+        system.run_frame();
+        CHECK(cpu->peek(0x4015) == 0x04);
+
+        // DMC plays 17 bytes - about 7000 cycles at the fastest rate - and then raises IRQ
+        cpu->poke(0x4010, 0x8f);
+        cpu->poke(0x4012, 0x00);
+        cpu->poke(0x4013, 0x01);
+        cpu->poke(0x4015, 0x14);
+        CHECK(cpu->peek(0x4015) == 0x14);
+        system.run_frame();
+        CHECK(cpu->peek(0x4015) == 0x84);
+        cpu->poke(0x4015, 0x04);
+        CHECK(cpu->peek(0x4015) == 0x04);
+    }
+    SUBCASE("frame_irq") {
+        INIT_TRACE("neschan.apu.frame_irq.log");
+        cout << "Running [APU][frame_irq]..." << endl;
+
+        // Inhibited at power on
+        system.run_frame();
+        CHECK(cpu->peek(0x4015) == 0);
+
+        // 4-step mode sets the flag once per sequence, and reading clears it
+        cpu->poke(0x4017, 0x00);
+        system.run_frame();
+        system.run_frame();
+        CHECK(cpu->peek(0x4015) == 0x40);
+        CHECK(cpu->peek(0x4015) == 0);
+
+        // 5-step mode never does
+        cpu->poke(0x4017, 0x80);
+        system.run_frame();
+        system.run_frame();
+        CHECK(cpu->peek(0x4015) == 0);
+
+        // Taken as soon as interrupt flag is cleared - including out of an idle loop
+        auto other = system.fork();
+        other->cpu()->set_idle_loop_skip(false);
+
+        uint16_t irq_handler = cpu->peek_word(IRQ_HANDLER);
+        for (auto sys : { &system, other.get() })
+        {
+            sys->cpu()->poke(0x4017, 0x00);
+            sys->cpu()->P() &= ~PROCESSOR_STATUS_INTERRUPT_MASK;
+        }
+        for (int i = 0; i < 3; ++i)
+        {
+            system.run_frame();
+            other->run_frame();
+            CHECK(cpu->cycle() == other->cpu()->cycle());
+            CHECK(cpu->PC() == other->cpu()->PC());
+            CHECK(cpu->S() == other->cpu()->S());
+        }
+        CHECK(cpu->idle_cycles() > nes_cycle_t(0));
+
+        nes_system stop;
+        stop.power_on();
+        stop.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i < 3; ++i)
+            stop.run_frame();
+        stop.cpu()->poke(0x4017, 0x00);
+        stop.cpu()->P() &= ~PROCESSOR_STATUS_INTERRUPT_MASK;
+        stop.cpu()->stop_at_addr(irq_handler);
+
+        // The 4-step sequence is a bit longer than a frame
+        nes_system_event events = nes_system_event_none;
+        for (int i = 0; i < 2 && !(events & nes_system_event_stop); ++i)
+            events = stop.run_frame();
+        // The handler is a lone RTI that doesn't acknowledge anything
+        CHECK((events & nes_system_event_stop) != 0);
+        CHECK(stop.cpu()->peek(0x4015) == 0x40);
+    }
+    SUBCASE("samples") {
+        INIT_TRACE("neschan.apu.samples.log");
+        cout << "Running [APU][samples]..." << endl;
+
+        // Nothing is produced until asked for
+        system.run_frame();
+        CHECK(apu->samples_available() == 0);
+
+        apu->set_sample_rate(44100);
+        cpu->poke(0x4015, 0x01);
+        cpu->poke(0x4000, 0xbf);                // 50% duty, constant volume 15, halt
+        cpu->poke(0x4002, 0xfd);                // ~440Hz
+        cpu->poke(0x4003, 0x00);
+
+        vector<int16_t> samples;
+        auto read_frames = [&](int count) {
+            samples.clear();
+            for (int i = 0; i < count; ++i)
+            {
+                system.run_frame();
+                size_t offset = samples.size();
+                samples.resize(offset + apu->samples_available());
+                CHECK(apu->read_samples(samples.data() + offset, int(samples.size() - offset)) == int(samples.size() - offset));
+            }
+        };
+
+        // One batch of ~735 samples per frame
+        read_frames(10);
+        CHECK(samples.size() > 7300);
+        CHECK(samples.size() < 7400);
+        auto range = minmax_element(samples.begin(), samples.end());
+        CHECK(*range.second - *range.first > 2000);
+
+        // Silence settles down to nothing
+        cpu->poke(0x4015, 0x00);
+        read_frames(30);
+        range = minmax_element(samples.end() - 100, samples.end());
+        CHECK(*range.second - *range.first < 16);
+
+        // Savestates include the APU - playing from the same state produces exactly the same samples
+        cpu->poke(0x4015, 0x0f);
+        cpu->poke(0x4008, 0xff);
+        cpu->poke(0x400a, 0x80);
+        cpu->poke(0x400b, 0x00);
+        cpu->poke(0x400c, 0x3f);
+        cpu->poke(0x400e, 0x04);
+        cpu->poke(0x400f, 0x00);
+        vector<uint8_t> state;
+        system.save_state(state);
+        apu->set_sample_rate(44100);
+        read_frames(10);
+        vector<int16_t> expected = samples;
+
+        CHECK(system.load_state(state));
+        apu->set_sample_rate(44100);
+        read_frames(10);
+        CHECK(samples == expected);
+    }
+    SUBCASE("audio_ring") {
+        INIT_TRACE("neschan.apu.audio_ring.log");
+        cout << "Running [APU][audio_ring]..." << endl;
+
+        // Rounded up to a power of two
+        nes_audio_ring ring(1000);
+        CHECK(ring.capacity() == 1024);
+        CHECK(ring.fill_level() == 0);
+
+        int16_t in[1500];
+        int16_t out[1500];
+        for (int i = 0; i < 1500; ++i)
+            in[i] = int16_t(i + 1);
+
+        // Running dry pads with silence
+        CHECK(ring.write(in, 100) == 100);
+        CHECK(ring.fill_level() == 100);
+        CHECK(ring.read(out, 150) == 100);
+        CHECK(out[99] == 100);
+        CHECK(out[100] == 0);
+        CHECK(out[149] == 0);
+        CHECK(ring.underrun_count() == 50);
+
+        // Wraps around the end of the buffer, and drops what doesn't fit
+        CHECK(ring.write(in, 1500) == 1024);
+        CHECK(ring.overflow_count() == 476);
+        CHECK(ring.fill_level() == 1024);
+        CHECK(ring.read(out, 1024) == 1024);
+        CHECK(equal(out, out + 1024, in));
+        CHECK(ring.fill_level() == 0);
+
+        // Consumer on another thread sees every sample in order, with nothing dropped as long as it keeps up
+        const int sample_count = 200000;
+        thread producer([&]() {
+            int16_t chunk[256];
+            int next = 0;
+            while (next < sample_count)
+            {
+                int count = min(int(ring.capacity() - ring.fill_level()), min(256, sample_count - next));
+                for (int i = 0; i < count; ++i)
+                    chunk[i] = int16_t(next + i);
+                ring.write(chunk, count);
+                next += count;
+                if (count == 0)
+                    this_thread::yield();
+            }
+        });
+
+        int received = 0;
+        int out_of_order = 0;
+        while (received < sample_count)
+        {
+            size_t count = ring.fill_level();
+            if (count == 0)
+            {
+                this_thread::yield();
+                continue;
+            }
+
+            count = min(count, size_t(1500));
+            CHECK(ring.read(out, count) == count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (out[i] != int16_t(received + i))
+                    out_of_order++;
+            }
+            received += int(count);
+        }
+        producer.join();
+
+        CHECK(out_of_order == 0);
+        CHECK(ring.overflow_count() == 476);
+        CHECK(ring.underrun_count() == 50);
+    }
+    SUBCASE("rate_control") {
+        INIT_TRACE("neschan.apu.rate_control.log");
+        cout << "Running [APU][rate_control]..." << endl;
+
+        // Faster below target, slower above, clamped either way
+        nes_audio_rate_control control(1000);
+        CHECK(control.update(1000) == 1.0);
+        control.reset();
+        CHECK(control.update(500) == doctest::Approx(1.0025));
+        control.reset();
+        CHECK(control.update(0) == doctest::Approx(1 + NES_AUDIO_MAX_RATE_ADJUST));
+        control.reset();
+        CHECK(control.update(5000) == doctest::Approx(1 - NES_AUDIO_MAX_RATE_ADJUST));
+
+        // Nudging the rate changes how many samples come out of a frame
+        apu->set_sample_rate(44100);
+        vector<int16_t> samples(2048);
+        auto frame_samples = [&](int frames) {
+            int count = 0;
+            for (int i = 0; i < frames; ++i)
+            {
+                system.run_frame();
+                count += apu->read_samples(samples.data(), int(samples.size()));
+            }
+            return count;
+        };
+        frame_samples(1);
+        int normal_count = frame_samples(100);
+        apu->set_rate_adjust(1.005);
+        int fast_count = frame_samples(100);
+        CHECK(fast_count - normal_count > 300);
+        CHECK(fast_count - normal_count < 440);
+        apu->set_rate_adjust(1.0);
+
+        // An audio device that plays 0.2% faster than emulation produces drains the buffer by ~1.5 samples a
+        // frame - rate control has to hold the level near the target (a bit below, being proportional only)
+        // where a fixed rate runs dry
+        double target = 2 * 44100 / NES_NTSC_FRAME_RATE;
+        auto play = [&](bool rate_control_enabled) {
+            nes_audio_ring ring(4096);
+            nes_audio_rate_control rate_control(target);
+            double device_samples_per_frame = 44100 * 1.002 / NES_NTSC_FRAME_RATE;
+            double device_due = 0;
+            int16_t device_buf[4096];
+            apu->set_rate_adjust(1.0);
+            for (int i = 0; i < 1500; ++i)
+            {
+                system.run_frame();
+                int count = apu->read_samples(samples.data(), int(samples.size()));
+                ring.write(samples.data(), count);
+                double ratio = rate_control.update(ring.fill_level());
+                if (rate_control_enabled)
+                    apu->set_rate_adjust(ratio);
+
+                // Device starts playing once a couple of frames are buffered
+                if (i >= 2)
+                {
+                    device_due += device_samples_per_frame;
+                    ring.read(device_buf, size_t(device_due));
+                    device_due -= size_t(device_due);
+                }
+            }
+
+            CHECK(ring.overflow_count() == 0);
+            return make_pair(ring.underrun_count(), rate_control.average_level());
+        };
+
+        CHECK(play(false).first > 0);
+
+        auto result = play(true);
+        CHECK(result.first == 0);
+        CHECK(result.second > target * 0.5);
+        CHECK(result.second < target * 1.1);
+        CHECK(apu->rate_adjust() > 1.0);
+    }
+}
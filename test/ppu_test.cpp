@@ -18,9 +18,9 @@ TEST_CASE("ppu_tests") {
 
         // The test infinite loops and does rendering in NMI
         // Wait for 10 frames so that it can finish rendering - and we can use the VRAM value to validate
-        system.ppu()->stop_after_frame(10);
-
-        system.run_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i <= 10; ++i)
+            system.run_frame();
 
         auto cpu = system.cpu();
         auto ppu = system.ppu();
@@ -32,15 +32,40 @@ TEST_CASE("ppu_tests") {
         CHECK(ppu->read_byte(0x3f03) == 0x30);
         CHECK(ppu->read_byte(0x3f13) == 0x30);
     }
+    SUBCASE("output_surface") {
+        INIT_TRACE("neschan.ppu.output_surface.log");
+        cout << "Running [PPU][output_surface]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        // Pixels written into the surface should match the completed frame buffer
+        auto ppu = system.ppu();
+        vector<uint32_t> pixels(PPU_SCREEN_X * PPU_SCREEN_Y);
+        ppu->set_output(pixels.data(), PPU_SCREEN_X * sizeof(uint32_t), nes_pixel_format_argb8888);
+        for (int i = 0; i <= 10; ++i)
+            system.run_frame();
+        ppu->set_output(nullptr, 0, nes_pixel_format_argb8888);
+
+        uint8_t *frame_buffer = ppu->frame_buffer();
+        int mismatch = 0;
+        for (int i = 0; i < PPU_SCREEN_X * PPU_SCREEN_Y; ++i)
+        {
+            if (pixels[i] != (0xff000000 | nes_ppu::s_default_palette[frame_buffer[i] & 0x3f]))
+                mismatch++;
+        }
+        CHECK(mismatch == 0);
+        CHECK(pixels[PPU_SCREEN_X * PPU_SCREEN_Y / 2] != 0);
+    }
     SUBCASE("vbl_clear_time") {
         INIT_TRACE("neschan.ppu.vbl_clear_time.log");
         cout << "Running [PPU][vbl_clear_time]..." << endl;
 
         system.power_on();
 
-        system.ppu()->stop_after_frame(10);
-
-        system.run_rom("./roms/blargg_ppu_tests/vbl_clear_time.nes", nes_rom_exec_mode_reset);
+        system.load_rom("./roms/blargg_ppu_tests/vbl_clear_time.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i <= 10; ++i)
+            system.run_frame();
 
         auto cpu = system.cpu();
 
@@ -52,9 +77,9 @@ TEST_CASE("ppu_tests") {
 
         system.power_on();
 
-        system.ppu()->stop_after_frame(10);
-
-        system.run_rom("./roms/blargg_ppu_tests/sprite_ram.nes", nes_rom_exec_mode_reset);
+        system.load_rom("./roms/blargg_ppu_tests/sprite_ram.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i <= 10; ++i)
+            system.run_frame();
 
         auto cpu = system.cpu();
 
@@ -66,9 +91,9 @@ TEST_CASE("ppu_tests") {
 
         system.power_on(); 
 
-        system.ppu()->stop_after_frame(10);
-
-        system.run_rom("./roms/blargg_ppu_tests/vram_access.nes", nes_rom_exec_mode_reset);
+        system.load_rom("./roms/blargg_ppu_tests/vram_access.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i <= 10; ++i)
+            system.run_frame();
 
         auto cpu = system.cpu();
 
@@ -80,9 +105,9 @@ TEST_CASE("ppu_tests") {
 
         system.power_on();
 
-        system.ppu()->stop_after_frame(10);
-
-        system.run_rom("./roms/blargg_ppu_tests/palette_ram.nes", nes_rom_exec_mode_reset);
+        system.load_rom("./roms/blargg_ppu_tests/palette_ram.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i <= 10; ++i)
+            system.run_frame();
 
         auto cpu = system.cpu();
 
@@ -14,6 +14,8 @@
 #include <fstream>
 #include <string>
 #include <iostream>
+#include <thread>
+#include <algorithm>
 
 //
 // NESchan headers
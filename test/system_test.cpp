@@ -0,0 +1,714 @@
+#include "stdafx.h"
+
+#include "doctest.h"
+#include "nes_trace.h"
+#include "nes_mapper.h"
+#include "nes_system.h"
+#include "nes_rewind.h"
+#include "nes_movie.h"
+#include "nes_batch.h"
+#include "nes_trace_ring.h"
+#include "nes_triple_buffer.h"
+#include "nes_frame_pacer.h"
+
+using namespace std;
+
+// Deterministic "random" button presses that change every few polls
+class test_input_device : public nes_input_device
+{
+public :
+    test_input_device() : _seed(1), _poll_count(0) {}
+
+    virtual nes_button_flags poll_status()
+    {
+        _poll_count++;
+        if (_poll_count % 7 == 0)
+            _seed = _seed * 1103515245 + 12345;
+        return nes_button_flags((_seed >> 16) & 0xff);
+    }
+
+    int poll_count() { return _poll_count; }
+
+private :
+    uint32_t _seed;
+    int _poll_count;
+};
+
+TEST_CASE("system_tests") {
+    nes_system system;
+
+    SUBCASE("run_frame") {
+        INIT_TRACE("neschan.system.run_frame.log");
+        cout << "Running [SYSTEM][run_frame]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        auto ppu = system.ppu();
+        for (uint32_t i = 1; i <= 3; ++i)
+        {
+            CHECK(system.run_frame() == nes_system_event_frame);
+            CHECK(ppu->frame_count() == i);
+            CHECK(ppu->cur_scanline() == 0);
+            CHECK(ppu->scanline_cycle() == nes_ppu_cycle_t(0));
+        }
+    }
+    SUBCASE("run_until_vblank") {
+        INIT_TRACE("neschan.system.run_until_vblank.log");
+        cout << "Running [SYSTEM][run_until_vblank]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        auto ppu = system.ppu();
+        CHECK(system.run_until(nes_system_event_vblank | nes_system_event_frame) == nes_system_event_vblank);
+        CHECK(ppu->cur_scanline() == 241);
+        CHECK(ppu->scanline_cycle() == nes_ppu_cycle_t(1));
+
+        CHECK(system.run_until(nes_system_event_vblank | nes_system_event_frame) == nes_system_event_frame);
+        CHECK(ppu->frame_count() == 1);
+    }
+    SUBCASE("run_scanlines") {
+        INIT_TRACE("neschan.system.run_scanlines.log");
+        cout << "Running [SYSTEM][run_scanlines]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        auto ppu = system.ppu();
+        system.run_scanlines(10);
+        CHECK(ppu->cur_scanline() == 10);
+        CHECK(ppu->scanline_cycle() == nes_ppu_cycle_t(0));
+
+        system.run_scanlines(PPU_SCANLINE_COUNT);
+        CHECK(ppu->frame_count() == 1);
+        CHECK(ppu->cur_scanline() == 10);
+    }
+    SUBCASE("deterministic") {
+        INIT_TRACE("neschan.system.deterministic.log");
+        cout << "Running [SYSTEM][deterministic]..." << endl;
+
+        // Stopping at scanlines or frames should be exactly the same as running straight through
+        nes_system other;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i < 3; ++i)
+            system.run_frame();
+
+        other.power_on();
+        other.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        other.run_scanlines(PPU_SCANLINE_COUNT * 3);
+
+        CHECK(system.ppu()->frame_count() == other.ppu()->frame_count());
+        CHECK(system.ppu()->cycle() == other.ppu()->cycle());
+        CHECK(system.cpu()->cycle() == other.cpu()->cycle());
+        CHECK(system.cpu()->PC() == other.cpu()->PC());
+        CHECK(memcmp(system.ppu()->frame_buffer(), other.ppu()->frame_buffer(), PPU_SCREEN_X * PPU_SCREEN_Y) == 0);
+    }
+    SUBCASE("idle_loop") {
+        INIT_TRACE("neschan.system.idle_loop.log");
+        cout << "Running [SYSTEM][idle_loop]..." << endl;
+
+        // Fast forwarding idle loops should end up exactly the same as interpreting them
+        nes_system other;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        other.power_on();
+        other.cpu()->set_idle_loop_skip(false);
+        other.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        for (int i = 0; i < 30; ++i)
+        {
+            system.run_frame();
+            other.run_frame();
+        }
+        for (int i = 0; i < PPU_SCANLINE_COUNT * 2; ++i)
+        {
+            system.run_scanlines(1);
+            other.run_scanlines(1);
+        }
+
+        CHECK(system.cpu()->idle_cycles() > nes_cycle_t(0));
+        CHECK(other.cpu()->idle_cycles() == nes_cycle_t(0));
+        CHECK(system.cpu()->cycle() == other.cpu()->cycle());
+        CHECK(system.cpu()->PC() == other.cpu()->PC());
+        CHECK(system.cpu()->A() == other.cpu()->A());
+        CHECK(system.ppu()->cycle() == other.ppu()->cycle());
+        CHECK(nes_movie::hash(system) == nes_movie::hash(other));
+    }
+    SUBCASE("logic_only") {
+        INIT_TRACE("neschan.system.logic_only.log");
+        cout << "Running [SYSTEM][logic_only]..." << endl;
+
+        // Skipping pixels shouldn't change anything the game sees, and the last frame is still rendered
+        nes_system other;
+
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        other.power_on();
+        other.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+
+        for (int i = 0; i < 6; ++i)
+        {
+            system.run_frames(10);
+            for (int j = 0; j < 10; ++j)
+                other.run_frame();
+
+            CHECK(system.cpu()->cycle() == other.cpu()->cycle());
+            CHECK(nes_movie::hash(system) == nes_movie::hash(other));
+        }
+        CHECK(!system.ppu()->is_logic_only());
+
+        // Same when CPU syncs PPU in the middle of visible scanlines - those are rendered cycle by cycle
+        // instead of a scanline at a time
+        auto run_frame_reading_status = [](nes_system &sys) {
+            auto ppu = sys.ppu();
+            uint32_t frame_count = ppu->frame_count();
+            while (ppu->frame_count() == frame_count)
+            {
+                sys.run_scanlines(1);
+                if (ppu->cur_scanline() < 240)
+                    sys.cpu()->peek(0x2002);
+            }
+        };
+
+        for (int i = 0; i < 3; ++i)
+        {
+            for (int j = 0; j < 10; ++j)
+            {
+                system.ppu()->set_logic_only(j < 9);
+                run_frame_reading_status(system);
+                run_frame_reading_status(other);
+            }
+
+            CHECK(system.cpu()->cycle() == other.cpu()->cycle());
+            CHECK(nes_movie::hash(system) == nes_movie::hash(other));
+        }
+    }
+    SUBCASE("mmc1_prg_bank") {
+        INIT_TRACE("neschan.system.mmc1_prg_bank.log");
+        cout << "Running [SYSTEM][mmc1_prg_bank]..." << endl;
+
+        // 4 x 16KB PRG banks, each filled with its own bank number
+        auto prg_rom = make_shared<vector<uint8_t>>(0x10000);
+        for (size_t i = 0; i < prg_rom->size(); ++i)
+            (*prg_rom)[i] = uint8_t(i / 0x4000);
+        auto chr_rom = make_shared<vector<uint8_t>>(0x2000);
+
+        system.power_on();
+        system.load_mapper(make_shared<nes_mapper_mmc1>(prg_rom, chr_rom, false), nes_rom_exec_mode_reset);
+
+        auto cpu = system.cpu();
+        auto write_serial = [&](uint16_t addr, uint8_t val) {
+            for (int i = 0; i < 5; ++i)
+                cpu->poke(addr, (val >> i) & 1);
+        };
+
+        // Power on - fix last bank at $C000
+        write_serial(0xe000, 0x01);
+        CHECK(cpu->peek(0x8000) == 1);
+        CHECK(cpu->peek(0xc000) == 3);
+
+        // Bank bits past the end of PRG ROM are ignored
+        write_serial(0xe000, 0x06);
+        CHECK(cpu->peek(0x8000) == 2);
+        CHECK(cpu->peek(0xc000) == 3);
+
+        // Fix first bank at $8000
+        write_serial(0x8000, 0x08);
+        write_serial(0xe000, 0x0d);
+        CHECK(cpu->peek(0x8000) == 0);
+        CHECK(cpu->peek(0xc000) == 1);
+
+        // 32KB mode ignores the low bit too
+        write_serial(0x8000, 0x00);
+        write_serial(0xe000, 0x0f);
+        CHECK(cpu->peek(0x8000) == 2);
+        CHECK(cpu->peek(0xc000) == 3);
+    }
+    SUBCASE("savestate") {
+        INIT_TRACE("neschan.system.savestate.log");
+        cout << "Running [SYSTEM][savestate]..." << endl;
+
+        // Loading a state into another instance should continue exactly like the original (MMC1 ROM)
+        const char *rom = "./roms/instr_test-v5/official_only.nes";
+        nes_system other;
+
+        system.power_on();
+        system.load_rom(rom, nes_rom_exec_mode_reset);
+        system.run_scanlines(PPU_SCANLINE_COUNT * 20 + 100);
+
+        vector<uint8_t> state;
+        system.save_state(state);
+        for (int i = 0; i < 10; ++i)
+            system.run_frame();
+
+        other.power_on();
+        other.load_rom(rom, nes_rom_exec_mode_reset);
+        CHECK(other.load_state(state));
+        for (int i = 0; i < 10; ++i)
+            other.run_frame();
+
+        CHECK(system.ppu()->frame_count() == other.ppu()->frame_count());
+        CHECK(system.ppu()->cycle() == other.ppu()->cycle());
+        CHECK(system.cpu()->cycle() == other.cpu()->cycle());
+        CHECK(system.cpu()->PC() == other.cpu()->PC());
+        CHECK(memcmp(system.ppu()->frame_buffer(), other.ppu()->frame_buffer(), PPU_SCREEN_X * PPU_SCREEN_Y) == 0);
+
+        // Saving again should produce the identical state
+        vector<uint8_t> state_1, state_2;
+        system.save_state(state_1);
+        other.save_state(state_2);
+        CHECK(state_1 == state_2);
+
+        // States from a different ROM are rejected
+        nes_system another;
+        another.power_on();
+        another.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        CHECK(!another.load_state(state));
+        state[0] ^= 0xff;
+        CHECK(!system.load_state(state));
+    }
+    SUBCASE("fork") {
+        INIT_TRACE("neschan.system.fork.log");
+        cout << "Running [SYSTEM][fork]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/instr_test-v5/official_only.nes", nes_rom_exec_mode_reset);
+        system.run_scanlines(PPU_SCANLINE_COUNT * 20 + 100);
+
+        // Child continues exactly like the parent
+        auto child = system.fork();
+        for (int i = 0; i < 10; ++i)
+        {
+            system.run_frame();
+            child->run_frame();
+        }
+
+        CHECK(system.ppu()->cycle() == child->ppu()->cycle());
+        CHECK(system.cpu()->cycle() == child->cpu()->cycle());
+        CHECK(system.cpu()->PC() == child->cpu()->PC());
+        CHECK(memcmp(system.ppu()->frame_buffer(), child->ppu()->frame_buffer(), PPU_SCREEN_X * PPU_SCREEN_Y) == 0);
+
+        vector<uint8_t> state_1, state_2;
+        system.save_state(state_1);
+        child->save_state(state_2);
+        CHECK(state_1 == state_2);
+
+        // Writes after fork are only seen by the side doing the write - including mirrors and PRG RAM
+        nes_system other;
+        system.fork_to(other);
+        uint8_t val = system.ram()->get_byte(0x0010);
+        uint8_t prg_ram_val = system.ram()->get_byte(0x6004);
+        system.ram()->set_byte(0x0810, val + 1);
+        other.ram()->set_byte(0x6004, prg_ram_val + 1);
+        CHECK(system.ram()->get_byte(0x1010) == uint8_t(val + 1));
+        CHECK(other.ram()->get_byte(0x0010) == val);
+        CHECK(other.ram()->get_byte(0x6004) == uint8_t(prg_ram_val + 1));
+        CHECK(system.ram()->get_byte(0x6004) == prg_ram_val);
+        CHECK(child->ram()->get_byte(0x0010) == val);
+
+        // Forking a fork
+        system.ram()->set_byte(0x0810, val);
+        auto grand_child = other.fork();
+        other.ram()->set_byte(0x6004, prg_ram_val);
+        CHECK(grand_child->ram()->get_byte(0x6004) == uint8_t(prg_ram_val + 1));
+        system.run_frame();
+        grand_child->ram()->set_byte(0x6004, prg_ram_val);
+        grand_child->run_frame();
+        system.save_state(state_1);
+        grand_child->save_state(state_2);
+        CHECK(state_1 == state_2);
+    }
+    SUBCASE("movie") {
+        INIT_TRACE("neschan.system.movie.log");
+        cout << "Running [SYSTEM][movie]..." << endl;
+
+        const char *rom = "./roms/color_test/color_test.nes";
+        system.power_on();
+        system.load_rom(rom, nes_rom_exec_mode_reset);
+
+        nes_movie movie;
+        auto device = make_shared<test_input_device>();
+        {
+            nes_movie_recorder recorder(system, movie);
+            recorder.register_input(0, device);
+            for (int i = 0; i < 120; ++i)
+                recorder.run_frame();
+        }
+        CHECK(device->poll_count() > 0);
+        CHECK(movie.frame_count() == 120);
+        CHECK(movie.save("neschan.system.movie.nesm"));
+
+        nes_movie loaded;
+        CHECK(loaded.load("neschan.system.movie.nesm"));
+        CHECK(loaded.frame_count() == 120);
+        CHECK(loaded.has_hash());
+
+        // Frame count that doesn't match the file is rejected before allocating anything for it
+        {
+            vector<char> data;
+            {
+                ifstream file("neschan.system.movie.nesm", std::ifstream::in | std::ifstream::binary);
+                data.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+            }
+
+            nes_movie_header header;
+            memcpy(&header, data.data(), sizeof(header));
+            header.frame_count = 0xffffffff;
+            memcpy(data.data(), &header, sizeof(header));
+            {
+                ofstream file("neschan.system.movie_corrupt.nesm", std::ofstream::out | std::ofstream::binary);
+                file.write(data.data(), data.size() / 2);
+            }
+
+            nes_movie corrupt;
+            CHECK(!corrupt.load("neschan.system.movie_corrupt.nesm"));
+            CHECK(corrupt.frame_count() == 0);
+
+            header.frame_count = 120;
+            memcpy(data.data(), &header, sizeof(header));
+            {
+                ofstream file("neschan.system.movie_corrupt.nesm", std::ofstream::out | std::ofstream::binary);
+                file.write(data.data(), data.size() - 1);
+            }
+            CHECK(!corrupt.load("neschan.system.movie_corrupt.nesm"));
+
+            remove("neschan.system.movie_corrupt.nesm");
+        }
+
+        // Playing back reproduces every frame
+        nes_system other;
+        other.power_on();
+        other.load_rom(rom, nes_rom_exec_mode_reset);
+        {
+            nes_movie_player player(other, loaded);
+            CHECK(player.play());
+            CHECK(player.is_done());
+        }
+        CHECK(memcmp(system.ppu()->frame_buffer(), other.ppu()->frame_buffer(), PPU_SCREEN_X * PPU_SCREEN_Y) == 0);
+
+        // Different input shows up as a mismatch
+        for (auto &frame : loaded.frames())
+            frame.buttons[0] = nes_button_flags(frame.buttons[0] ^ nes_button_flags_up);
+        other.power_on();
+        other.load_rom(rom, nes_rom_exec_mode_reset);
+        {
+            nes_movie_player player(other, loaded);
+            CHECK(!player.play());
+            CHECK(!player.is_done());
+        }
+    }
+    SUBCASE("batch") {
+        INIT_TRACE("neschan.system.batch.log");
+        cout << "Running [SYSTEM][batch]..." << endl;
+
+        const char *rom = "./roms/color_test/color_test.nes";
+        system.power_on();
+        system.load_rom(rom, nes_rom_exec_mode_reset);
+
+        nes_movie movie;
+        {
+            nes_movie_recorder recorder(system, movie);
+            recorder.register_input(0, make_shared<test_input_device>());
+            for (int i = 0; i < 60; ++i)
+                recorder.run_frame();
+        }
+        CHECK(movie.save("neschan.system.batch.nesm"));
+        uint64_t movie_hash = nes_movie::hash(system);
+
+        // Same jobs on different threads should end up exactly the same
+        vector<nes_batch_job> jobs(16);
+        for (size_t i = 0; i < jobs.size(); ++i)
+        {
+            jobs[i].rom_path = rom;
+            if (i % 2)
+            {
+                jobs[i].movie_path = "neschan.system.batch.nesm";
+            }
+            else
+            {
+                jobs[i].frame_count = 40;
+                jobs[i].keep_frame_buffer = true;
+                jobs[i].on_frame = [](nes_system &system, uint32_t frame) {
+                    if (frame == 0)
+                        system.input()->register_input(0, make_shared<test_input_device>());
+                };
+            }
+        }
+        jobs.push_back(nes_batch_job());
+        jobs.back().rom_path = "./roms/does_not_exist.nes";
+
+        nes_batch_runner runner(4);
+        auto results = runner.run(jobs);
+        REQUIRE(results.size() == jobs.size());
+        for (size_t i = 0; i < jobs.size() - 1; ++i)
+        {
+            CHECK(results[i].success);
+            if (i % 2)
+            {
+                CHECK(results[i].frames_run == 60);
+                CHECK(results[i].hash == movie_hash);
+            }
+            else
+            {
+                CHECK(results[i].frames_run == 40);
+                CHECK(results[i].hash == results[0].hash);
+                CHECK(results[i].frame_buffer == results[0].frame_buffer);
+            }
+        }
+        CHECK(!results.back().success);
+        CHECK(!results.back().error.empty());
+        CHECK(runner.summary().job_count == jobs.size());
+        CHECK(runner.summary().failed_count == 1);
+        CHECK(runner.summary().frame_count == 8 * 60 + 8 * 40);
+    }
+    SUBCASE("rewind") {
+        INIT_TRACE("neschan.system.rewind.log");
+        cout << "Running [SYSTEM][rewind]..." << endl;
+
+        system.power_on();
+        system.load_rom("./roms/instr_test-v5/official_only.nes", nes_rom_exec_mode_reset);
+
+        // Plenty of room - every snapshot is kept
+        nes_rewind rewind(0x100000, 600, 8);
+        vector<vector<uint8_t>> states(40);
+        for (auto &state : states)
+        {
+            CHECK(rewind.push(system));
+            system.save_state(state);
+            system.run_frame();
+        }
+        CHECK(rewind.frame_count() == 40);
+        CHECK(rewind.used_size() < states[0].size() * 10);
+
+        vector<uint8_t> state;
+        CHECK(rewind.rewind(system, 5));        // delta
+        system.save_state(state);
+        CHECK(state == states[35]);
+        CHECK(rewind.rewind(system, 3));        // keyframe
+        system.save_state(state);
+        CHECK(state == states[32]);
+
+        // Continue from there and go back again
+        system.run_frame();
+        CHECK(rewind.push(system));
+        CHECK(rewind.push(system));
+        CHECK(rewind.rewind(system, 3));
+        system.save_state(state);
+        CHECK(state == states[31]);
+        CHECK(!rewind.rewind(system, 100));
+
+        // Small buffer - oldest snapshots get dropped as it wraps around
+        nes_rewind small_rewind(0x4000, 600, 4);
+        for (int i = 0; i < 100; ++i)
+        {
+            CHECK(small_rewind.push(system));
+            system.save_state(states[i % states.size()]);
+            system.run_frame();
+        }
+        uint32_t count = small_rewind.frame_count();
+        CHECK(count > 0);
+        CHECK(count < 100);
+        CHECK(small_rewind.used_size() <= 0x4000);
+        CHECK(small_rewind.rewind(system, count));
+        system.save_state(state);
+        CHECK(state == states[(100 - count) % states.size()]);
+    }
+#if NES_TRACE_MAX_LEVEL >= 4
+    SUBCASE("trace_ring") {
+        INIT_TRACE("neschan.system.trace_ring.log");
+        cout << "Running [SYSTEM][trace_ring]..." << endl;
+
+        const char *rom = "./roms/color_test/color_test.nes";
+        system.power_on();
+        system.load_rom(rom, nes_rom_exec_mode_reset);
+
+        // Flight recorder - only the last 1000 (rounded up to 1024) records are kept
+        system.enable_trace_ring(1000);
+        auto trace = system.trace_ring();
+        system.run_frame();
+        system.run_frame();
+        CHECK(trace->total_count() > 1024);
+        CHECK(trace->size() == 1024);
+
+        vector<nes_trace_record> records(2048);
+        size_t count = trace->read(records.data(), records.size());
+        CHECK(count == 1024);
+        CHECK(trace->size() == 0);
+
+        int instruction_count = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (records[i].type == nes_trace_event_instruction)
+                instruction_count++;
+        }
+        CHECK(instruction_count > 0);
+
+        // Same layout as the text tracer
+        nes_trace_record rec = {};
+        rec.type = nes_trace_event_instruction;
+        rec.cycle = 341 * 2 + 7;
+        rec.pc = 0xc000;
+        rec.op_code = 0x4c;
+        rec.operand[0] = 0xf5;
+        rec.operand[1] = 0xc5;
+        rec.p = 0x24;
+        rec.s = 0xfd;
+        string str;
+        nes_trace_ring::format(str, rec);
+        CHECK(str == "C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:  7");
+
+        // Streaming loses nothing and matches a dump of the same run
+        nes_system stream_system;
+        stream_system.power_on();
+        stream_system.load_rom(rom, nes_rom_exec_mode_reset);
+        stream_system.enable_trace_ring(256);
+        CHECK(stream_system.trace_ring()->start_streaming("neschan.system.trace_ring.stream.txt"));
+
+        nes_system dump_system;
+        dump_system.power_on();
+        dump_system.load_rom(rom, nes_rom_exec_mode_reset);
+        dump_system.enable_trace_ring(0x100000);
+
+        for (int i = 0; i < 3; ++i)
+        {
+            stream_system.run_frame();
+            dump_system.run_frame();
+        }
+        stream_system.trace_ring()->stop_streaming();
+        CHECK(stream_system.trace_ring()->total_count() == dump_system.trace_ring()->total_count());
+        CHECK(dump_system.trace_ring()->dump("neschan.system.trace_ring.dump.txt"));
+
+        ifstream stream_file("neschan.system.trace_ring.stream.txt");
+        ifstream dump_file("neschan.system.trace_ring.dump.txt");
+        string stream_text((istreambuf_iterator<char>(stream_file)), istreambuf_iterator<char>());
+        string dump_text((istreambuf_iterator<char>(dump_file)), istreambuf_iterator<char>());
+        CHECK(!stream_text.empty());
+        CHECK(stream_text == dump_text);
+
+        system.disable_trace_ring();
+        CHECK(system.trace_ring() == nullptr);
+    }
+#endif
+    SUBCASE("triple_buffer") {
+        INIT_TRACE("neschan.system.triple_buffer.log");
+        cout << "Running [SYSTEM][triple_buffer]..." << endl;
+
+        const size_t frame_size = PPU_SCREEN_X * PPU_SCREEN_Y * sizeof(uint32_t);
+        nes_triple_buffer frames(frame_size);
+        CHECK(!frames.acquire());
+
+        // Producer fills each frame with its sequence - consumer must never see a partially written frame
+        const uint64_t frame_count = 2000;
+        thread producer([&]() {
+            for (uint64_t i = 1; i <= frame_count; ++i)
+            {
+                memset(frames.back(), uint8_t(i), frame_size);
+                frames.publish(i);
+            }
+        });
+
+        uint64_t last_sequence = 0;
+        int torn_count = 0;
+        int acquire_count = 0;
+        while (last_sequence < frame_count)
+        {
+            if (!frames.acquire())
+            {
+                this_thread::yield();
+                continue;
+            }
+
+            acquire_count++;
+            uint64_t sequence = frames.front_sequence();
+            CHECK(sequence > last_sequence);
+            last_sequence = sequence;
+
+            const uint8_t *front = frames.front();
+            for (size_t i = 0; i < frame_size; ++i)
+            {
+                if (front[i] != uint8_t(sequence))
+                {
+                    torn_count++;
+                    break;
+                }
+            }
+        }
+        producer.join();
+
+        CHECK(torn_count == 0);
+        CHECK(acquire_count > 0);
+        CHECK(!frames.acquire());
+
+        // PPU renders straight into the back frame
+        system.power_on();
+        system.load_rom("./roms/color_test/color_test.nes", nes_rom_exec_mode_reset);
+        for (int i = 0; i < 3; ++i)
+        {
+            system.ppu()->set_output(frames.back(), PPU_SCREEN_X * sizeof(uint32_t), nes_pixel_format_argb8888);
+            system.run_frame();
+            frames.publish(system.ppu()->frame_count());
+        }
+        system.ppu()->set_output(nullptr, 0, nes_pixel_format_argb8888);
+        CHECK(frames.acquire());
+        CHECK(frames.front_sequence() == system.ppu()->frame_count());
+
+        auto pixels = reinterpret_cast<const uint32_t *>(frames.front());
+        uint8_t *frame_buffer = system.ppu()->frame_buffer();
+        int mismatch = 0;
+        for (int i = 0; i < PPU_SCREEN_X * PPU_SCREEN_Y; ++i)
+        {
+            if (pixels[i] != (0xff000000 | nes_ppu::s_default_palette[frame_buffer[i] & 0x3f]))
+                mismatch++;
+        }
+        CHECK(mismatch == 0);
+    }
+    SUBCASE("frame_pacer") {
+        INIT_TRACE("neschan.system.frame_pacer.log");
+        cout << "Running [SYSTEM][frame_pacer]..." << endl;
+
+        CHECK(NES_NTSC_FRAME_RATE > 60.098);
+        CHECK(NES_NTSC_FRAME_RATE < 60.099);
+
+        // Clock that moves forward a bit every time the pacer looks at it, like an audio device consuming samples
+        double clock = 0;
+        nes_frame_pacer pacer(100);
+        pacer.set_clock([&]() { clock += 0.0005; return clock; });
+
+        pacer.wait_frame();                     // first frame is due right away
+        double start = clock;
+        for (int i = 0; i < 10; ++i)
+            pacer.wait_frame();
+        CHECK(clock >= start + 0.1);
+        CHECK(clock < start + 0.1 + 0.001);
+
+        // Running late by a little catches up - frames are due right away
+        clock += 0.025;
+        double late = clock;
+        pacer.wait_frame();
+        pacer.wait_frame();
+        CHECK(clock < late + 0.002);
+        CHECK(pacer.late_count() == 0);
+
+        // Stalling for a long time starts over instead of running a burst of frames
+        clock += 1;
+        late = clock;
+        pacer.wait_frame();
+        CHECK(pacer.late_count() == 1);
+        pacer.wait_frame();
+        CHECK(clock >= late + 0.01);
+        CHECK(pacer.frame_count() == 15);
+
+        // Host clock
+        nes_frame_pacer host_pacer(1000);
+        auto host_start = steady_clock::now();
+        for (int i = 0; i <= 20; ++i)
+            host_pacer.wait_frame();
+        CHECK(steady_clock::now() - host_start >= milliseconds(20));
+    }
+}